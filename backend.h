@@ -1,6 +1,7 @@
 #ifndef SANDBOX_FS_BACKEND_H
 #define SANDBOX_FS_BACKEND_H
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <functional>
@@ -9,7 +10,25 @@
 #include "byte_buffer.h"
 
 struct Backend {
-    virtual void foreach(std::function<void (std::string path, struct stat stat, ByteBuffer data)> &&func) const = 0;
+    virtual ~Backend() = default;
+
+protected:
+    /* fraction of the archive consumed so far, compressed archives decode to more bytes than they take */
+    mutable std::atomic<double> done {0.0};
+
+public:
+    [[nodiscard]] double progress() const { return done.load(std::memory_order_relaxed); }
+
+public:
+    virtual void       foreach(std::function<void (std::string path, struct stat stat, ByteBuffer data)> &&func) const = 0;
+    virtual void       scan(std::function<void (std::string path, struct stat stat, size_t index)> &&func) const = 0;
+    virtual ByteBuffer fetch(size_t index) const = 0;
+
+public:
+    /* same as foreach, but may invoke the callback concurrently from up to `jobs` threads */
+    virtual void parallel(std::function<void (std::string path, struct stat stat, ByteBuffer data)> &&func, size_t jobs) const {
+        foreach(std::move(func));
+    }
 };
 
 #endif /* SANDBOX_FS_BACKEND_H */
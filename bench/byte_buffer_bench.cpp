@@ -0,0 +1,90 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <random>
+#include <iostream>
+#include <gflags/gflags.h>
+#include <folly/init/Init.h>
+
+#include "timer.h"
+#include "byte_buffer.h"
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "cert-err58-cpp"
+
+DEFINE_uint64(size, 64ul << 20, "Size of the shared buffer in bytes");
+DEFINE_uint64(chunk, 131072, "Bytes per read, FUSE reads at most 128 KiB at once");
+DEFINE_uint32(threads, std::thread::hardware_concurrency(), "Maximum number of reader threads");
+DEFINE_uint32(seconds, 2, "Duration of each round in seconds");
+DEFINE_bool(writer, false, "Keep a writer replacing pages while reading");
+DEFINE_bool(scatter, false, "Read with scatter() instead of copying with read()");
+
+#pragma clang diagnostic pop
+
+static double measure(ByteBuffer &buf, size_t nth) {
+    std::atomic_bool         stop(false);
+    std::atomic_uint64_t     total(0);
+    std::vector<std::thread> threads;
+
+    /* readers hit random offsets of the same buffer */
+    for (size_t i = 0; i < nth; i++) {
+        threads.emplace_back([&, i] {
+            uint64_t          nb = 0;
+            std::mt19937_64   rng(i);
+            std::vector<char> mem(FLAGS_chunk);
+
+            /* read until told to stop */
+            while (!stop.load(std::memory_order_relaxed)) {
+                auto off = rng() % (FLAGS_size - FLAGS_chunk);
+                if (!FLAGS_scatter) {
+                    nb += buf.read(mem.data(), FLAGS_chunk, off);
+                } else {
+                    nb += buf.scatter(FLAGS_chunk, off, [&](const char *p, size_t len, int, off_t) { mem[0] ^= p[len - 1]; });
+                }
+            }
+
+            /* report the bytes read */
+            total += nb;
+        });
+    }
+
+    /* the writer keeps the pages changing, so that old ones must be reclaimed */
+    if (FLAGS_writer) {
+        threads.emplace_back([&] {
+            std::mt19937_64 rng(nth);
+            for (char val = 0; !stop.load(std::memory_order_relaxed); val++) {
+                buf.write(&val, 1, rng() % FLAGS_size);
+            }
+        });
+    }
+
+    /* let them run for a while */
+    auto now = T::now();
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_seconds));
+    stop = true;
+
+    /* wait for every thread */
+    for (auto &th : threads) {
+        th.join();
+    }
+
+    /* throughput in MiB/s */
+    return total.load() / ((T::now() - now) * 1e-9) / 1048576.0;
+}
+
+int main(int argc, char **argv) {
+    ByteBuffer        buf;
+    folly::Init       init(&argc, &argv);
+    std::vector<char> mem(FLAGS_size);
+
+    /* fill the buffer with something other than zeros */
+    for (size_t i = 0; i < mem.size(); i++) mem[i] = static_cast<char>(i * 131);
+    buf.write(mem.data(), mem.size(), 0);
+
+    /* double the readers every round */
+    for (size_t nth = 1; nth <= FLAGS_threads; nth *= 2) {
+        auto bw = measure(buf, nth);
+        std::cout << nth << " threads: " << static_cast<uint64_t>(bw) << " MiB/s, " << static_cast<uint64_t>(bw / nth) << " MiB/s per thread" << std::endl;
+    }
+    return 0;
+}
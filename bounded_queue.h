@@ -0,0 +1,62 @@
+#ifndef SANDBOX_FS_BOUNDED_QUEUE_H
+#define SANDBOX_FS_BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template <typename T>
+class BoundedQueue {
+    bool                    _done;
+    size_t                  _size;
+    std::mutex              _mutex;
+    std::deque<T>           _items;
+    std::condition_variable _empty;
+    std::condition_variable _full;
+
+public:
+    explicit BoundedQueue(size_t size) : _done(false), _size(size) {}
+
+public:
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _full.wait(lock, [this] { return _done || _items.size() < _size; });
+
+        /* consumers are gone */
+        if (_done) {
+            return false;
+        }
+
+        /* add to queue */
+        _items.emplace_back(std::move(item));
+        _empty.notify_one();
+        return true;
+    }
+
+public:
+    bool pop(T *item) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _empty.wait(lock, [this] { return _done || !_items.empty(); });
+
+        /* closed and drained */
+        if (_items.empty()) {
+            return false;
+        }
+
+        /* remove from queue */
+        *item = std::move(_items.front());
+        _items.pop_front();
+        _full.notify_one();
+        return true;
+    }
+
+public:
+    void close() {
+        std::lock_guard<std::mutex> _(_mutex);
+        _done = true;
+        _full.notify_all();
+        _empty.notify_all();
+    }
+};
+
+#endif /* SANDBOX_FS_BOUNDED_QUEUE_H */
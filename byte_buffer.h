@@ -1,21 +1,148 @@
 #ifndef SANDBOX_FS_BYTE_BUFFER_H
 #define SANDBOX_FS_BYTE_BUFFER_H
 
+#include <mutex>
 #include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <utility>
-#include <folly/Synchronized.h>
+#include <functional>
+#include <shared_mutex>
+#include <sys/types.h>
+#include <folly/synchronization/Rcu.h>
 
+#include "range_lock.h"
+
+/* readers never lock, they load the storage inside an RCU read section, and everything
+ * a reader might still be looking at is retired through RCU instead of being deleted,
+ * writers share a lock and only exclude each other on the pages they touch, while
+ * detaching, growing the page table or truncating holds it exclusively, the locks
+ * are striped across every buffer to keep the buffer itself small */
 class ByteBuffer {
+public:
+    static constexpr size_t PageBits = 16;
+    static constexpr size_t PageSize = 1ul << PageBits;
+    static constexpr size_t PageMask = PageSize - 1;
+
+public:
+    struct Extent {
+        const char *                mem;
+        int                         fd;
+        off_t                       pos;
+        std::shared_ptr<const void> owner;
+    };
+
+public:
+    typedef std::function<size_t(char *buf, size_t len)> Filler;
+    typedef std::function<Extent(const char *mem, size_t len)> Spiller;
+
+private:
+    struct Page final {
+        std::atomic_int64_t         ref = 1;
+        char *                      mem = nullptr;
+        size_t                      cap = 0;
+        int                         fd  = -1;
+        off_t                       pos = 0;
+        std::shared_ptr<const void> pin = nullptr;
+
+    private:
+        ~Page() noexcept {
+            if (pin == nullptr) {
+                free(mem);
+                allocated() -= cap;
+            }
+        }
+
+    public:
+        Page(Page &&)      = delete;
+        Page(const Page &) = delete;
+
+    public:
+        explicit Page(size_t size) noexcept : ref(1), mem(static_cast<char *>(calloc(1, size))), cap(size) {
+            allocated() += cap;
+        }
+
+    public:
+        explicit Page(const Page *src, size_t size) noexcept : ref(1), mem(static_cast<char *>(malloc(size))), cap(size) {
+            memcpy(mem, src->mem, std::min(size, src->cap));
+            memset(mem + std::min(size, src->cap), 0, size - std::min(size, src->cap));
+            allocated() += cap;
+        }
+
+    public:
+        explicit Page(const char *src, size_t size, std::shared_ptr<const void> owner, int fd, off_t pos) noexcept :
+            mem (const_cast<char *>(src)),
+            cap (size),
+            fd  (fd),
+            pos (pos),
+            pin (std::move(owner)) {}
+
+    public:
+        Page &operator=(Page &&)      = delete;
+        Page &operator=(const Page &) = delete;
+
+    public:
+        [[nodiscard]] inline bool shared() const noexcept {
+            return ref != 1 || pin != nullptr;
+        }
+
+    public:
+        inline Page *retain() noexcept {
+            ref++;
+            return this;
+        }
+
+    public:
+        inline bool acquire() noexcept {
+            for (auto n = ref.load(); n != 0;) {
+                if (ref.compare_exchange_weak(n, n + 1)) {
+                    return true;
+                }
+            }
+
+            /* the page is being retired */
+            return false;
+        }
+
+    public:
+        inline size_t read(char *buf, size_t size, size_t start) const noexcept {
+            if (cap <= start) {
+                memset(buf, 0, size);
+            } else if (cap >= start + size) {
+                memcpy(buf, mem + start, size);
+            } else {
+                memcpy(buf, mem + start, cap - start);
+                memset(buf + cap - start, 0, size - cap + start);
+            }
+            return size;
+        }
+
+    public:
+        static inline void release(Page *p) noexcept {
+            if (p != nullptr && --p->ref == 0) {
+                folly::rcu_retire(p, [](Page *v) { delete v; });
+            }
+        }
+    };
+
+private:
+    typedef std::unique_ptr<std::atomic<Page *>[]> PageTable;
+
+private:
     struct Storage final {
         std::atomic_int64_t ref = 1;
-        char *              mem = nullptr;
-        size_t              len = 0;
+        std::atomic_size_t  len = 0;
         size_t              cap = 0;
+        PageTable           pages;
 
     private:
         ~Storage() noexcept {
-            free(mem);
+            for (size_t i = 0; i < cap; i++) {
+                Page::release(pages[i].load(std::memory_order_relaxed));
+            }
         }
 
     public:
@@ -24,23 +151,32 @@ class ByteBuffer {
         Storage(const Storage &) = delete;
 
     public:
-        explicit Storage(Storage *src) noexcept : ref(1), mem(static_cast<char *>(malloc(src->len))), cap(src->len), len(src->len) {
-            memcpy(mem, src->mem, len);
-            release(src);
+        explicit Storage(size_t size) noexcept : ref(1), len(0), cap(size), pages(new std::atomic<Page *>[size]()) {}
+        explicit Storage(const Storage *src, size_t size) noexcept : Storage(std::max(size, src->cap)) {
+            len.store(src->len.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            for (size_t i = 0; i < src->cap; i++) {
+                if (auto *p = src->pages[i].load(std::memory_order_relaxed)) {
+                    pages[i].store(p->retain(), std::memory_order_relaxed);
+                }
+            }
         }
 
     public:
-        Storage &operator=(Storage &&)      = delete;
-        Storage &operator=(const Storage &) = delete;
-
-    public:
-        inline void ensure(size_t size) noexcept {
-            if (cap < size) {
-                cap = (((size - 1) >> 4) + 1) << 4;
-                mem = static_cast<char *>(realloc(mem, cap));
+        explicit Storage(const char *src, size_t size, const std::shared_ptr<const void> &owner, int fd, off_t pos) noexcept :
+            Storage((size + PageMask) >> PageBits)
+        {
+            for (size_t i = 0; i < size; i += PageSize) {
+                pages[i >> PageBits].store(new Page(src + i, std::min(PageSize, size - i), owner, fd, fd < 0 ? 0 : pos + i), std::memory_order_relaxed);
             }
+
+            /* set the length */
+            len.store(size, std::memory_order_relaxed);
         }
 
+    public:
+        Storage &operator=(Storage &&)      = delete;
+        Storage &operator=(const Storage &) = delete;
+
     public:
         inline Storage *retain() noexcept {
             ref++;
@@ -48,114 +184,626 @@ class ByteBuffer {
         }
 
     public:
-        inline void zfill(size_t size) noexcept {
-            if (len < size) {
-                ensure(size);
-                memset(mem + len, 0, size - len);
+        [[nodiscard]] inline Page *at(size_t idx) const noexcept {
+            return idx < cap ? pages[idx].load(std::memory_order_acquire) : nullptr;
+        }
+
+    public:
+        inline void set(size_t idx, Page *p) noexcept {
+            Page *q = pages[idx].load(std::memory_order_relaxed);
+            pages[idx].store(p, std::memory_order_release);
+            Page::release(q);
+        }
+
+    public:
+        inline Page *page(size_t idx, size_t size) noexcept {
+            Page * q = pages[idx].load(std::memory_order_relaxed);
+            size_t n = capacity(idx, q == nullptr ? 0 : q->cap, size);
+
+            /* unshared pages large enough are written in place */
+            if (q != nullptr && !q->shared() && q->cap >= n) {
+                return q;
             }
+
+            /* holes are read as zeros, allocate on first write only, other pages are copied
+             * on write, or moved to a larger page, as readers might be looking at the old one */
+            auto *p = q == nullptr ? new Page(n) : new Page(q, n);
+            set(idx, p);
+            return p;
         }
 
     public:
         inline void resize(size_t size) noexcept {
-            zfill(size);
-            len = size;
+            size_t np = (size + PageMask) >> PageBits;
+            size_t tail = size & PageMask;
+            size_t old = len.load(std::memory_order_relaxed);
+
+            /* drop pages beyond the new size, new pages are holes */
+            for (size_t i = np; i < cap; i++) {
+                if (pages[i].load(std::memory_order_relaxed) != nullptr) {
+                    set(i, nullptr);
+                }
+            }
+
+            /* data beyond the end of file must read as zeros if the file grows again */
+            if (size < old && tail != 0 && at(np - 1) != nullptr && at(np - 1)->cap > tail) {
+                auto *p = page(np - 1, tail);
+                memset(p->mem + tail, 0, p->cap - tail);
+            }
+
+            /* update the length */
+            len.store(size, std::memory_order_release);
         }
 
     public:
         inline size_t read(char *buf, size_t size, size_t start) const noexcept {
-            if (len <= start) {
+            size_t end = len.load(std::memory_order_acquire);
+
+            /* check for EOF */
+            if (end <= start) {
                 return 0;
-            } else {
-                memcpy(buf, mem + start, (size = std::min(size, len - start)));
-                return size;
             }
+
+            /* copy page by page */
+            size_t rem = size = std::min(size, end - start);
+            size_t pos = start;
+
+            /* holes read as zeros */
+            while (rem != 0) {
+                auto *p  = at(pos >> PageBits);
+                auto off = pos & PageMask;
+                auto cnt = std::min(rem, PageSize - off);
+
+                /* copy the data */
+                if (p == nullptr) {
+                    memset(buf, 0, cnt);
+                } else {
+                    p->read(buf, cnt, off);
+                }
+
+                /* move to next page */
+                buf += cnt;
+                pos += cnt;
+                rem -= cnt;
+            }
+
+            /* all done */
+            return size;
         }
 
     public:
-        inline size_t write(const void *data, size_t size, size_t start) noexcept {
-            ensure(size + start);
-            memcpy(mem + start, data, size);
-            len = std::max(len, size + start);
+        inline size_t pin(size_t size, size_t start, std::vector<Page *> *out) const noexcept {
+            size_t end = len.load(std::memory_order_acquire);
+
+            /* check for EOF */
+            if (end <= start || size == 0) {
+                return 0;
+            }
+
+            /* clamp the range */
+            size = std::min(size, end - start);
+            out->reserve(((start + size - 1) >> PageBits) - (start >> PageBits) + 1);
+
+            /* a page that drops it's last reference has already been replaced in the table,
+             * so loading the slot again finds the replacement */
+            for (size_t i = start >> PageBits; i <= (start + size - 1) >> PageBits; i++) {
+                for (;;) {
+                    auto *p = at(i);
+                    if (p == nullptr || p->acquire()) {
+                        out->push_back(p);
+                        break;
+                    }
+                }
+            }
+
+            /* all done */
             return size;
         }
 
+    public:
+        template <typename F>
+        static inline void scatter(const std::vector<Page *> &pages, size_t size, size_t start, F &&fn) {
+            size_t rem = size;
+            size_t pos = start;
+            size_t idx = 0;
+
+            /* holes and the unallocated tail of a page are served from the zero page,
+             * pages borrowed from a file also tell where they are within that file */
+            while (rem != 0) {
+                auto *p  = pages[idx++];
+                auto off = pos & PageMask;
+                auto cnt = std::min(rem, PageSize - off);
+
+                /* hand out the memory in place */
+                if (p == nullptr || p->cap <= off) {
+                    fn(zeros(), cnt, -1, 0);
+                } else if (p->cap >= off + cnt) {
+                    fn(p->mem + off, cnt, p->fd, p->pos + off);
+                } else {
+                    fn(p->mem + off, p->cap - off, p->fd, p->pos + off);
+                    fn(zeros(), cnt - p->cap + off, -1, 0);
+                }
+
+                /* move to next page */
+                pos += cnt;
+                rem -= cnt;
+            }
+        }
+
+    public:
+        template <typename F>
+        inline size_t fill(size_t size, size_t start, F &&fn) {
+            size_t pos = start;
+            size_t end = start + size;
+
+            /* fill page by page, until the source runs dry, the page table is
+             * always large enough at this point, and existing pages never move */
+            while (pos < end) {
+                auto off = pos & PageMask;
+                auto cnt = std::min(end - pos, PageSize - off);
+                auto ret = fn(page(pos >> PageBits, off + cnt)->mem + off, cnt);
+
+                /* move to next page */
+                pos += ret;
+                if (ret != cnt) break;
+            }
+
+            /* update the length, pages beyond it are still holes if the source ran dry,
+             * other writers might be extending the file at the same time */
+            for (size_t n = len.load(std::memory_order_relaxed); n < pos;) {
+                if (len.compare_exchange_weak(n, pos, std::memory_order_release, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+
+            /* all done */
+            return pos - start;
+        }
+
+    public:
+        inline size_t write(const void *data, size_t size, size_t start) noexcept {
+            auto src = static_cast<const char *>(data);
+            auto ret = fill(size, start, [&](char *buf, size_t cnt) {
+                memcpy(buf, src, cnt);
+                src += cnt;
+                return cnt;
+            });
+
+            /* memory copies never fall short */
+            return ret;
+        }
+
+    public:
+        inline size_t spill(const Spiller &fn) {
+            size_t ret = 0;
+
+            /* move every owned page out, they are borrowed from the spill file afterwards */
+            for (size_t i = 0; i < cap; i++) {
+                auto *p = pages[i].load(std::memory_order_relaxed);
+
+                /* only owned pages can be spilled */
+                if (p == nullptr || p->pin != nullptr) {
+                    continue;
+                }
+
+                /* the memory is freed once every storage sharing the page lets go */
+                auto ext = fn(p->mem, p->cap);
+                ret += p->cap;
+                set(i, new Page(ext.mem, p->cap, std::move(ext.owner), ext.fd, ext.pos));
+            }
+
+            /* all done */
+            return ret;
+        }
+
+    public:
+        [[nodiscard]] inline size_t resident() const noexcept {
+            size_t ret = 0;
+            for (size_t i = 0; i < cap; i++) if (auto *p = at(i)) ret += p->pin == nullptr ? p->cap : 0;
+            return ret;
+        }
+
+    public:
+        [[nodiscard]] inline bool borrowed() const noexcept {
+            for (size_t i = 0; i < cap; i++) if (auto *p = at(i)) if (p->pin != nullptr) return true;
+            return false;
+        }
+
+    public:
+        [[nodiscard]] inline bool equals(const Storage *other) const noexcept {
+            size_t size = len.load(std::memory_order_acquire);
+
+            /* check for the length */
+            if (this == other) {
+                return true;
+            } else if (size != other->len.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            /* compare page by page, identical pages are skipped */
+            for (size_t i = 0; i < (size + PageMask) >> PageBits; i++) {
+                if (at(i) != other->at(i) && !same(at(i), other->at(i), std::min(PageSize, size - (i << PageBits)))) {
+                    return false;
+                }
+            }
+
+            /* all done */
+            return true;
+        }
+
+    private:
+        static inline const char *zeros() noexcept {
+            static const char buf[PageSize] = {};
+            return buf;
+        }
+
+    private:
+        static inline bool same(const Page *a, const Page *b, size_t size) noexcept {
+            size_t na = a == nullptr ? 0 : std::min(a->cap, size);
+            size_t nb = b == nullptr ? 0 : std::min(b->cap, size);
+            size_t nm = std::min(na, nb);
+
+            /* compare the common part */
+            if (nm != 0 && memcmp(a->mem, b->mem, nm) != 0) {
+                return false;
+            }
+
+            /* holes and unallocated tails read as zeros */
+            if (na > nm) {
+                return memcmp(a->mem + nm, zeros(), na - nm) == 0;
+            } else if (nb > nm) {
+                return memcmp(b->mem + nm, zeros(), nb - nm) == 0;
+            } else {
+                return true;
+            }
+        }
+
+    private:
+        static inline size_t capacity(size_t idx, size_t cap, size_t size) noexcept {
+            if (idx != 0) {
+                return PageSize;
+            } else if (cap >= size) {
+                return cap;
+            } else {
+                return std::min(PageSize, std::max(size, cap * 2));
+            }
+        }
+
     public:
         static inline void release(Storage *p) noexcept {
             if (p != nullptr && --p->ref == 0) {
-                delete p;
+                folly::rcu_retire(p, [](Storage *v) { delete v; });
             }
         }
     };
 
 private:
-    folly::Synchronized<Storage *> _buf;
+    struct Writer {
+        ByteBuffer *buf;
+
+    public:
+       ~Writer() { buf->_writing--; }
+        explicit Writer(ByteBuffer *buf) : buf(buf) { buf->_writing++; }
+    };
+
+private:
+    typedef std::shared_lock<std::shared_mutex> SharedLock;
+    typedef std::unique_lock<std::shared_mutex> UniqueLock;
+
+private:
+    static constexpr size_t StripeBits = 8;
+    static constexpr size_t Stripes    = 1ul << StripeBits;
+
+private:
+    /* most buffers are never written after loading, so the locks live in a global table
+     * keyed by the buffer address instead of in every buffer, buffers sharing a stripe
+     * only contend when one of them detaches, grows or truncates */
+    struct alignas(64) Stripe {
+        std::shared_mutex lock;
+        RangeLock         pages;
+    };
+
+private:
+    struct Exclusive {
+        UniqueLock a;
+        UniqueLock b;
+
+    public:
+        Exclusive(const ByteBuffer *x, const ByteBuffer *y) {
+            auto *p = &x->sync();
+            auto *q = &y->sync();
+
+            /* lock in address order, buffers on the same stripe only lock it once */
+            if (p > q) std::swap(p, q);
+            a = UniqueLock(p->lock);
+            if (p != q) b = UniqueLock(q->lock);
+        }
+    };
+
+public:
+    /* a range of pages held by a reader, they stay alive and unmodified until released, writers copy them instead,
+     * so holding a few pages never costs writers more than copying those pages */
+    class Pinned {
+        size_t              _size;
+        size_t              _start;
+        std::vector<Page *> _pages;
+
+    private:
+        friend class ByteBuffer;
+
+    public:
+       ~Pinned() { release(); }
+        Pinned() : _size(0), _start(0) {}
+
+    public:
+        Pinned(Pinned &&)      = delete;
+        Pinned(const Pinned &) = delete;
+
+    public:
+        Pinned &operator=(Pinned &&)      = delete;
+        Pinned &operator=(const Pinned &) = delete;
+
+    public:
+        [[nodiscard]] size_t len() const noexcept { return _size; }
+
+    public:
+        template <typename F>
+        void scatter(F &&fn) const {
+            Storage::scatter(_pages, _size, _start, std::forward<F>(fn));
+        }
+
+    public:
+        void release() noexcept {
+            for (auto *p : _pages) Page::release(p);
+            _pages.clear();
+            _size = 0;
+        }
+    };
+
+private:
+    std::atomic_int        _writing;
+    std::atomic<Storage *> _buf;
 
 public:
     ~ByteBuffer() noexcept {
-        Storage::release(_buf.unsafeGetUnlocked());
+        Storage::release(_buf.load(std::memory_order_relaxed));
     }
 
 public:
-    ByteBuffer() : _buf(nullptr) {}
+    ByteBuffer() : _writing(0), _buf(nullptr) {}
     ByteBuffer(const ByteBuffer &) noexcept = delete;
-    ByteBuffer(ByteBuffer &&other) noexcept : ByteBuffer() { _buf.swap(other._buf); }
+
+public:
+    ByteBuffer(ByteBuffer &&other) noexcept : _writing(0), _buf(nullptr) {
+        UniqueLock _(other.sync().lock);
+        _buf.store(other._buf.exchange(nullptr, std::memory_order_acq_rel), std::memory_order_release);
+    }
 
 private:
-    explicit ByteBuffer(Storage *buf) noexcept : _buf(buf) {}
+    explicit ByteBuffer(Storage *buf) noexcept : _writing(0), _buf(buf) {}
 
 public:
     ByteBuffer &operator=(const ByteBuffer &) noexcept = delete;
-    ByteBuffer &operator=(ByteBuffer &&other) noexcept { _buf.swap(other._buf); return *this; }
+    ByteBuffer &operator=(ByteBuffer &&other) noexcept {
+        if (this != &other) {
+            Exclusive _(this, &other);
+            auto *buf = _buf.load(std::memory_order_relaxed);
+            _buf.store(other._buf.load(std::memory_order_relaxed), std::memory_order_release);
+            other._buf.store(buf, std::memory_order_release);
+        }
+        return *this;
+    }
 
 public:
     [[nodiscard]] size_t len() const noexcept {
-        auto rbuf = _buf.rlock();
-        return *rbuf == nullptr ? 0 : (*rbuf)->len;
+        folly::rcu_reader _;
+        auto *buf = _buf.load(std::memory_order_acquire);
+        return buf == nullptr ? 0 : buf->len.load(std::memory_order_acquire);
+    }
+
+public:
+    [[nodiscard]] const void *id() const noexcept {
+        return _buf.load(std::memory_order_acquire);
+    }
+
+public:
+    [[nodiscard]] size_t resident() const noexcept {
+        folly::rcu_reader _;
+        auto *buf = _buf.load(std::memory_order_acquire);
+        return buf == nullptr ? 0 : buf->resident();
+    }
+
+public:
+    [[nodiscard]] bool unique() const noexcept {
+        folly::rcu_reader _;
+        auto *buf = _buf.load(std::memory_order_acquire);
+        return buf == nullptr || buf->ref == 1;
+    }
+
+public:
+    [[nodiscard]] bool borrowed() const noexcept {
+        folly::rcu_reader _;
+        auto *buf = _buf.load(std::memory_order_acquire);
+        return buf != nullptr && buf->borrowed();
+    }
+
+public:
+    [[nodiscard]] bool equals(const ByteBuffer &other) const noexcept {
+        folly::rcu_reader _;
+        auto *buf = _buf.load(std::memory_order_acquire);
+        auto *obf = other._buf.load(std::memory_order_acquire);
+
+        /* empty buffers have no storage */
+        if (buf == nullptr || obf == nullptr) {
+            return (buf == nullptr ? 0 : buf->len.load()) == (obf == nullptr ? 0 : obf->len.load());
+        } else {
+            return buf->equals(obf);
+        }
     }
 
 public:
     [[nodiscard]] ByteBuffer clone() const noexcept {
-        auto rbuf = _buf.rlock();
-        return *rbuf == nullptr ? ByteBuffer() : ByteBuffer((*rbuf)->retain());
+        Storage *buf;
+
+        /* the storage can not go away within the read section */
+        {
+            folly::rcu_reader _;
+            if ((buf = _buf.load(std::memory_order_acquire)) == nullptr) return ByteBuffer();
+            buf->retain();
+        }
+
+        /* writers modify unshared storage in place, so they must either see the new reference,
+         * or be seen by us, in which case the clone waits for the write to finish */
+        if (_writing.load() != 0) {
+            Storage::release(buf);
+            UniqueLock _(sync().lock);
+            buf = _buf.load(std::memory_order_relaxed);
+            return buf == nullptr ? ByteBuffer() : ByteBuffer(buf->retain());
+        }
+
+        /* all done */
+        return ByteBuffer(buf);
+    }
+
+public:
+    [[nodiscard]] static ByteBuffer wrap(const void *mem, size_t len, std::shared_ptr<const void> owner, int fd = -1, off_t pos = 0) noexcept {
+        return ByteBuffer(new Storage(static_cast<const char *>(mem), len, owner, fd, pos));
     }
 
 public:
     void ensure(size_t size) noexcept {
-        auto wbuf = _buf.wlock();
-        detach(*wbuf)->ensure(size);
+        Writer _(this);
+        UniqueLock lock(sync().lock);
+        writable(size);
     }
 
 public:
     void resize(size_t size) noexcept {
-        auto wbuf = _buf.wlock();
-        detach(*wbuf)->resize(size);
+        Writer _(this);
+        UniqueLock lock(sync().lock);
+        writable(size)->resize(size);
     }
 
 public:
-    size_t read(char *buf, size_t size, size_t start) noexcept {
-        auto rbuf = _buf.rlock();
-        return *rbuf == nullptr ? 0 : (*rbuf)->read(buf, size, start);
+    size_t read(char *buf, size_t size, size_t start) const noexcept {
+        folly::rcu_reader _;
+        auto *sbuf = _buf.load(std::memory_order_acquire);
+        return sbuf == nullptr ? 0 : sbuf->read(buf, size, start);
     }
 
 public:
     size_t write(const void *data, size_t size, size_t start) noexcept {
-        auto wbuf = _buf.wlock();
-        return detach(*wbuf)->write(data, size, start);
+        Writer _(this);
+        auto lock = shared(start + size);
+        RangeLock::Guard range(sync().pages, this, start >> PageBits, (start + size + PageMask) >> PageBits);
+        return _buf.load(std::memory_order_relaxed)->write(data, size, start);
+    }
+
+public:
+    template <typename F>
+    size_t fill(size_t size, size_t start, F &&fn) {
+        Writer _(this);
+        auto lock = shared(start + size);
+        RangeLock::Guard range(sync().pages, this, start >> PageBits, (start + size + PageMask) >> PageBits);
+        return _buf.load(std::memory_order_relaxed)->fill(size, start, std::forward<F>(fn));
+    }
+
+public:
+    size_t spill(const Spiller &fn) {
+        Writer _(this);
+        UniqueLock lock(sync().lock);
+        return _buf.load(std::memory_order_relaxed) == nullptr ? 0 : writable(0)->spill(fn);
+    }
+
+public:
+    bool replace(const void *id, ByteBuffer &&other) noexcept {
+        Exclusive _(this, &other);
+        auto *buf = _buf.load(std::memory_order_relaxed);
+
+        /* the contents might have been changed in the meantime */
+        if (buf != id) {
+            return false;
+        }
+
+        /* readers see either the old or the new storage, the old one is released with `other` */
+        _buf.store(other._buf.load(std::memory_order_relaxed), std::memory_order_release);
+        other._buf.store(buf, std::memory_order_release);
+        return true;
+    }
+
+public:
+    size_t pin(size_t size, size_t start, Pinned *out) const {
+        folly::rcu_reader _;
+        auto *buf = _buf.load(std::memory_order_acquire);
+
+        /* pin the pages within the read section, so that they can be held for as long as needed
+         * afterwards without holding back reclamation, pinned pages are copied on write instead */
+        out->release();
+        out->_start = start;
+        out->_size  = buf == nullptr ? 0 : buf->pin(size, start, &out->_pages);
+        return out->_size;
+    }
+
+public:
+    template <typename F>
+    size_t scatter(size_t size, size_t start, F &&fn) const {
+        Pinned pins;
+
+        /* the callback might block on I/O, the pages are let go of afterwards */
+        pin(size, start, &pins);
+        pins.scatter(std::forward<F>(fn));
+        return pins.len();
+    }
+
+public:
+    static std::atomic_int64_t &allocated() {
+        static std::atomic_int64_t v(0);
+        return v;
+    }
+
+private:
+    [[nodiscard]] inline Stripe &sync() const noexcept {
+        static Stripe stripes[Stripes];
+        return stripes[(reinterpret_cast<uintptr_t>(this) * 0x9e3779b97f4a7c15ull) >> (64 - StripeBits)];
     }
 
 private:
-    inline Storage *detach(Storage *&buf) {
-        unshare(buf);
-        return buf;
+    inline SharedLock shared(size_t size) {
+        for (;;) {
+            SharedLock lock(sync().lock);
+            auto *buf = _buf.load(std::memory_order_relaxed);
+
+            /* writes within an unshared storage only need to lock the pages they touch */
+            if (buf != nullptr && buf->ref == 1 && buf->cap >= (size + PageMask) >> PageBits) {
+                return lock;
+            }
+
+            /* detaching or growing the page table waits for every other writer */
+            lock.unlock();
+            UniqueLock _(sync().lock);
+            writable(size);
+        }
     }
 
 private:
-    static inline void unshare(Storage *&wbuf) {
-        if (wbuf == nullptr) {
-            wbuf = new Storage();
-        } else if (wbuf->ref != 1) {
-            wbuf = new Storage(wbuf);
+    inline Storage *writable(size_t size) {
+        auto * buf = _buf.load(std::memory_order_relaxed);
+        size_t np  = (size + PageMask) >> PageBits;
+
+        /* unshared storage with enough pages is modified in place */
+        if (buf != nullptr && buf->ref == 1 && buf->cap >= np) {
+            return buf;
         }
+
+        /* otherwise make a new one, the page table grows geometrically */
+        auto *nbuf = buf == nullptr
+            ? new Storage(np)
+            : new Storage(buf, buf->cap >= np ? buf->cap : std::max(np, buf->cap * 2));
+
+        /* publish the new storage, readers of the old one are not affected */
+        _buf.store(nbuf, std::memory_order_release);
+        Storage::release(buf);
+        return nbuf;
     }
 };
 
@@ -0,0 +1,277 @@
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <folly/logging/xlog.h>
+
+#include "timer.h"
+#include "fuse_error.h"
+#include "checkpoint.h"
+
+static constexpr size_t BufferSize = 1048576;
+
+static inline void need(size_t pos, size_t len, size_t size) {
+    if (pos > size || len > size - pos) {
+        throw FuseError(EINVAL, "corrupted checkpoint");
+    }
+}
+
+namespace {
+struct Output {
+    int         fd;
+    bool        done;
+    off_t       off;
+    std::string buf;
+    std::string name;
+
+public:
+    ~Output() {
+        close(fd);
+        if (!done) unlink(name.c_str());
+    }
+
+public:
+    void put(const void *mem, size_t len) {
+        if (buf.size() + len > BufferSize) flush();
+        if (len >= BufferSize) write(mem, len); else buf.append(static_cast<const char *>(mem), len);
+    }
+
+public:
+    void flush() {
+        write(buf.data(), buf.size());
+        buf.clear();
+    }
+
+private:
+    void write(const void *mem, size_t len) {
+        auto    ptr = static_cast<const char *>(mem);
+        ssize_t ret;
+
+        /* short writes are possible */
+        while (len != 0) {
+            if ((ret = pwrite(fd, ptr, len, off)) < 0) {
+                throw FuseError();
+            } else {
+                ptr += ret;
+                off += ret;
+                len -= ret;
+            }
+        }
+    }
+};
+
+struct Input {
+    int    fd;
+    size_t off;
+    size_t size;
+
+public:
+    ~Input() {
+        close(fd);
+    }
+
+public:
+    void get(void *mem, size_t len) {
+        need(off, len, size);
+        read(static_cast<char *>(mem), len);
+    }
+
+public:
+    ByteBuffer data(size_t len) {
+        ByteBuffer ret;
+        need(off, len, size);
+
+        /* read straight into the pages */
+        ret.fill(len, 0, [&](char *buf, size_t cnt) {
+            read(buf, cnt);
+            return cnt;
+        });
+
+        /* all done */
+        return ret;
+    }
+
+private:
+    void read(char *ptr, size_t len) {
+        ssize_t ret;
+
+        /* short reads are possible, the file might also have been truncated under us */
+        while (len != 0) {
+            if ((ret = pread(fd, ptr, len, static_cast<off_t>(off))) < 0) {
+                throw FuseError();
+            } else if (ret == 0) {
+                throw FuseError(EINVAL, "truncated checkpoint");
+            } else {
+                ptr += ret;
+                off += ret;
+                len -= ret;
+            }
+        }
+    }
+};
+}
+
+Checkpoint::Stats Checkpoint::save(
+    const std::string &    fname,
+    const std::string &    archive,
+    const FileNode::Node & base,
+    const Lookup &         node,
+    folly::SharedMutex &   barrier
+) {
+    int                           fd;
+    auto                          now = T::now();
+    auto                          tmp = fname + ".XXXXXX";
+    Stats                         ret;
+    Header                        hdr = {};
+    std::vector<FileNode::Change> changes;
+
+    /* the consistency point, writers to the mount are held off while collecting the changes,
+     * contents are shared with the sandbox and copied on write, so the sandbox is free to move
+     * on while they are being written out, the mount is only looked up at that point, since
+     * the first write replaces it with a private copy */
+    {
+        std::unique_lock<folly::SharedMutex> _(barrier);
+        node()->diff(base, &changes);
+    }
+
+    /* report the time taken */
+    XLOGF(INFO, "Found {:d} changed nodes in {:.3f}ms.", changes.size(), (double)(T::now() - now) * 1e-6);
+
+    /* write to a temporary file, so that a partial checkpoint is never picked up */
+    if ((fd = mkstemp(tmp.data())) < 0) {
+        throw FuseError();
+    }
+
+    /* the temporary file is removed on errors */
+    Output out { fd, false, 0, {}, tmp };
+    memcpy(hdr.magic, Magic, sizeof(Magic));
+
+    /* the header, followed by the name of the archive */
+    hdr.version = Version;
+    hdr.nlen    = archive.size();
+    hdr.count   = changes.size();
+    out.put(&hdr, sizeof(Header));
+    out.put(archive.data(), archive.size());
+
+    /* every change, followed by the path and the contents */
+    for (auto &v : changes) {
+        Record rec   = {};
+        rec.removed  = v.removed;
+        rec.flags    = v.attrs ? Attrs : 0;
+        rec.plen     = v.path.size();
+        rec.mode     = v.stat.st_mode;
+        rec.uid      = v.stat.st_uid;
+        rec.gid      = v.stat.st_gid;
+        rec.atime[0] = v.stat.st_atimespec.tv_sec;
+        rec.atime[1] = v.stat.st_atimespec.tv_nsec;
+        rec.mtime[0] = v.stat.st_mtimespec.tv_sec;
+        rec.mtime[1] = v.stat.st_mtimespec.tv_nsec;
+        rec.ctime[0] = v.stat.st_ctimespec.tv_sec;
+        rec.ctime[1] = v.stat.st_ctimespec.tv_nsec;
+        rec.len      = v.data.len();
+
+        /* write the record */
+        out.put(&rec, sizeof(Record));
+        out.put(v.path.data(), v.path.size());
+
+        /* stream the contents, holes are written as zeros */
+        v.data.scatter(rec.len, 0, [&](const char *mem, size_t len, int, off_t) {
+            out.put(mem, len);
+        });
+
+        /* update the statistics */
+        ret.bytes   += rec.len;
+        ret.nodes   += !v.removed;
+        ret.removed += v.removed;
+
+        /* release the contents early */
+        v.data = ByteBuffer();
+    }
+
+    /* make sure the checkpoint is complete before it becomes visible */
+    out.flush();
+    if (fsync(fd) != 0 || rename(tmp.c_str(), fname.c_str()) != 0) {
+        throw FuseError();
+    }
+
+    /* all done */
+    out.done = true;
+    XLOGF(INFO, "Checkpoint '{:s}' written in {:.3f}s.", fname, (double)(T::now() - now) * 1e-9);
+    return ret;
+}
+
+FileNode::Node Checkpoint::restore(const std::string &fname, const Resolver &base, Stats *stats) {
+    int         fd;
+    Header      hdr = {};
+    auto        now = T::now();
+    struct stat st  = {};
+
+    /* open the checkpoint */
+    if ((fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        throw FuseError();
+    }
+
+    /* find the checkpoint size */
+    if (fstat(fd, &st) != 0) {
+        auto err = errno;
+        close(fd);
+        throw FuseError(err);
+    }
+
+    /* contents are copied rather than mapped, so that the checkpoint can be replaced or removed
+     * afterwards, a mapping would fault on every access to a truncated checkpoint */
+    Input in { fd, 0, static_cast<size_t>(st.st_size) };
+    in.get(&hdr, sizeof(Header));
+
+    /* check the header, version 1 has no attribute-only records */
+    if (memcmp(hdr.magic, Magic, sizeof(Magic)) != 0 || hdr.version == 0 || hdr.version > Version) {
+        throw FuseError(EINVAL, "invalid checkpoint");
+    }
+
+    /* find the archive it was taken from */
+    auto name = std::string(hdr.nlen, 0);
+    in.get(name.data(), hdr.nlen);
+
+    /* apply every change on a private copy of the archive */
+    auto root = base(name)->copy();
+    while (stats->nodes + stats->removed < hdr.count) {
+        FileNode::Change ch;
+        Record           rec;
+
+        /* read the record and the path */
+        in.get(&rec, sizeof(Record));
+        ch.path.resize(rec.plen);
+        in.get(ch.path.data(), rec.plen);
+
+        /* rebuild the stat */
+        ch.attrs                     = (rec.flags & Attrs) != 0;
+        ch.removed                   = rec.removed != 0;
+        ch.stat.st_mode              = rec.mode;
+        ch.stat.st_nlink             = 1;
+        ch.stat.st_uid               = rec.uid;
+        ch.stat.st_gid               = rec.gid;
+        ch.stat.st_size              = static_cast<off_t>(rec.len);
+        ch.stat.st_atimespec.tv_sec  = rec.atime[0];
+        ch.stat.st_atimespec.tv_nsec = rec.atime[1];
+        ch.stat.st_mtimespec.tv_sec  = rec.mtime[0];
+        ch.stat.st_mtimespec.tv_nsec = rec.mtime[1];
+        ch.stat.st_ctimespec.tv_sec  = rec.ctime[0];
+        ch.stat.st_ctimespec.tv_nsec = rec.ctime[1];
+
+        /* read the contents */
+        if (rec.len != 0) {
+            ch.data = in.data(rec.len);
+        }
+
+        /* update the statistics */
+        stats->bytes   += rec.len;
+        stats->nodes   += !ch.removed;
+        stats->removed += ch.removed;
+
+        /* apply the change */
+        root->apply(std::move(ch));
+    }
+
+    /* all done */
+    XLOGF(INFO, "Checkpoint '{:s}' restored in {:.3f}s.", fname, (double)(T::now() - now) * 1e-9);
+    return root;
+}
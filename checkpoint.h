@@ -0,0 +1,62 @@
+#ifndef SANDBOX_FS_CHECKPOINT_H
+#define SANDBOX_FS_CHECKPOINT_H
+
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <folly/SharedMutex.h>
+
+#include "file_node.h"
+
+class Checkpoint {
+    struct Header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t nlen;
+        uint64_t count;
+    };
+
+private:
+    struct Record {
+        uint32_t removed;
+        uint32_t plen;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t flags;
+        int64_t  atime[2];
+        int64_t  mtime[2];
+        int64_t  ctime[2];
+        uint64_t len;
+    };
+
+private:
+    static constexpr uint32_t Attrs    = 1;
+    static constexpr uint32_t Version  = 2;
+    static constexpr char     Magic[8] = { 'S', 'B', 'F', 'S', 'C', 'K', 'P', 0 };
+
+public:
+    struct Stats {
+        size_t nodes   = 0;
+        size_t removed = 0;
+        size_t bytes   = 0;
+    };
+
+public:
+    typedef std::function<FileNode::Node()>                           Lookup;
+    typedef std::function<FileNode::Node(const std::string &archive)> Resolver;
+
+public:
+    static Stats save(
+        const std::string &    fname,
+        const std::string &    archive,
+        const FileNode::Node & base,
+        const Lookup &         node,
+        folly::SharedMutex &   barrier
+    );
+
+public:
+    static FileNode::Node restore(const std::string &fname, const Resolver &base, Stats *stats);
+};
+
+#endif /* SANDBOX_FS_CHECKPOINT_H */
@@ -0,0 +1,127 @@
+#include <vector>
+#include <folly/logging/xlog.h>
+#include <folly/hash/SpookyHashV2.h>
+
+#include "content_store.h"
+
+static constexpr uint64_t Seed = 0x73616e64626f7821;
+
+ByteBuffer ContentStore::intern(const Key &key, ByteBuffer data, Stats *stats) {
+    stats->files++;
+    stats->bytes += key.len;
+
+    /* empty files have nothing to share, and borrowed pages are not ours to keep alive */
+    if (key.len == 0 || data.borrowed()) {
+        return data;
+    }
+
+    /* look for the same contents */
+    auto ents = shard(key).ents.wlock();
+    auto iter = ents->find(key);
+
+    /* first time seen, the store keeps a reference */
+    if (iter == ents->end()) {
+        _keys.wlock()->emplace(data.id(), key);
+        ents->emplace(key, data.clone());
+        return data;
+    }
+
+    /* hash collisions are not worth handling, just keep a private copy */
+    if (!iter->second.equals(data)) {
+        XLOGF(WARN, "Content hash collision on a {:d} bytes file, not deduplicated.", key.len);
+        return data;
+    }
+
+    /* share the existing storage, writes are still copied on demand */
+    stats->dupes++;
+    stats->saved += key.len;
+    return iter->second.clone();
+}
+
+size_t ContentStore::sweep() {
+    size_t                  ret = 0;
+    std::vector<ByteBuffer> old;
+
+    /* one shard at a time, interning into the other shards goes on in the meantime */
+    for (auto &sh : _shards) {
+        {
+            auto ents = sh.ents.wlock();
+
+            /* drop contents that no file refers to anymore */
+            for (auto it = ents->begin(); it != ents->end();) {
+                if (!it->second.unique()) {
+                    it++;
+                } else {
+                    ret += it->first.len;
+                    old.emplace_back(std::move(it->second));
+                    it = ents->erase(it);
+                }
+            }
+
+            /* forget their storage as well, while nothing can be interned with the same storage */
+            if (!old.empty()) {
+                auto keys = _keys.wlock();
+                for (auto &buf : old) keys->erase(buf.id());
+            }
+        }
+
+        /* the pages are released outside the locks */
+        old.clear();
+    }
+
+    /* all done */
+    return ret;
+}
+
+void ContentStore::rebind(const void *id, const ByteBuffer &data) {
+    Key key {};
+
+    /* not interned */
+    {
+        auto keys = _keys.rlock();
+        auto iter = keys->find(id);
+
+        /* find the key of the storage */
+        if (iter == keys->end()) {
+            return;
+        } else {
+            key = iter->second;
+        }
+    }
+
+    /* the contents were moved elsewhere (spilled, for example), follow them,
+     * so that the store is not the one keeping the old pages alive */
+    auto ents = shard(key).ents.wlock();
+    auto iter = ents->find(key);
+
+    /* replace the storage, unless it was swept in the meantime */
+    if (iter != ents->end() && iter->second.replace(id, data.clone())) {
+        auto keys = _keys.wlock();
+        keys->erase(id);
+        keys->emplace(data.id(), key);
+    }
+}
+
+ContentStore::Key ContentStore::digest(const ByteBuffer &data) {
+    Key                       ret {};
+    folly::hash::SpookyHashV2 hash;
+
+    /* borrowed pages are never interned, don't bother hashing them */
+    if (data.borrowed()) {
+        ret.len = data.len();
+        return ret;
+    }
+
+    /* hash the contents in place */
+    hash.Init(Seed, Seed);
+    ret.len = data.scatter(data.len(), 0, [&](const char *mem, size_t len, int, off_t) { hash.Update(mem, len); });
+
+    /* all done */
+    hash.Final(&ret.lo, &ret.hi);
+    return ret;
+}
+
+ContentStore &ContentStore::instance() {
+    static auto *v = new ContentStore;
+    return *v;
+}
@@ -0,0 +1,74 @@
+#ifndef SANDBOX_FS_CONTENT_STORE_H
+#define SANDBOX_FS_CONTENT_STORE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <folly/Synchronized.h>
+
+#include "byte_buffer.h"
+
+/* contents are sharded by their digest, so that interning, rebinding and sweeping only ever lock one shard at a
+ * time, the storage to key mapping is kept apart, and is always locked after the shard if both are needed */
+class ContentStore {
+public:
+    struct Key {
+        uint64_t lo;
+        uint64_t hi;
+        size_t   len;
+
+    public:
+        bool operator==(const Key &other) const noexcept {
+            return lo == other.lo && hi == other.hi && len == other.len;
+        }
+    };
+
+public:
+    struct Stats {
+        size_t files = 0;
+        size_t bytes = 0;
+        size_t dupes = 0;
+        size_t saved = 0;
+
+    public:
+        [[nodiscard]] double ratio() const noexcept {
+            return bytes == saved ? 1.0 : (double)bytes / (double)(bytes - saved);
+        }
+    };
+
+private:
+    struct Hasher {
+        size_t operator()(const Key &key) const noexcept {
+            return key.lo;
+        }
+    };
+
+private:
+    typedef std::unordered_map<Key, ByteBuffer, Hasher> EntryMap;
+    typedef std::unordered_map<const void *, Key>       StorageMap;
+
+private:
+    static constexpr size_t Shards = 64;
+
+private:
+    struct alignas(64) Shard {
+        folly::Synchronized<EntryMap> ents;
+    };
+
+private:
+    Shard                           _shards[Shards];
+    folly::Synchronized<StorageMap> _keys;
+
+private:
+    Shard &shard(const Key &key) { return _shards[key.hi % Shards]; }
+
+public:
+    ByteBuffer intern(const Key &key, ByteBuffer data, Stats *stats);
+    size_t     sweep();
+    void       rebind(const void *id, const ByteBuffer &data);
+
+public:
+    static Key            digest(const ByteBuffer &data);
+    static ContentStore & instance();
+};
+
+#endif /* SANDBOX_FS_CONTENT_STORE_H */
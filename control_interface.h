@@ -1,16 +1,30 @@
 #ifndef SANDBOX_FS_CONTROL_INTERFACE_H
 #define SANDBOX_FS_CONTROL_INTERFACE_H
 
+#include <memory>
+#include <string>
+#include <vector>
 #include <sys/stat.h>
+#include <functional>
 #include <type_traits>
 #include "sandbox_file.h"
 
 struct ControlInterface {
+    typedef std::shared_ptr<void>                          Watch;
+    typedef std::function<void(const std::string &alias)> Watcher;
+
+public:
     [[nodiscard]] virtual const char *        name()          const = 0;
     [[nodiscard]] virtual SandboxFile *       open(int flags) const = 0;
     [[nodiscard]] virtual const struct stat & stat()          const = 0;
+
+public:
+    /* the watcher stays registered until the returned handle is released, which waits for it if it's running */
+    [[nodiscard]] virtual Watch watch(Watcher &&fn) const = 0;
 };
 
+typedef std::vector<ControlInterface *> ControlFiles;
+
 template <typename T, const char Name[], mode_t Mode>
 class Controller : public ControlInterface {
     struct stat _st;
@@ -23,6 +37,9 @@ public:
     [[nodiscard]] const char *        name()          const override { return Name; }
     [[nodiscard]] SandboxFile *       open(int flags) const override { return new T(flags); }
     [[nodiscard]] const struct stat & stat()          const override { return _st; }
+
+public:
+    [[nodiscard]] Watch watch(Watcher &&fn) const override { return T::watch(std::move(fn)); }
 };
 
 template <typename T, const char Name[], mode_t Mode>
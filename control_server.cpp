@@ -0,0 +1,364 @@
+#include <poll.h>
+#include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <folly/logging/xlog.h>
+
+#include "timer.h"
+#include "fuse_error.h"
+#include "control_server.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using JSON = SandboxController::JSON;
+
+ControlServer::Client::~Client() {
+    close(fd);
+}
+
+void ControlServer::Client::send(const JSON &v) {
+    auto buf = v.dump() + '\n';
+    auto len = buf.size();
+
+    /* nobody is reading the replies any more */
+    if (gone) {
+        return;
+    }
+
+    /* the client might have gone away, which is not an error of the command */
+    for (size_t off = 0; off < len;) {
+        auto ret = ::send(fd, buf.data() + off, len - off, MSG_NOSIGNAL);
+
+        /* check for errors */
+        if (ret >= 0) {
+            off += ret;
+            continue;
+        } else if (errno == EINTR) {
+            continue;
+        }
+
+        /* a client that does not read it's replies is dropped, instead of holding the worker */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            XLOGF(WARN, "Control client {:d} did not read it's replies for {:d}s, dropped.", fd, SendTimeout);
+        } else {
+            XLOGF(DBG, "Cannot send reply to control client {:d}: {:s}", fd, strerror(errno));
+        }
+
+        /* the event loop sees the connection shut down, and forgets the client */
+        gone = true;
+        shutdown(fd, SHUT_RDWR);
+        return;
+    }
+}
+
+ControlServer::~ControlServer() {
+    _stop = true;
+    wake();
+
+    /* stop accepting requests, the pending ones still run to completion, streamed ones report one last time */
+    _loop.join();
+    _clients.clear();
+    _pool.join();
+
+    /* timers may have been added by the last requests */
+    _timers.clear();
+
+    /* remove the socket */
+    close(_fd);
+    close(_wake[0]);
+    close(_wake[1]);
+    unlink(_path.c_str());
+}
+
+ControlServer::ControlServer(std::string path, size_t workers, mode_t mode) :
+    _fd    (-1),
+    _wake  {-1, -1},
+    _path  (std::move(path)),
+    _stop  (false),
+    _pool  (workers)
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+
+    /* the path must fit in the address */
+    if (_path.size() >= sizeof(addr.sun_path)) {
+        throw FuseError(ENAMETOOLONG);
+    }
+
+    /* create the listening socket, and a pipe to wake up the event loop with */
+    if ((_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || pipe(_wake) != 0) {
+        auto err = errno;
+        close(_fd);
+        throw FuseError(err);
+    }
+
+    /* replace the socket left by a previous instance if any */
+    unlink(_path.c_str());
+    memcpy(addr.sun_path, _path.c_str(), _path.size() + 1);
+
+    /* bind to the path, anyone who can connect can control the sandbox, so the socket is restricted
+     * before listening, connecting to a socket that is not listening yet is always refused */
+    if (bind(_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || chmod(_path.c_str(), mode) != 0 || listen(_fd, SOMAXCONN) != 0) {
+        auto err = errno;
+        close(_fd);
+        close(_wake[0]);
+        close(_wake[1]);
+        throw FuseError(err);
+    }
+
+    /* none of them are inherited by child processes */
+    fcntl(_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(_wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(_wake[1], F_SETFD, FD_CLOEXEC);
+
+    /* waking up an event loop that is already awake must never block */
+    fcntl(_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake[1], F_SETFL, O_NONBLOCK);
+
+    /* start the event loop */
+    _loop = std::thread([this] { loop(); });
+    XLOGF(INFO, "Control socket listening on '{:s}' with {:d} workers, mode {:04o}.", _path, workers, mode);
+}
+
+void ControlServer::loop() {
+    std::vector<struct pollfd>           fds;
+    std::vector<std::shared_ptr<Client>> cls;
+
+    /* wait for new clients and requests, until woken up by the pipe */
+    while (!_stop) {
+        fds.clear();
+        cls.clear();
+        fds.push_back({ .fd = _wake[0], .events = POLLIN, .revents = 0 });
+        fds.push_back({ .fd = _fd, .events = POLLIN, .revents = 0 });
+
+        /* every connected client */
+        for (auto &[fd, cl] : _clients) {
+            cls.emplace_back(cl);
+            fds.push_back({ .fd = fd, .events = POLLIN, .revents = 0 });
+        }
+
+        /* wait for events, or until the next timer expires */
+        if (poll(fds.data(), fds.size(), expire()) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else {
+                XLOGF(ERR, "Control socket event loop failed: {:s}", strerror(errno));
+                break;
+            }
+        }
+
+        /* drain the wake-up pipe, timers are checked on every iteration anyway */
+        if (fds[0].revents & POLLIN) {
+            char buf[256];
+            while (read(_wake[0], buf, sizeof(buf)) > 0);
+        }
+
+        /* new clients */
+        if (fds[1].revents & POLLIN) {
+            accept();
+        }
+
+        /* the requests already sent by clients that went away are still executed, clients dropped by a worker send nothing more */
+        for (size_t i = 0; i < cls.size(); i++) {
+            if (fds[i + 2].revents != 0 && (cls[i]->gone || !receive(cls[i]))) {
+                cls[i]->gone = true;
+                _clients.erase(cls[i]->fd);
+            }
+        }
+    }
+}
+
+void ControlServer::wake() {
+    (void)write(_wake[1], "", 1);
+}
+
+int ControlServer::expire() {
+    std::vector<std::function<void()>> fns;
+    std::unique_lock<std::mutex>       lock(_mutex);
+
+    /* take every expired timer */
+    auto now  = T::now();
+    auto iter = _timers.begin();
+    for (; iter != _timers.end() && iter->first <= now; ++iter) fns.emplace_back(std::move(iter->second));
+    _timers.erase(_timers.begin(), iter);
+
+    /* milliseconds until the next one, rounded up so that it has expired by then */
+    auto next = _timers.empty() ? -1 : static_cast<int>(std::min<uint64_t>((_timers.begin()->first - now + 999999) / 1000000, INT_MAX));
+    lock.unlock();
+
+    /* timers only hand work over to the workers, so they are cheap to run on the event loop */
+    for (auto &fn : fns) fn();
+    return next;
+}
+
+void ControlServer::schedule(double delay, std::function<void()> &&fn) {
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        _timers.emplace(T::now() + static_cast<uint64_t>(delay * 1e9), std::move(fn));
+    }
+
+    /* the event loop might be waiting for a later timer */
+    wake();
+}
+
+void ControlServer::accept() {
+    int fd = ::accept(_fd, nullptr, nullptr);
+
+    /* the client might have gone away in the meantime */
+    if (fd < 0) {
+        XLOGF(WARN, "Cannot accept control client: {:s}", strerror(errno));
+        return;
+    }
+
+    /* replies are sent from the workers, which must never wait for a client forever */
+    struct timeval tv = { .tv_sec = SendTimeout, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* not inherited by child processes, and writing to closed clients must not raise signals */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    /* requests of one client are executed in order */
+    _clients.emplace(fd, std::make_shared<Client>(fd, folly::SerialExecutor::create(folly::getKeepAliveToken(_pool))));
+}
+
+bool ControlServer::receive(const std::shared_ptr<Client> &client) {
+    char buf[65536];
+    auto ret = read(client->fd, buf, sizeof(buf));
+
+    /* check for EOF and errors */
+    if (ret == 0) {
+        return false;
+    } else if (ret < 0) {
+        return errno == EINTR;
+    }
+
+    /* split the requests */
+    size_t pos = client->rbuf.size();
+    client->rbuf.append(buf, ret);
+
+    /* queue every complete request */
+    for (size_t nl; (nl = client->rbuf.find('\n', pos)) != std::string::npos; pos = 0) {
+        auto line = client->rbuf.substr(0, nl);
+        client->rbuf.erase(0, nl + 1);
+
+        /* skip empty lines */
+        if (!line.empty()) {
+            client->exec->add([this, client, line = std::move(line)] { handle(client, line); });
+        }
+    }
+
+    /* requests are not allowed to grow forever, the error is sent after the requests before it,
+     * on a worker, so that a client that does not read it's replies can never block the event loop */
+    if (client->rbuf.size() <= MaxRequest) {
+        return true;
+    } else {
+        client->rbuf.clear();
+        client->exec->add([client] { client->send({{"id", nullptr}, {"error", E2BIG}, {"message", "request too large"}}); });
+        return false;
+    }
+}
+
+void ControlServer::handle(const std::shared_ptr<Client> &client, const std::string &line) {
+    JSON                           id     = nullptr;
+    JSON                           reps   = JSON::array();
+    bool                           stream = false;
+    double                         intv   = 1.0;
+    std::string                    cmd;
+    SandboxController::CommandArgs args;
+
+    /* parse the request */
+    try {
+        auto req = JSON::parse(line);
+        id     = req.value("id", JSON());
+        cmd    = req.at("cmd").get<std::string>();
+        args   = req.value("args", JSON::object()).get<SandboxController::CommandArgs>();
+        stream = req.value("stream", false);
+        intv   = req.value("interval", 1.0);
+    } catch (const JSON::exception &e) {
+        XLOGF(ERR, "Cannot parse control request, dropped. JSON Error: [{:d}] {:s}", e.id, e.what());
+        client->send({{"id", id}, {"error", EINVAL}, {"message", e.what()}});
+        return;
+    }
+
+    /* streamed status requests keep reporting until the job is finished */
+    if (stream && cmd == "STATUS") {
+        status(client, id, args, std::max(intv, 0.01));
+        return;
+    }
+
+    /* streamed replies are sent as soon as they are ready, otherwise they are sent all at once */
+    auto sink = [&](const JSON &v) {
+        if (stream) {
+            client->send({{"id", id}, {"reply", v}});
+        } else {
+            reps.push_back(v);
+        }
+    };
+
+    /* execute the request */
+    try {
+        SandboxController::serve(cmd, args, sink);
+    } catch (const FuseError &e) {
+        client->send({{"id", id}, {"error", e.code()}, {"message", e.message()}});
+        return;
+    } catch (const std::exception &e) {
+        XLOGF(ERR, "Cannot handle control request. Error: {:s}", e.what());
+        client->send({{"id", id}, {"error", EINVAL}, {"message", e.what()}});
+        return;
+    }
+
+    /* the final reply */
+    if (stream) {
+        client->send({{"id", id}, {"error", 0}, {"done", true}});
+    } else {
+        client->send({{"id", id}, {"error", 0}, {"replies", reps}});
+    }
+}
+
+void ControlServer::status(const std::shared_ptr<Client> &client, const JSON &id, const SandboxController::CommandArgs &args, double interval) {
+    auto done = false;
+
+    /* report the current status, the job is done once it is no longer queued nor loading */
+    try {
+        SandboxController::serve("STATUS", args, [&](const JSON &v) {
+            auto state = v.value("state", "");
+            done = state != "queued" && state != "loading";
+            client->send({{"id", id}, {"reply", v}});
+        });
+    } catch (const FuseError &e) {
+        client->send({{"id", id}, {"error", e.code()}, {"message", e.message()}});
+        return;
+    } catch (const std::exception &e) {
+        XLOGF(ERR, "Cannot handle control request. Error: {:s}", e.what());
+        client->send({{"id", id}, {"error", EINVAL}, {"message", e.what()}});
+        return;
+    }
+
+    /* the final reply, nobody is listening any more if the client went away */
+    if (done || _stop) {
+        client->send({{"id", id}, {"error", 0}, {"done", true}});
+        return;
+    } else if (client->gone) {
+        return;
+    }
+
+    /* report again later, requests sent by the client in the meantime are served in between */
+    schedule(interval, [this, client, id, args, interval] {
+        client->exec->add([this, client, id, args, interval] { status(client, id, args, interval); });
+    });
+}
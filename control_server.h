@@ -0,0 +1,80 @@
+#ifndef SANDBOX_FS_CONTROL_SERVER_H
+#define SANDBOX_FS_CONTROL_SERVER_H
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <sys/types.h>
+#include <folly/executors/SerialExecutor.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+
+#include "sandbox_controller.h"
+
+/* the same commands as `_fsctl`, served over a local stream socket, so that control traffic never competes with
+ * file operations for the FUSE worker threads. Requests and replies are JSON objects, one per line, the event loop
+ * only accepts connections and splits requests, which are executed on a worker pool in the order each client sent
+ * them, while different clients are served concurrently. Streamed status reports are driven by timers of the event
+ * loop, so that waiting for the next report never holds a worker. Replies are sent from the workers, a client that
+ * stops reading them is dropped once a reply could not be sent for `SendTimeout` seconds, so that it can never hold
+ * a worker for longer than that */
+class ControlServer {
+    struct Client {
+        int                                               fd;
+        std::string                                       rbuf;
+        std::atomic_bool                                  gone;
+        folly::Executor::KeepAlive<folly::SerialExecutor> exec;
+
+    public:
+       ~Client();
+        Client(int fd, folly::Executor::KeepAlive<folly::SerialExecutor> exec) : fd(fd), gone(false), exec(std::move(exec)) {}
+
+    public:
+        void send(const SandboxController::JSON &v);
+    };
+
+private:
+    static constexpr size_t MaxRequest  = 16ul << 20;
+    static constexpr long   SendTimeout = 5;
+
+private:
+    int                                              _fd;
+    int                                              _wake[2];
+    std::string                                      _path;
+    std::thread                                      _loop;
+    std::mutex                                       _mutex;
+    std::atomic_bool                                 _stop;
+    folly::CPUThreadPoolExecutor                     _pool;
+    std::multimap<uint64_t, std::function<void()>>   _timers;
+    std::unordered_map<int, std::shared_ptr<Client>> _clients;
+
+public:
+   ~ControlServer();
+    ControlServer(std::string path, size_t workers, mode_t mode);
+
+public:
+    ControlServer(ControlServer &&)      = delete;
+    ControlServer(const ControlServer &) = delete;
+
+public:
+    ControlServer &operator=(ControlServer &&)      = delete;
+    ControlServer &operator=(const ControlServer &) = delete;
+
+private:
+    void loop();
+    void wake();
+    void accept();
+    bool receive(const std::shared_ptr<Client> &client);
+    int  expire();
+
+private:
+    void handle(const std::shared_ptr<Client> &client, const std::string &line);
+    void status(const std::shared_ptr<Client> &client, const SandboxController::JSON &id, const SandboxController::CommandArgs &args, double interval);
+    void schedule(double delay, std::function<void()> &&fn);
+};
+
+#endif /* SANDBOX_FS_CONTROL_SERVER_H */
@@ -0,0 +1,106 @@
+#ifndef SANDBOX_FS_DIR_LISTING_H
+#define SANDBOX_FS_DIR_LISTING_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+
+#include "file_node.h"
+#include "control_interface.h"
+
+/* the entries of an opened directory, taken as a snapshot when the listing starts from the beginning,
+ * so that offsets handed to the kernel stay valid no matter how the directory changes in the meantime,
+ * and huge directories can be paged through without listing them again for every reply, nodes are
+ * only referred to weakly and stat'ed when replied, so an open listing never keeps a replaced or
+ * unmounted tree alive, entries that are gone by then are skipped */
+class DirListing {
+    typedef std::weak_ptr<FileNode> NodeRef;
+
+private:
+    struct Entry {
+        std::string        name;
+        NodeRef            node;
+        ControlInterface * ctrl;
+    };
+
+private:
+    ControlFiles       _ctrl;
+    NodeRef            _dir;
+    NodeRef            _parent;
+    std::mutex         _mutex;
+    std::vector<Entry> _ents;
+
+public:
+    DirListing(const FileNode::Node &dir, const FileNode::Node &parent, ControlFiles ctrl) :
+        _ctrl   (std::move(ctrl)),
+        _dir    (dir),
+        _parent (parent == nullptr ? dir : parent) {}
+
+public:
+    DirListing(DirListing &&)      = delete;
+    DirListing(const DirListing &) = delete;
+
+public:
+    DirListing &operator=(DirListing &&)      = delete;
+    DirListing &operator=(const DirListing &) = delete;
+
+public:
+    /* calls `fn(name, stat, next)` for every entry starting at `off` until it returns false, `next` is
+     * the offset of the entry after */
+    template <typename F>
+    void list(off_t off, F &&fn) {
+        std::lock_guard<std::mutex> _(_mutex);
+
+        /* listing from the start, which is also how the directory is rewound */
+        if (off == 0) {
+            refresh();
+        }
+
+        /* resume right after the last entry that was replied */
+        for (size_t i = off; i < _ents.size(); i++) {
+            FileNode::Stat st;
+            auto &         ent = _ents[i];
+
+            /* the node might have been released since the listing was taken */
+            if (ent.ctrl != nullptr) {
+                st = ent.ctrl->stat();
+            } else if (auto node = ent.node.lock()) {
+                st = node->stat();
+            } else {
+                continue;
+            }
+
+            /* stop when the reply is full */
+            if (!fn(ent.name.c_str(), st, static_cast<off_t>(i + 1))) {
+                break;
+            }
+        }
+    }
+
+private:
+    void refresh() {
+        auto dir = _dir.lock();
+        _ents.clear();
+
+        /* the directory itself is gone, so is everything in it */
+        if (dir == nullptr) {
+            return;
+        }
+
+        /* current & super directory, and the control files if any */
+        _ents.reserve(dir->nodes().size() + _ctrl.size() + 2);
+        _ents.push_back(Entry { ".", _dir, nullptr });
+        _ents.push_back(Entry { "..", _parent, nullptr });
+        for (auto *v : _ctrl) _ents.push_back(Entry { v->name(), NodeRef(), v });
+
+        /* add every directory entry */
+        dir->nodes().foreach([&](const std::string &name, const FileNode::Node &node) {
+            _ents.push_back(Entry { name, node, nullptr });
+        });
+    }
+};
+
+#endif /* SANDBOX_FS_DIR_LISTING_H */
@@ -1,28 +1,48 @@
+#include <algorithm>
 #include <archive_entry.h>
 
 #include "fuse_error.h"
 #include "file_backend.h"
 
-static inline void archiveOpen(struct archive *fp, const char *fn) {
+static inline struct archive *archiveOpen(const char *fn) {
+    struct archive *fp = archive_read_new();
+
+    /* compressed streams of any format */
+    archive_read_support_filter_all(fp);
+    archive_read_support_format_all(fp);
+
+    /* open the archive */
     if (archive_read_open_filename(fp, fn, 16777216) != 0) {
         auto err = archive_errno(fp);
         auto msg = std::string(archive_error_string(fp));
 
         /* free the archive before throwing the error */
-        archive_free(fp);
+        archive_read_free(fp);
         throw FuseError(err, std::move(msg));
     }
+
+    /* all done */
+    return fp;
 }
 
 FileBackend::~FileBackend() {
-    archive_read_close(fp);
-    archive_read_free(fp);
+    for (auto &cur : cursors) {
+        archive_read_free(cur.fp);
+    }
+
+    /* the scanning handle is gone after scanning */
+    if (fp != nullptr) {
+        archive_read_free(fp);
+    }
 }
 
-FileBackend::FileBackend(const std::string &fname) : fp(archive_read_new()) {
-    archive_read_support_filter_all(fp);
-    archive_read_support_format_all(fp);
-    archiveOpen(fp, fname.c_str());
+FileBackend::FileBackend(const std::string &fname) : fp(archiveOpen(fname.c_str())), fn(fname), len(0) {
+    struct stat st = {};
+
+    /* the archive size is only used for reporting progress */
+    if (::stat(fname.c_str(), &st) == 0) {
+        len = st.st_size;
+    }
 }
 
 void FileBackend::foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const {
@@ -31,35 +51,132 @@ void FileBackend::foreach(std::function<void(std::string, struct stat, ByteBuffe
 
     /* read all the headers */
     while ((ret = archive_read_next_header(fp, &val)) == ARCHIVE_OK) {
-        size_t       len;
-        la_int64_t   off;
-        ByteBuffer   buf;
-        const void * rbuf;
-
-        /* reserve space if possible */
-        if (archive_entry_size_is_set(val)) {
-            buf.ensure(archive_entry_size(val));
-        }
+        auto stat = *archive_entry_stat(val);
+        auto name = std::string(archive_entry_pathname_utf8(val));
+
+        /* read the file, the compressed bytes consumed so far tell how far along we are */
+        auto data = read(fp, val);
+        done = len == 0 ? 0.0 : (double)archive_filter_bytes(fp, -1) / (double)len;
+
+        /* invoke the callback */
+        func(std::move(name), stat, std::move(data));
+    }
 
-        /* get the file name and stat */
+    /* check for EOF */
+    if (ret != ARCHIVE_EOF) {
+        throw FuseError(archive_errno(fp), archive_error_string(fp));
+    }
+}
+
+void FileBackend::scan(std::function<void(std::string, struct stat, size_t)> &&func) const {
+    int                    ret;
+    size_t                 idx = 0;
+    struct archive_entry * val;
+
+    /* read all the headers, the data blocks are skipped by libarchive */
+    while ((ret = archive_read_next_header(fp, &val)) == ARCHIVE_OK) {
         auto stat = *archive_entry_stat(val);
         auto name = std::string(archive_entry_pathname_utf8(val));
 
-        /* read one file */
-        while ((ret = archive_read_data_block(fp, &rbuf, &len, &off)) == ARCHIVE_OK) {
-            buf.write(rbuf, len, buf.len());
+        /* invoke the callback with the entry index */
+        done = len == 0 ? 0.0 : (double)archive_filter_bytes(fp, -1) / (double)len;
+        func(std::move(name), stat, idx++);
+    }
+
+    /* check for EOF */
+    if (ret != ARCHIVE_EOF) {
+        throw FuseError(archive_errno(fp), archive_error_string(fp));
+    }
+
+    /* the scanning handle is no longer needed, release it's buffers early */
+    archive_read_free(fp);
+    fp = nullptr;
+}
+
+ByteBuffer FileBackend::fetch(size_t index) const {
+    int                    ret;
+    auto                   cur = take(index);
+    struct archive_entry * val = nullptr;
+
+    /* handles are forward-only, skip over the entries in between, the handle is
+     * dropped on errors, as it's position is unknown by then */
+    try {
+        while (cur.idx <= index) {
+            if ((ret = archive_read_next_header(cur.fp, &val)) == ARCHIVE_OK) {
+                cur.idx++;
+            } else if (ret == ARCHIVE_EOF) {
+                throw FuseError(EIO, "archive entry " + std::to_string(index) + " no longer exists");
+            } else {
+                throw FuseError(archive_errno(cur.fp), archive_error_string(cur.fp));
+            }
         }
 
-        /* invoke the callback if needed */
-        if (ret == ARCHIVE_EOF) {
-            func(std::move(name), stat, std::move(buf));
-        } else {
-            throw FuseError(archive_errno(fp), archive_error_string(fp));
+        /* read the entry, and keep the handle for the next fetch */
+        auto buf = read(cur.fp, val);
+        give(cur);
+        return buf;
+    } catch (...) {
+        archive_read_free(cur.fp);
+        throw;
+    }
+}
+
+FileBackend::Cursor FileBackend::take(size_t index) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto                         best = cursors.end();
+
+    /* the closest handle that has not passed the entry yet */
+    for (auto it = cursors.begin(); it != cursors.end(); ++it) {
+        if (it->idx <= index && (best == cursors.end() || it->idx > best->idx)) {
+            best = it;
         }
     }
 
-    /* check for EOF */
+    /* handles are used by one fetch at a time */
+    if (best != cursors.end()) {
+        auto ret = *best;
+        cursors.erase(best);
+        return ret;
+    }
+
+    /* start over from the first entry, opening is done without holding the lock */
+    lock.unlock();
+    return Cursor { 0, archiveOpen(fn.c_str()) };
+}
+
+void FileBackend::give(Cursor cur) const {
+    std::lock_guard<std::mutex> _(mutex);
+    cursors.push_back(cur);
+
+    /* keep only a few handles, the one furthest behind is the least likely to be useful */
+    if (cursors.size() > Cursors) {
+        auto it = std::min_element(cursors.begin(), cursors.end(), [](const Cursor &a, const Cursor &b) { return a.idx < b.idx; });
+        archive_read_free(it->fp);
+        cursors.erase(it);
+    }
+}
+
+ByteBuffer FileBackend::read(struct archive *fp, struct archive_entry *val) {
+    int          ret;
+    size_t       len;
+    la_int64_t   off;
+    ByteBuffer   buf;
+    const void * rbuf;
+
+    /* reserve space if possible */
+    if (archive_entry_size_is_set(val)) {
+        buf.ensure(archive_entry_size(val));
+    }
+
+    /* read one file */
+    while ((ret = archive_read_data_block(fp, &rbuf, &len, &off)) == ARCHIVE_OK) {
+        buf.write(rbuf, len, buf.len());
+    }
+
+    /* check for errors */
     if (ret != ARCHIVE_EOF) {
         throw FuseError(archive_errno(fp), archive_error_string(fp));
+    } else {
+        return buf;
     }
 }
@@ -1,6 +1,7 @@
 #ifndef SANDBOX_FS_FILE_BACKEND_H
 #define SANDBOX_FS_FILE_BACKEND_H
 
+#include <mutex>
 #include <string>
 #include <vector>
 #include <archive.h>
@@ -8,15 +9,40 @@
 
 #include "backend.h"
 
+/* archives that can not be mapped are compressed streams, which can only be read forward, so lazy fetches
+ * continue from a few cached handles instead of starting over from the first entry every time, fetching the
+ * whole tree in archive order decompresses the stream only once */
 class FileBackend : public Backend {
-    struct archive *fp;
+    struct Cursor {
+        size_t           idx;
+        struct archive * fp;
+    };
+
+private:
+    static constexpr size_t Cursors = 4;
+
+private:
+    mutable struct archive *    fp;
+    std::string                 fn;
+    size_t                      len;
+    mutable std::mutex          mutex;
+    mutable std::vector<Cursor> cursors;
 
 public:
     virtual ~FileBackend();
     explicit FileBackend(const std::string &fname);
 
 public:
-    void foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const override;
+    void       foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const override;
+    void       scan(std::function<void(std::string, struct stat, size_t)> &&func) const override;
+    ByteBuffer fetch(size_t index) const override;
+
+private:
+    Cursor take(size_t index) const;
+    void   give(Cursor cur) const;
+
+public:
+    static ByteBuffer read(struct archive *fp, struct archive_entry *val);
 };
 
 #endif /* SANDBOX_FS_FILE_BACKEND_H */
@@ -1,6 +1,12 @@
+#include <algorithm>
+#include <unordered_map>
+
 #include "utils.h"
 #include "file_node.h"
 
+/* scratch key buffer for map lookups, it keeps it's capacity between calls */
+static thread_local std::string key;
+
 static inline void settime(FileNode::Time *tm, const FileNode::Time &time) {
     switch (time.tv_nsec) {
         default         : *tm = time; break;
@@ -9,34 +15,79 @@ static inline void settime(FileNode::Time *tm, const FileNode::Time &time) {
     }
 }
 
-FileNode::Node FileNode::clone() const {
-    auto buf = NodeBuffer();
-    auto ret = std::make_shared<FileNode>();
+static inline bool stale(const FileNode::Time &atime, const FileNode::Time &mtime, const FileNode::Time &ctime, const FileNode::Time &now) {
+    auto le = [](const FileNode::Time &a, const FileNode::Time &b) {
+        return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+    };
+
+    /* same rules as relatime */
+    if (le(atime, mtime) || le(atime, ctime)) {
+        return true;
+    } else {
+        return now.tv_sec - atime.tv_sec >= 86400;
+    }
+}
+
+static inline std::pair<std::string, std::string> splitpath(const std::string &path) {
+    auto end = path.find_last_not_of('/');
+    auto pos = path.find_last_of('/', end);
+
+    /* the root directory cannot be modified */
+    if (end == std::string::npos) {
+        throw FuseError(EBUSY);
+    }
+
+    /* split into the parent directory and the base name */
+    if (pos == std::string::npos) {
+        return std::make_pair(std::string(), path.substr(0, end + 1));
+    } else {
+        return std::make_pair(path.substr(0, pos), path.substr(pos + 1, end - pos));
+    }
+}
+
+void FileNode::freeze() {
+    _frozen = true;
 
-    /* clone the node tree */
-    for (auto &v : _nodes) {
-        buf.emplace(v.first, v.second->clone());
+    /* entries of loaded trees never change again, so they are packed into the arena being loaded into */
+    if (auto *mem = NodeArena::current()) {
+        _nodes.compact(mem);
     }
 
+    /* freeze the whole tree */
+    _nodes.foreach([](const std::string &, const Node &node) {
+        node->freeze();
+    });
+}
+
+FileNode::Node FileNode::copy() {
+    auto ret = make();
+
+    /* lazy contents must settle before the node can be shared by copies */
+    load();
+
+    /* children are shared with the original, and copied on demand */
+    _nodes.foreach([&](const std::string &name, const Node &node) {
+        ret->_nodes.try_emplace(name, node);
+    });
+
     /* initialize the result node */
-    ret->_st    = _st;
-    ret->_name  = _name;
-    ret->_data  = _data.clone();
-    ret->_nodes = std::move(buf);
+    ret->_st.store(_st.load());
+    ret->_data = _data.clone();
     return ret;
 }
 
 void FileNode::rmdir(const std::string &path) {
-    Node par;
-    auto node = resolve(path, Missing::Error, &par);
+    auto name = splitpath(path);
+    auto par  = resolve(name.first, Missing::Error, true);
+    auto node = par->child(name.second);
 
     /* can only remove empty directories */
     if (!node->_nodes.empty()) {
         throw FuseError(ENOTEMPTY);
-    } else if (!S_ISDIR(node->_st.st_mode)) {
+    } else if (!S_ISDIR(node->stat().st_mode)) {
         throw FuseError(ENOTDIR);
     } else {
-        par->_nodes.erase(node->_name);
+        par->_nodes.erase(name.second);
     }
 }
 
@@ -49,105 +100,611 @@ void FileNode::mkdir(const std::string &path) {
 }
 
 void FileNode::unlink(const std::string &path) {
-    Node par;
-    auto node = resolve(path, Missing::Error, &par);
+    auto name = splitpath(path);
+    auto par  = resolve(name.first, Missing::Error, true);
+    auto node = par->child(name.second);
 
     /* can only unlink files */
-    if (S_ISDIR(node->_st.st_mode)) {
+    if (S_ISDIR(node->stat().st_mode)) {
         throw FuseError(EISDIR);
     } else {
-        par->_nodes.erase(node->_name);
+        par->_nodes.erase(name.second);
     }
 }
 
 void FileNode::rename(const std::string &path, const std::string &dest) {
-    Node par;
-    auto node = resolve(path, Missing::Error, &par);
+    auto src = splitpath(path);
+    auto dst = splitpath(dest);
+
+    /* cannot move a directory into itself */
+    if (dest.size() > path.size() && dest.compare(0, path.size(), path) == 0 && dest[path.size()] == '/') {
+        throw FuseError(EINVAL);
+    }
+
+    /* only the parent directories are modified, the node itself is moved as is */
+    auto spar = resolve(src.first, Missing::Error, true);
+    auto dpar = resolve(dst.first, Missing::Error, true);
+    auto node = spar->child(src.second);
+
+    /* renaming to itself is a no-op */
+    if (spar == dpar && src.second == dst.second) {
+        return;
+    }
 
-    /* erase from the old path, and attach to the new path */
-    par->_nodes.erase(node->_name);
-    resolve(dest, Missing::Create, nullptr, &node->_st, &node->_data, &node->_nodes);
+    /* can only move into directories */
+    if (!S_ISDIR(dpar->stat().st_mode)) {
+        throw FuseError(ENOTDIR);
+    }
+
+    /* attach to the new path, an existing destination is only replaced by the same kind of node,
+     * and directories must be empty, the destination is checked again if it changed in between */
+    for (;;) {
+        auto prev = dpar->_nodes.get(dst.second);
+        auto sdir = S_ISDIR(node->stat().st_mode);
+
+        /* nothing to replace */
+        if (prev == nullptr) {
+            if (dpar->_nodes.try_emplace(dst.second, node).second) break;
+            continue;
+        }
+
+        /* both names refer to the same node, nothing to do */
+        if (prev == node) {
+            return;
+        }
+
+        /* check the destination */
+        if (sdir && !S_ISDIR(prev->stat().st_mode)) {
+            throw FuseError(ENOTDIR);
+        } else if (!sdir && S_ISDIR(prev->stat().st_mode)) {
+            throw FuseError(EISDIR);
+        } else if (sdir && !prev->_nodes.empty()) {
+            throw FuseError(ENOTEMPTY);
+        }
+
+        /* replace the destination */
+        if (dpar->_nodes.assign_if_equal(dst.second, prev, node)) {
+            break;
+        }
+    }
+
+    /* erase from the old path */
+    spar->_nodes.erase_if_equal(src.second, node);
+
+    /* nodes moved to another mount must stop following the epoch of the old one */
+    if (&epoch(path) != &epoch(dest)) {
+        epoch(path).fetch_add(1, std::memory_order_release);
+    }
+}
+
+void FileNode::load() {
+    std::call_once(_once, [this] {
+        if (_lazy != nullptr) {
+            _data = _lazy->get().clone();
+            _lazy.reset();
+        }
+    });
 }
 
 void FileNode::access() {
-    _st.st_atimespec = T::nowts();
+    auto st  = _st.load();
+    auto now = T::nowts();
+
+    /* relatime, only update the access time if it's older than the last
+     * modification, or a day old, so that most reads never store anything */
+    if (!_frozen && stale(st.st_atimespec, st.st_mtimespec, st.st_ctimespec, now)) {
+        _st.update([&](Stat &v) { v.st_atimespec = now; });
+    }
 }
 
 void FileNode::resize(size_t size) {
-    if (S_ISDIR(_st.st_mode)) {
+    if (S_ISDIR(stat().st_mode)) {
         throw FuseError(EISDIR);
+    } else if (_frozen) {
+        throw FuseError(EROFS);
     } else {
+        load();
+        touch();
         _data.resize(size);
-        _st.st_size = _data.len();
-        _st.st_mtimespec = T::nowts();
+        modified();
+        MemoryBudget::instance().check();
     }
 }
 
 void FileNode::utimens(const FileNode::Time &atime, const FileNode::Time &mtime) {
-    settime(&_st.st_atimespec, atime);
-    settime(&_st.st_mtimespec, mtime);
+    if (_frozen) {
+        throw FuseError(EROFS);
+    } else {
+        _st.update([&](Stat &st) {
+            settime(&st.st_atimespec, atime);
+            settime(&st.st_mtimespec, mtime);
+        });
+    }
 }
 
 size_t FileNode::read(char *buf, size_t len, size_t off) {
+    load();
+    touch();
     access();
     return _data.read(buf, len, off);
 }
 
 size_t FileNode::write(const char *buf, size_t len, size_t off) {
-    _data.write(buf, len, off);
-    _st.st_size = _data.len();
-    _st.st_mtimespec = T::nowts();
-    return len;
+    if (_frozen) {
+        throw FuseError(EROFS);
+    } else {
+        load();
+        touch();
+        _data.write(buf, len, off);
+        modified();
+        MemoryBudget::instance().check();
+        return len;
+    }
+}
+
+size_t FileNode::fill(size_t len, size_t off, const ByteBuffer::Filler &fn) {
+    if (_frozen) {
+        throw FuseError(EROFS);
+    } else {
+        load();
+        touch();
+        len = _data.fill(len, off, fn);
+        modified();
+        MemoryBudget::instance().check();
+        return len;
+    }
+}
+
+size_t FileNode::pin(size_t len, size_t off, ByteBuffer::Pinned *pins) {
+    load();
+    touch();
+    access();
+    return _data.pin(len, off, pins);
+}
+
+void FileNode::diff(const Node &base, std::vector<Change> *changes) {
+    std::string path;
+    diff(base.get(), path, changes);
+}
+
+void FileNode::apply(Change &&change) {
+    if (change.removed) {
+        auto name = splitpath(change.path);
+        resolve(name.first, Missing::Error, true)->del(name.second);
+    } else if (change.attrs) {
+        resolve(change.path, Missing::Error, true)->_st.update([&](Stat &st) {
+            auto size  = st.st_size;
+            st         = change.stat;
+            st.st_size = size;
+        });
+    } else if (S_ISDIR(change.stat.st_mode)) {
+        resolve(change.path, Missing::Create, true, &change.stat);
+    } else {
+        resolve(change.path, Missing::Create, true, &change.stat, &change.data);
+    }
+}
+
+bool FileNode::same(const FileNode *base) const {
+    auto st = stat();
+    auto bs = base->stat();
+
+    /* compare the attributes and the contents */
+    return st.st_mode               == bs.st_mode               &&
+           st.st_uid                == bs.st_uid                &&
+           st.st_gid                == bs.st_gid                &&
+           st.st_size               == bs.st_size               &&
+           st.st_atimespec.tv_sec   == bs.st_atimespec.tv_sec   &&
+           st.st_atimespec.tv_nsec  == bs.st_atimespec.tv_nsec  &&
+           st.st_mtimespec.tv_sec   == bs.st_mtimespec.tv_sec   &&
+           st.st_mtimespec.tv_nsec  == bs.st_mtimespec.tv_nsec  &&
+           st.st_ctimespec.tv_sec   == bs.st_ctimespec.tv_sec   &&
+           st.st_ctimespec.tv_nsec  == bs.st_ctimespec.tv_nsec  &&
+           _data.id()               == base->_data.id();
+}
+
+void FileNode::diff(const FileNode *base, std::string &path, std::vector<Change> *changes) {
+    auto len = path.size();
+
+    /* nodes still shared with the base are unchanged, along with everything below them */
+    if (this == base) {
+        return;
+    }
+
+    /* the type has changed, the base node is replaced as a whole */
+    if (base != nullptr && (base->stat().st_mode & S_IFMT) != (stat().st_mode & S_IFMT)) {
+        changes->emplace_back(Change { path, true });
+        base = nullptr;
+    }
+
+    /* files are recorded along with their contents */
+    if (!S_ISDIR(stat().st_mode)) {
+        if (base == nullptr || !same(base)) {
+            load();
+
+            /* only the attributes changed, the contents are still shared with the base */
+            if (base != nullptr && _data.id() == base->_data.id()) {
+                changes->emplace_back(Change { path, false, stat(), ByteBuffer(), true });
+            } else {
+                changes->emplace_back(Change { path, false, stat(), _data.clone() });
+            }
+        }
+        return;
+    }
+
+    /* directories are recorded only when their attributes changed */
+    if (base == nullptr || !same(base)) {
+        changes->emplace_back(Change { path, false, stat() });
+    }
+
+    /* children of the base that no longer exist, loaded trees are never modified in place */
+    if (base != nullptr) {
+        base->_nodes.foreach([&](const std::string &name, const Node &) {
+            if (_nodes.get(name) == nullptr) {
+                changes->emplace_back(Change { (len == 0 ? "" : path + '/') + name, true });
+            }
+        });
+    }
+
+    /* compare every child with the one in the base, if any */
+    _nodes.foreach([&](const std::string &name, const Node &node) {
+        Node prev = base == nullptr ? nullptr : base->_nodes.get(name);
+
+        /* build the path in place */
+        if (len != 0) path.push_back('/');
+        path.append(name);
+        node->diff(prev.get(), path, changes);
+        path.resize(len);
+    });
+}
+
+void FileNode::touch() {
+    auto v = MemoryBudget::instance().epoch();
+
+    /* shared nodes are touched by many threads, avoid bouncing the cache line */
+    if (_touched.load(std::memory_order_relaxed) != v) {
+        _touched.store(v, std::memory_order_relaxed);
+    }
+}
+
+void FileNode::modified() {
+    _st.update([this](Stat &st) {
+        st.st_size      = _data.len();
+        st.st_mtimespec = T::nowts();
+    });
+}
+
+void FileNode::report() const {
+    size_t nb = 0;
+    size_t sz = footprint(&nb);
+
+    /* file contents are not included */
+    XLOGF(INFO, "{:d} nodes, {:d} bytes of metadata, {:.1f} bytes per node.", nb, sz, (double)sz / nb);
+}
+
+size_t FileNode::footprint(size_t *count) const {
+    size_t ret = sizeof(FileNode) + _nodes.footprint();
+
+    /* count every node below this one */
+    _nodes.foreach([&](const std::string &, const Node &node) {
+        ret += node->footprint(count);
+    });
+
+    /* add this node */
+    ++*count;
+    return ret;
+}
+
+void FileNode::collect(std::unordered_set<const FileNode *> *seen, std::vector<Node> *nodes, bool priv) {
+    if ((priv && _frozen) || !seen->insert(this).second) {
+        return;
+    }
+
+    /* files with contents in memory are candidates */
+    if (!S_ISDIR(stat().st_mode)) {
+        if (_data.resident() != 0) nodes->emplace_back(shared_from_this());
+        return;
+    }
+
+    /* walk the whole tree */
+    _nodes.foreach([&](const std::string &, const Node &node) {
+        node->collect(seen, nodes, priv);
+    });
+}
+
+FileNode::Node FileNode::merge(const std::vector<Node> &layers) {
+    std::unordered_map<std::string, std::vector<Node>> nodes;
+
+    /* directories that only exist in one layer are shared as is, except for whiteouts */
+    if (layers.size() == 1) {
+        return strip(layers.front());
+    }
+
+    /* walk the layers from bottom to top */
+    for (auto &layer : layers) {
+        if (layer->_nodes.get(Opaque) != nullptr) {
+            nodes.clear();
+        }
+
+        /* whiteouts hide the entries of lower layers only, so they go first */
+        layer->_nodes.foreach([&](const std::string &name, const Node &) {
+            if (name != Opaque && name.compare(0, sizeof(Whiteout) - 1, Whiteout) == 0) {
+                nodes.erase(name.substr(sizeof(Whiteout) - 1));
+            }
+        });
+
+        /* directories are merged with lower directories, anything else replaces them */
+        layer->_nodes.foreach([&](const std::string &name, const Node &node) {
+            if (name.compare(0, sizeof(Whiteout) - 1, Whiteout) != 0) {
+                auto &nv = nodes[name];
+                auto dir = S_ISDIR(node->stat().st_mode);
+
+                /* check for directories */
+                if (!dir || nv.empty() || !S_ISDIR(nv.back()->stat().st_mode)) {
+                    nv.clear();
+                }
+
+                /* add to the layers of this name */
+                nv.emplace_back(node);
+            }
+        });
+    }
+
+    /* the merged directory takes the attributes of the top layer */
+    auto ret = make();
+    ret->_st.store(layers.back()->stat());
+
+    /* merge every child, only directories existing in many layers are new nodes */
+    for (auto &[name, nv] : nodes) {
+        ret->_nodes.try_emplace(name, merge(nv));
+    }
+
+    /* the merged tree is shared by copies just like loaded ones, and never modified in place */
+    ret->_frozen = true;
+    return ret;
+}
+
+FileNode::Node FileNode::strip(const Node &node) {
+    bool                                      dirty = false;
+    std::vector<std::pair<std::string, Node>> items;
+
+    /* only directories have whiteouts */
+    if (!S_ISDIR(node->stat().st_mode)) {
+        return node;
+    }
+
+    /* whiteouts and opaque markers are never visible, they have nothing to hide below a single layer */
+    node->_nodes.foreach([&](const std::string &name, const Node &child) {
+        if (name.compare(0, sizeof(Whiteout) - 1, Whiteout) == 0) {
+            dirty = true;
+        } else {
+            items.emplace_back(name, child);
+        }
+    });
+
+    /* strip every child, the directory is only rebuilt if any of them changed */
+    for (auto &[name, child] : items) {
+        auto val = strip(child);
+        dirty |= val != child;
+        child = std::move(val);
+    }
+
+    /* subtrees without any whiteouts are shared as is */
+    if (!dirty) {
+        return node;
+    }
+
+    /* otherwise rebuild the directory without them */
+    auto ret = make();
+    ret->_st.store(node->stat());
+
+    /* add the remaining children */
+    for (auto &[name, child] : items) {
+        ret->_nodes.try_emplace(name, std::move(child));
+    }
+
+    /* frozen just like merged directories */
+    ret->_frozen = true;
+    return ret;
+}
+
+size_t FileNode::trim(const std::vector<Node> &roots, size_t limit) {
+    size_t ret = 0;
+
+    /* only private nodes hold what was written into a mount, frozen ones belong to the loaded archives */
+    for (auto &root : roots) {
+        size_t                               used = 0;
+        std::vector<Node>                    nodes;
+        std::unordered_set<const FileNode *> seen;
+
+        /* find every written file with contents in memory */
+        root->collect(&seen, &nodes, true);
+        for (auto &node : nodes) used += node->_data.resident();
+
+        /* spill down to the low watermark */
+        if (used > limit) {
+            ret += evict(nodes, used - (limit - limit / 8));
+        }
+    }
+
+    /* all done */
+    return ret;
+}
+
+size_t FileNode::reclaim(const std::vector<Node> &roots, size_t target) {
+    auto                                 now = static_cast<size_t>(std::max(ByteBuffer::allocated().load(), int64_t(0)));
+    std::vector<Node>                    nodes;
+    std::unordered_set<const FileNode *> seen;
+
+    /* nothing to do */
+    if (now <= target) {
+        return 0;
+    }
+
+    /* find every file with contents in memory, the same tree might be reachable from many roots */
+    for (auto &v : roots) {
+        v->collect(&seen, &nodes, false);
+    }
+
+    /* spill until the target is reached */
+    return evict(nodes, now - target);
+}
+
+size_t FileNode::evict(std::vector<Node> &nodes, size_t want) {
+    size_t ret = 0;
+    auto & mem = MemoryBudget::instance();
+
+    /* spill the least recently touched ones first */
+    std::stable_sort(nodes.begin(), nodes.end(), [](const Node &a, const Node &b) {
+        return a->_touched.load(std::memory_order_relaxed) < b->_touched.load(std::memory_order_relaxed);
+    });
+
+    /* storage shared by many nodes is spilled only once, the originals are kept
+     * until all done, so that their addresses are never reused in the meantime */
+    std::unordered_map<const void *, std::pair<ByteBuffer, ByteBuffer>> done;
+
+    /* spill until enough is released, the spill file might be full though */
+    std::exception_ptr error = nullptr;
+    try {
+        for (auto &node : nodes) {
+            auto old = node->_data.clone();
+            auto id  = old.id();
+            auto it  = done.find(id);
+
+            /* once the target is reached, only nodes sharing spilled contents are updated */
+            if (id == nullptr || (it == done.end() && ret >= want)) {
+                continue;
+            }
+
+            /* spill the contents if not done yet */
+            if (it == done.end()) {
+                auto buf = old.clone();
+                ret += mem.spill(buf);
+                it   = done.emplace(id, std::make_pair(std::move(old), std::move(buf))).first;
+            }
+
+            /* writers make their own copy, in which case the node is left alone */
+            node->_data.replace(id, it->second.second.clone());
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    /* the content store must not keep the old pages alive */
+    for (auto &[id, v] : done) {
+        ContentStore::instance().rebind(id, v.second);
+    }
+
+    /* check for spilling errors */
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    } else {
+        return ret;
+    }
+}
+
+std::atomic_uint64_t &FileNode::epoch(std::string_view path) {
+    static constexpr size_t Stripes = 64;
+    static struct alignas(64) { std::atomic_uint64_t v { 0 }; } stripes[Stripes];
+
+    /* copies only invalidate nodes within the same mount, which is the first component of the path */
+    auto key = *str::split(path, '/').begin();
+
+    /* find the stripe, mounts sharing one only cost each other some extra lookups */
+    return stripes[std::hash<std::string_view>()(key) % Stripes].v;
+}
+
+FileNode::Node FileNode::find(std::string_view path, int *err) {
+    FileNode *        p = this;
+    folly::rcu_reader _;
+
+    /* nodes are kept alive by the read section, so no references are taken on the way */
+    for (auto &v : str::split(path, '/')) {
+        auto *node = p->_nodes.find(key.assign(v.data(), v.size()));
+
+        /* check for node existance */
+        if (node == nullptr) {
+            *err = S_ISDIR(p->stat().st_mode) ? ENOENT : ENOTDIR;
+            return nullptr;
+        }
+
+        /* move to next level */
+        p = node;
+    }
+
+    /* only the final node is referenced */
+    return p->shared_from_this();
+}
+
+FileNode::Node FileNode::child(const std::string &name) {
+    if (auto node = _nodes.get(name)) {
+        return node;
+    } else {
+        throw FuseError(S_ISDIR(stat().st_mode) ? ENOENT : ENOTDIR);
+    }
 }
 
 FileNode::Node FileNode::resolve(
-    const std::string & path,
+    std::string_view    path,
     Missing             ifnx,
-    Node *              parent,
+    bool                writable,
     Stat *              stat,
-    ByteBuffer *        mbuf,
-    NodeBuffer *        nodes
+    ByteBuffer *        mbuf
 ) {
     Node q = nullptr;
     Node p = shared_from_this();
 
+    /* creating nodes modifies every directory along the path */
+    if (ifnx == Missing::Create) {
+        writable = true;
+    }
+
     /* find in nodes */
-    for (auto &v : str::split(path, "/").filterNot(&std::string::empty)) {
-        auto end  = p->_nodes.end();
-        auto iter = p->_nodes.find(v);
+    for (auto &v : str::split(path, '/')) {
+        auto node = p->_nodes.get(key.assign(v.data(), v.size()));
 
         /* check for node existance */
-        if (iter != end) {
+        if (node != nullptr) {
             q = std::move(p);
-            p = iter->second;
+            p = std::move(node);
+
+            /* copy shared nodes on the way down if they are about to be modified, the
+             * parent is always private at this point, so only the path is duplicated */
+            while (writable && p->_frozen) {
+                auto copy = p->copy();
+                auto done = q->_nodes.assign_if_equal(key, p, copy);
+
+                /* some other thread might have replaced the node, use their copy instead */
+                if (done) {
+                    p = std::move(copy);
+                    epoch(path).fetch_add(1, std::memory_order_release);
+                } else {
+                    p = q->child(key);
+                }
+            }
+
+            /* move to next level */
             continue;
         }
 
         /* node does not exist, follow the selected strategy */
         switch (ifnx) {
-            case Missing::Error  : throw FuseError(S_ISDIR(p->_st.st_mode) ? ENOENT : ENOTDIR);
+            case Missing::Error  : throw FuseError(S_ISDIR(p->stat().st_mode) ? ENOENT : ENOTDIR);
             case Missing::Empty  : return nullptr;
             case Missing::Create : break;
         }
 
         /* can only create new nodes under directories */
-        if (!S_ISDIR(p->_st.st_mode)) {
+        if (!S_ISDIR(p->stat().st_mode)) {
             throw FuseError(ENOTDIR);
         }
 
-        /* create a new node */
+        /* create a new node, and add to the node set */
         q = std::move(p);
-        p = std::make_shared<FileNode>();
-
-        /* set it's name and add to the node set */
-        p->_name = v;
-        q->_nodes.emplace(v, p);
+        p = q->_nodes.try_emplace(key, make()).first;
     }
 
     /* set all the optional fields */
-    if (stat   != nullptr) std::swap(*stat, p->_st);
-    if (mbuf   != nullptr) std::swap(*mbuf, p->_data);
-    if (nodes  != nullptr) std::swap(*nodes, p->_nodes);
-    if (parent != nullptr) std::swap(*parent, q);
+    if (stat != nullptr) p->_st.store(*stat);
+    if (mbuf != nullptr) std::swap(*mbuf, p->_data);
     return p;
 }
@@ -1,10 +1,17 @@
 #ifndef SANDBOX_FS_FILE_NODE_H
 #define SANDBOX_FS_FILE_NODE_H
 
+#include <mutex>
+#include <tuple>
+#include <atomic>
+#include <thread>
+#include <exception>
 #include <memory>
 #include <string>
+#include <vector>
+#include <string_view>
+#include <unordered_set>
 #include <folly/logging/xlog.h>
-#include <folly/concurrency/ConcurrentHashMap.h>
 
 #include <utime.h>
 #include <unistd.h>
@@ -12,15 +19,33 @@
 
 #include "timer.h"
 #include "backend.h"
+#include "node_map.h"
+#include "seq_lock.h"
+#include "node_arena.h"
+#include "load_progress.h"
 #include "fuse_error.h"
 #include "byte_buffer.h"
+#include "lazy_buffer.h"
+#include "memfd_pool.h"
+#include "bounded_queue.h"
+#include "content_store.h"
+#include "memory_budget.h"
 
 struct FileNode : public std::enable_shared_from_this<FileNode> {
     typedef std::string                                 Name;
     typedef struct stat                                 Stat;
     typedef struct timespec                             Time;
     typedef std::shared_ptr<FileNode>                   Node;
-    typedef folly::ConcurrentHashMap<std::string, Node> NodeBuffer;
+    typedef NodeMap<Node>                               NodeBuffer;
+
+public:
+    struct Change {
+        Name       path;
+        bool       removed;
+        Stat       stat;
+        ByteBuffer data;
+        bool       attrs = false;
+    };
 
 private:
     enum class Missing {
@@ -30,14 +55,24 @@ private:
     };
 
 private:
-    Stat        _st;
-    Name        _name;
-    ByteBuffer  _data;
-    NodeBuffer  _nodes;
+    static constexpr size_t QueueDepth = 64;
+
+private:
+    static constexpr char Whiteout[] = ".wh.";
+    static constexpr char Opaque[]   = ".wh..wh..opq";
+
+private:
+    SeqLock<Stat>               _st;
+    bool                        _frozen;
+    ByteBuffer                  _data;
+    NodeBuffer                  _nodes;
+    std::once_flag              _once;
+    std::atomic_uint64_t        _touched;
+    std::shared_ptr<LazyBuffer> _lazy;
 
 public:
    ~FileNode() { _nodes.clear(); }
-    FileNode() : _st() { setstat(&_st, S_IFDIR | 0755); }
+    FileNode() : _st(defstat(S_IFDIR | 0755)), _frozen(false), _touched(0) {}
 
 public:
     FileNode(FileNode &&) = delete;
@@ -48,9 +83,13 @@ public:
     FileNode &operator=(const FileNode &) = delete;
 
 public:
-    [[nodiscard]] const Stat &       stat()  const { return _st; }
-    [[nodiscard]] const NodeBuffer & nodes() const { return _nodes; }
-    [[nodiscard]] Node               clone() const;
+    [[nodiscard]] Stat               stat()   const { return _st.load(); }
+    [[nodiscard]] const NodeBuffer & nodes()  const { return _nodes; }
+    [[nodiscard]] bool               frozen() const { return _frozen; }
+
+public:
+    void freeze();
+    Node copy();
 
 public:
     inline void del(const std::string &name) {
@@ -60,27 +99,42 @@ public:
     }
 
 public:
-    inline void add(const std::string &name, Node &&node) {
+    inline void add(const std::string &name, Node node) {
         if (!_nodes.try_emplace(name, std::move(node)).second) {
             throw FuseError(EEXIST);
         }
     }
 
 public:
-    inline Node get(const std::string &path, bool autoCreate = false) {
+    inline Node get(const std::string &path, bool autoCreate = false, bool writable = false) {
         Stat st;
-        auto node = resolve(path, autoCreate ? Missing::Empty : Missing::Error);
+        int  err;
+
+        /* read-only lookups take the fast path */
+        if (!autoCreate && !writable) {
+            if (auto node = find(path, &err)) {
+                return node;
+            } else {
+                throw FuseError(err);
+            }
+        }
 
         /* check for existing node */
+        auto node = resolve(path, autoCreate ? Missing::Empty : Missing::Error, writable || autoCreate);
+
+        /* found the node */
         if (node != nullptr) {
             return node;
         }
 
         /* create a new one if needed */
         setstat(&st, S_IFREG | 0644);
-        return resolve(path, Missing::Create, nullptr, &st);
+        return resolve(path, Missing::Create, true, &st);
     }
 
+public:
+    Node find(std::string_view path, int *err);
+
 public:
     void rmdir(const std::string &path);
     void mkdir(const std::string &path);
@@ -88,6 +142,7 @@ public:
     void rename(const std::string &path, const std::string &dest);
 
 public:
+    void load();
     void access();
     void resize(size_t size);
     void utimens(const Time &atime, const Time &mtime);
@@ -96,32 +151,236 @@ public:
     size_t read(char *buf, size_t len, size_t off);
     size_t write(const char *buf, size_t len, size_t off);
 
+public:
+    size_t fill(size_t len, size_t off, const ByteBuffer::Filler &fn);
+    size_t pin(size_t len, size_t off, ByteBuffer::Pinned *pins);
+
+public:
+    void diff(const Node &base, std::vector<Change> *changes);
+    void apply(Change &&change);
+
+public:
+    /* metadata bytes of this node and everything below it, file contents are not included */
+    size_t footprint(size_t *count) const;
+
 private:
+    bool same(const FileNode *base) const;
+    void diff(const FileNode *base, std::string &path, std::vector<Change> *changes);
+
+private:
+    void touch();
+    void report() const;
+    void modified();
+    void collect(std::unordered_set<const FileNode *> *seen, std::vector<Node> *nodes, bool priv);
+
+private:
+    Node child(const std::string &name);
     Node resolve(
-        const std::string & path,
-        Missing             ifnx   = Missing::Error,
-        Node *              parent = nullptr,
-        Stat *              stat   = nullptr,
-        ByteBuffer *        mbuf   = nullptr,
-        NodeBuffer *        nodes  = nullptr
+        std::string_view    path,
+        Missing             ifnx     = Missing::Error,
+        bool                writable = false,
+        Stat *              stat     = nullptr,
+        ByteBuffer *        mbuf     = nullptr
     );
 
 public:
-    static Node build(const Backend &be) {
+    static Node build(
+        const Backend &       be,
+        MemfdPool *           pool     = nullptr,
+        size_t                jobs     = 1,
+        ContentStore::Stats * dedupe   = nullptr,
+        LoadProgress *        progress = nullptr
+    ) {
+        struct Item {
+            std::string       name;
+            Stat              stat;
+            ByteBuffer        data;
+            ContentStore::Key key;
+        };
+
+        /* loading states */
+        size_t             nb    = 0;
+        size_t             held  = 0;
+        size_t             spill = 0;
+        auto &             mem   = MemoryBudget::instance();
+        auto               now   = T::now();
+        auto               ret   = make();
+        auto               ents  = std::vector<std::tuple<Node, size_t, size_t>>();
+        std::exception_ptr error = nullptr;
+        BoundedQueue<Item> queue(QueueDepth);
+
+        /* memfd pools keep their own copy of the contents */
+        if (pool != nullptr) {
+            dedupe = nullptr;
+        }
+
+        /* decode on a separate thread, so that decoding and tree construction overlap */
+        std::thread producer([&] {
+            auto push = [&](std::string name, Stat stat, ByteBuffer data) {
+                auto key = dedupe == nullptr ? ContentStore::Key() : ContentStore::digest(data);
+
+                /* hash the contents on the decoding threads */
+                if (!queue.push(Item { std::move(name), stat, std::move(data), key })) {
+                    throw FuseError(ECANCELED);
+                }
+            };
+
+            /* the callback might be invoked concurrently, but the queue is thread-safe */
+            try {
+                if (jobs > 1) {
+                    be.parallel(push, jobs);
+                } else {
+                    be.foreach(push);
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            /* no more items */
+            queue.close();
+        });
+
+        /* add every file, contents are moved into the pool right away if any */
+        try {
+            for (Item item; queue.pop(&item);) {
+                XLOGF(DBG, "Loading file {:s}", item.name);
+                nb += item.data.len();
+
+                /* report progress, cancelled loads stop here */
+                if (progress != nullptr) {
+                    progress->update(item.data.len(), be.progress());
+                }
+
+                /* the memfd pool is not part of the budget */
+                auto size = item.data.borrowed() || pool != nullptr ? 0 : item.data.len();
+
+                /* identical contents share the same storage, and only count once */
+                if (dedupe != nullptr) {
+                    auto saved = dedupe->saved;
+                    item.data  = ContentStore::instance().intern(item.key, std::move(item.data), dedupe);
+                    size      -= dedupe->saved - saved;
+                }
+
+                /* spill the contents right away if they do not fit in the budget,
+                 * the whole archive is rejected if even that does not work */
+                if (auto id = item.data.id(); mem.admit(item.data, size, &held)) {
+                    spill += size;
+                    ContentStore::instance().rebind(id, item.data);
+                }
+
+                /* keep the contents in memory */
+                if (pool == nullptr) {
+                    ret->resolve(item.name, Missing::Create, true, &item.stat, &item.data);
+                    continue;
+                }
+
+                /* the pool can only be mapped after sealing, remember where the contents are */
+                auto len  = item.data.len();
+                auto off  = pool->append(item.data);
+                auto node = ret->resolve(item.name, Missing::Create, true, &item.stat);
+
+                /* only regular files have contents */
+                if (S_ISREG(node->stat().st_mode)) {
+                    ents.emplace_back(std::move(node), off, len);
+                }
+            }
+        } catch (...) {
+            queue.close();
+            producer.join();
+            throw;
+        }
+
+        /* check for decoding errors */
+        producer.join();
+        if (error != nullptr) std::rethrow_exception(error);
+
+        /* seal the pool, and serve the contents from it */
+        if (pool != nullptr) {
+            pool->seal();
+            XLOGF(INFO, "Contents sealed into a {:d} bytes memfd pool.", pool->size());
+
+            /* attach the contents */
+            for (auto &[node, off, len] : ents) {
+                node->_data = pool->slice(off, len);
+            }
+        }
+
+        /* loaded trees are shared by every mount, and never modified in place */
+        auto sec = (double)(T::now() - now) * 1e-9;
+        ret->freeze();
+        XLOGF(INFO, "Storage initialized successfully in {:.3f}s, {:.1f} MiB/s with {:d} jobs.", sec, nb / sec / 1048576.0, jobs);
+
+        /* report metadata overhead */
+        ret->report();
+
+        /* report memory usage */
+        if (spill != 0) {
+            XLOGF(INFO, "{:d} bytes kept in memory, {:d} bytes spilled.", held, spill);
+        }
+
+        /* report deduplication results */
+        if (dedupe != nullptr) {
+            XLOGF(INFO, "Deduplicated {:d} of {:d} files, {:d} bytes saved, ratio {:.2f}.", dedupe->dupes, dedupe->files, dedupe->saved, dedupe->ratio());
+        }
+        return ret;
+    }
+
+public:
+    static Node index(const std::shared_ptr<const Backend> &be, LoadProgress *progress = nullptr) {
         auto now = T::now();
-        auto ret = std::make_shared<FileNode>();
+        auto ret = make();
+
+        /* add every file, contents are fetched on first access */
+        be->scan([&](const std::string &name, Stat stat, size_t index) {
+            XLOGF(DBG, "Indexing file {:s}", name); // NOLINT(bugprone-lambda-function-name)
+            auto node = ret->resolve(name, Missing::Create, true, &stat);
 
-        /* add every file */
-        be.foreach([&](const std::string &name, Stat stat, ByteBuffer data) {
-            XLOG(INFO, "Loading file " + name); // NOLINT(bugprone-lambda-function-name)
-            ret->resolve(name, Missing::Create, nullptr, &stat, &data, nullptr);
+            /* report progress, cancelled loads stop here */
+            if (progress != nullptr) {
+                progress->update(stat.st_size, be->progress());
+            }
+
+            /* only regular files have contents */
+            if (S_ISREG(node->stat().st_mode)) {
+                node->_lazy = std::make_shared<LazyBuffer>(be, index);
+            }
         });
 
-        /* log the time cost */
-        XLOGF(INFO, "Storage initialized successfully in {:.3f}s.", (double)(T::now() - now) * 1e-9);
+        /* loaded trees are shared by every mount, and never modified in place */
+        ret->freeze();
+        ret->report();
+        XLOGF(INFO, "Storage indexed successfully in {:.3f}s.", (double)(T::now() - now) * 1e-9);
         return ret;
     }
 
+public:
+    static Node make() {
+        if (auto *mem = NodeArena::current()) {
+            return std::allocate_shared<FileNode>(ArenaAllocator<FileNode>(mem));
+        } else {
+            return std::make_shared<FileNode>();
+        }
+    }
+
+public:
+    static Node   merge(const std::vector<Node> &layers);
+    static size_t trim(const std::vector<Node> &roots, size_t limit);
+    static size_t reclaim(const std::vector<Node> &roots, size_t target);
+
+private:
+    static Node   strip(const Node &node);
+    static size_t evict(std::vector<Node> &nodes, size_t want);
+
+public:
+    static std::atomic_uint64_t &epoch(std::string_view path);
+
+public:
+    static Stat defstat(mode_t mode) {
+        Stat st = {};
+        setstat(&st, mode);
+        return st;
+    }
+
 public:
     static void setstat(Stat *st, mode_t mode) {
         st->st_mode      = mode;
@@ -0,0 +1,72 @@
+#ifndef SANDBOX_FS_FUSE_BUFFER_H
+#define SANDBOX_FS_FUSE_BUFFER_H
+
+#include <fuse_common.h>
+
+#include "fuse_error.h"
+#include "sandbox_file.h"
+
+struct FuseBuffer {
+    const char * mem;
+    size_t       len;
+    int          fd;
+    off_t        pos;
+
+public:
+    FuseBuffer(const char *mem, size_t len, int fd, off_t pos) : mem(mem), len(len), fd(fd), pos(pos) {}
+
+#if FUSE_VERSION >= 29
+public:
+    [[nodiscard]] struct fuse_buf buf() const {
+        struct fuse_buf ret = {};
+
+        /* descriptor-backed buffers can be spliced */
+        if (fd < 0) {
+            ret.size  = len;
+            ret.mem   = const_cast<char *>(mem);
+            ret.fd    = -1;
+        } else {
+            ret.size  = len;
+            ret.flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            ret.fd    = fd;
+            ret.pos   = pos;
+        }
+
+        /* all done */
+        return ret;
+    }
+#endif
+};
+
+#if FUSE_VERSION >= 29
+
+static inline ssize_t writeBuffer(SandboxFile *fp, struct fuse_bufvec *src, off_t off) {
+    int  err = 0;
+    auto ret = fp->fill(fuse_buf_size(src), off, [&](char *buf, size_t len) -> size_t {
+        ssize_t            nb;
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+
+        /* copy straight into the file pages, spliced requests are read from the pipe without staging */
+        dst.buf[0].mem = buf;
+        nb = fuse_buf_copy(&dst, src, static_cast<enum fuse_buf_copy_flags>(0));
+
+        /* check for errors */
+        if (nb >= 0) {
+            return nb;
+        } else {
+            err = static_cast<int>(-nb);
+            return 0;
+        }
+    });
+
+    /* report errors only if nothing was written */
+    if (ret == 0 && err != 0) {
+        throw FuseError(err);
+    } else {
+        return ret;
+    }
+}
+
+#endif
+
+#endif /* SANDBOX_FS_FUSE_BUFFER_H */
@@ -0,0 +1,41 @@
+#ifndef SANDBOX_FS_FUSE_SESSION_H
+#define SANDBOX_FS_FUSE_SESSION_H
+
+#include <fuse.h>
+#include "fuse_error.h"
+
+struct FuseChannel {
+    const char *       mp;
+    struct fuse_chan * ch;
+
+public:
+    ~FuseChannel() { fuse_unmount(mp, ch); }
+    FuseChannel(const char *mp, struct fuse_args *args) : mp(mp) {
+        if ((ch = fuse_mount(mp, args)) == nullptr) {
+            throw FuseError();
+        }
+    }
+};
+
+struct FuseSignals {
+    struct fuse_session *fs = nullptr;
+
+public:
+    ~FuseSignals() {
+        if (fs != nullptr) {
+            fuse_remove_signal_handlers(fs);
+        }
+    }
+
+public:
+    bool init(struct fuse_session *ss) {
+        if (fuse_set_signal_handlers(ss) != 0) {
+            return false;
+        } else {
+            fs = ss;
+            return true;
+        }
+    }
+};
+
+#endif /* SANDBOX_FS_FUSE_SESSION_H */
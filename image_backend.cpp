@@ -0,0 +1,302 @@
+#include <mutex>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <folly/logging/xlog.h>
+#include <folly/hash/SpookyHashV2.h>
+
+#include "timer.h"
+#include "fuse_error.h"
+#include "image_backend.h"
+
+static constexpr uint64_t HashSeed = 0x73616e64626f7869;
+
+namespace {
+struct TempFile {
+    int         fd;
+    bool        done;
+    std::string name;
+
+public:
+    ~TempFile() {
+        close(fd);
+        if (!done) unlink(name.c_str());
+    }
+};
+}
+
+static inline void writeAll(int fd, const void *buf, size_t len, uint64_t off) {
+    auto    mem = static_cast<const char *>(buf);
+    ssize_t ret;
+
+    /* short writes are possible */
+    while (len != 0) {
+        if ((ret = pwrite(fd, mem, len, off)) < 0) {
+            throw FuseError();
+        } else {
+            mem += ret;
+            off += ret;
+            len -= ret;
+        }
+    }
+}
+
+static inline uint64_t align(uint64_t v, uint64_t n) {
+    return (v + n - 1) & ~(n - 1);
+}
+
+ImageBackend::ImageBackend(const std::string &fname, const Source *src) : _fd(-1), _len(0), _mem(nullptr), _hdr(nullptr), _recs(nullptr) {
+    void *      mem;
+    struct stat st = {};
+
+    /* open the image */
+    if ((_fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        throw FuseError();
+    }
+
+    /* find the image size */
+    if (fstat(_fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+        auto err = errno;
+        close(_fd);
+        throw FuseError(err == 0 ? EINVAL : err, "invalid image");
+    }
+
+    /* map the whole image, the descriptor is kept so that reads can be spliced from it */
+    if ((mem = mmap(nullptr, (_len = st.st_size), PROT_READ, MAP_SHARED, _fd, 0)) == MAP_FAILED) {
+        auto err = errno;
+        close(_fd);
+        throw FuseError(err);
+    }
+
+    /* the mapping lives as long as any buffer that refers to it */
+    _mem = static_cast<const char *>(mem);
+    _hdr = reinterpret_cast<const Header *>(_mem);
+    _map = std::shared_ptr<const void>(mem, [fd = _fd, len = _len](const void *p) {
+        munmap(const_cast<void *>(p), len);
+        close(fd);
+    });
+
+    /* check the header, records are checked when used */
+    if (memcmp(_hdr->magic, Magic, sizeof(Magic)) != 0 || _hdr->version != Version || _hdr->size != _len) {
+        throw FuseError(EINVAL, "invalid image");
+    }
+
+    /* the archive might have been replaced since the image was compiled */
+    if (src != nullptr && memcmp(&_hdr->source, src, sizeof(Source)) != 0) {
+        throw FuseError(ESTALE, "stale image");
+    }
+
+    /* the tables must be within the image */
+    if (_hdr->names > _len || _hdr->table > _hdr->names || (_hdr->names - _hdr->table) / sizeof(Record) < _hdr->count) {
+        throw FuseError(EINVAL, "invalid image");
+    }
+
+    /* nothing to parse, the record table is used in place */
+    _recs = reinterpret_cast<const Record *>(_mem + _hdr->table);
+    XLOGF(INFO, "Image '{:s}' mapped with {:d} entries.", fname, _hdr->count);
+}
+
+void ImageBackend::foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const {
+    for (size_t i = 0; i < _hdr->count; i++) {
+        done = (double)(i + 1) / (double)_hdr->count;
+        func(name(_recs[i]), stat(_recs[i]), slice(_recs[i]));
+    }
+}
+
+void ImageBackend::scan(std::function<void(std::string, struct stat, size_t)> &&func) const {
+    for (size_t i = 0; i < _hdr->count; i++) {
+        done = (double)(i + 1) / (double)_hdr->count;
+        func(name(_recs[i]), stat(_recs[i]), i);
+    }
+}
+
+ByteBuffer ImageBackend::fetch(size_t index) const {
+    if (index >= _hdr->count) {
+        throw FuseError(EIO, "image entry " + std::to_string(index) + " no longer exists");
+    } else {
+        return slice(_recs[index]);
+    }
+}
+
+std::string ImageBackend::name(const Record &rec) const {
+    if (rec.name > _len - _hdr->names || rec.nlen > _len - _hdr->names - rec.name) {
+        throw FuseError(EIO, "corrupted image");
+    } else {
+        return std::string(_mem + _hdr->names + rec.name, rec.nlen);
+    }
+}
+
+struct stat ImageBackend::stat(const Record &rec) const {
+    struct stat st = {};
+
+    /* only the attributes archives have are kept */
+    st.st_mode              = rec.mode;
+    st.st_nlink             = 1;
+    st.st_uid               = rec.uid;
+    st.st_gid               = rec.gid;
+    st.st_size              = static_cast<off_t>(rec.len);
+    st.st_atimespec.tv_sec  = rec.atime[0];
+    st.st_atimespec.tv_nsec = rec.atime[1];
+    st.st_mtimespec.tv_sec  = rec.mtime[0];
+    st.st_mtimespec.tv_nsec = rec.mtime[1];
+    st.st_ctimespec.tv_sec  = rec.ctime[0];
+    st.st_ctimespec.tv_nsec = rec.ctime[1];
+    return st;
+}
+
+ByteBuffer ImageBackend::slice(const Record &rec) const {
+    if (rec.len == 0) {
+        return ByteBuffer();
+    } else if (rec.off > _hdr->table || rec.len > _hdr->table - rec.off) {
+        throw FuseError(EIO, "corrupted image");
+    } else {
+        return ByteBuffer::wrap(_mem + rec.off, rec.len, _map, _fd, static_cast<off_t>(rec.off));
+    }
+}
+
+bool ImageBackend::probe(const std::string &fname) {
+    int  fd;
+    char buf[sizeof(Magic)];
+
+    /* open the file */
+    if ((fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+
+    /* check for the magic number */
+    auto ret = pread(fd, buf, sizeof(buf), 0) == sizeof(buf) && memcmp(buf, Magic, sizeof(Magic)) == 0;
+    close(fd);
+    return ret;
+}
+
+void ImageBackend::compile(const Backend &be, const std::string &fname, const Source &src, size_t jobs) {
+    int                                     fd;
+    auto                                    now  = T::now();
+    auto                                    tmp  = fname + ".XXXXXX";
+    uint64_t                                end  = Alignment;
+    std::mutex                              mutex;
+    std::unordered_map<std::string, Record> ents;
+
+    /* write to a temporary file, so that a partial image is never picked up */
+    if ((fd = mkstemp(tmp.data())) < 0) {
+        throw FuseError();
+    }
+
+    /* the temporary file is removed on errors */
+    TempFile file { fd, false, tmp };
+    auto     push = [&](std::string name, struct stat st, ByteBuffer data) {
+        size_t   pos = 0;
+        uint64_t len = data.len();
+        Record   rec = {};
+
+        /* reserve page-aligned space for the data */
+        if (len != 0) {
+            std::lock_guard<std::mutex> _(mutex);
+            rec.off = end;
+            end     = align(end + len, Alignment);
+        }
+
+        /* write the data, holes are written as zeros */
+        data.scatter(len, 0, [&](const char *mem, size_t cnt, int, off_t) {
+            writeAll(fd, mem, cnt, rec.off + pos);
+            pos += cnt;
+        });
+
+        /* fill the record */
+        rec.len      = len;
+        rec.mode     = st.st_mode;
+        rec.uid      = st.st_uid;
+        rec.gid      = st.st_gid;
+        rec.atime[0] = st.st_atimespec.tv_sec;
+        rec.atime[1] = st.st_atimespec.tv_nsec;
+        rec.mtime[0] = st.st_mtimespec.tv_sec;
+        rec.mtime[1] = st.st_mtimespec.tv_nsec;
+        rec.ctime[0] = st.st_ctimespec.tv_sec;
+        rec.ctime[1] = st.st_ctimespec.tv_nsec;
+
+        /* later entries with the same name replace earlier ones, just like loading does */
+        std::lock_guard<std::mutex> _(mutex);
+        ents.insert_or_assign(std::move(name), rec);
+    };
+
+    /* decode every entry into the data section */
+    if (jobs > 1) {
+        be.parallel(push, jobs);
+    } else {
+        be.foreach(push);
+    }
+
+    /* sort the entries by name */
+    std::vector<std::pair<std::string, Record>> recs(ents.begin(), ents.end());
+    std::sort(recs.begin(), recs.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+    /* build the name pool and the record table */
+    std::string         names;
+    std::vector<Record> table;
+
+    /* names are referenced by offset and length */
+    for (auto &[name, rec] : recs) {
+        rec.name = names.size();
+        rec.nlen = name.size();
+        names.append(name);
+        table.emplace_back(rec);
+    }
+
+    /* the tables follow the data section */
+    Header hdr  = {};
+    hdr.version = Version;
+    hdr.count   = table.size();
+    hdr.table   = end;
+    hdr.names   = hdr.table + table.size() * sizeof(Record);
+    hdr.size    = hdr.names + names.size();
+    hdr.source  = src;
+    memcpy(hdr.magic, Magic, sizeof(Magic));
+
+    /* write the tables, and the header at last */
+    writeAll(fd, table.data(), table.size() * sizeof(Record), hdr.table);
+    writeAll(fd, names.data(), names.size(), hdr.names);
+    writeAll(fd, &hdr, sizeof(Header), 0);
+
+    /* make sure the image is complete before it becomes visible, and is never written again */
+    if (fchmod(fd, 0444) != 0 || fsync(fd) != 0 || rename(tmp.c_str(), fname.c_str()) != 0) {
+        throw FuseError();
+    }
+
+    /* all done */
+    file.done = true;
+    XLOGF(INFO, "Image '{:s}' compiled with {:d} entries in {:.3f}s.", fname, hdr.count, (double)(T::now() - now) * 1e-9);
+}
+
+ImageBackend::Source ImageBackend::source(const std::string &fname) {
+    Source      ret = {};
+    struct stat st  = {};
+
+    /* only the identity of the archive is checked, reading it would cost as much as decoding */
+    if (::stat(fname.c_str(), &st) != 0) {
+        throw FuseError();
+    }
+
+    /* the same file, not modified since */
+    ret.dev      = st.st_dev;
+    ret.ino      = st.st_ino;
+    ret.size     = st.st_size;
+    ret.mtime[0] = st.st_mtimespec.tv_sec;
+    ret.mtime[1] = st.st_mtimespec.tv_nsec;
+    return ret;
+}
+
+std::string ImageBackend::key(const Source &src) {
+    uint64_t h1 = HashSeed;
+    uint64_t h2 = HashSeed;
+    char     str[33];
+
+    /* format as hex */
+    folly::hash::SpookyHashV2::Hash128(&src, sizeof(Source), &h1, &h2);
+    snprintf(str, sizeof(str), "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+    return str;
+}
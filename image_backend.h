@@ -0,0 +1,82 @@
+#ifndef SANDBOX_FS_IMAGE_BACKEND_H
+#define SANDBOX_FS_IMAGE_BACKEND_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <sys/stat.h>
+
+#include "backend.h"
+
+/* images are mapped shared and served in place, they are written to a temporary file and renamed
+ * into place, never modified afterwards, and made read-only, since truncating a mapped image would
+ * fault every reader that touches the missing pages */
+class ImageBackend : public Backend {
+public:
+    struct Source {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t  mtime[2];
+    };
+
+private:
+    struct Header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t table;
+        uint64_t names;
+        uint64_t size;
+        Source   source;
+    };
+
+private:
+    struct Record {
+        uint64_t name;
+        uint32_t nlen;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint64_t off;
+        uint64_t len;
+        int64_t  atime[2];
+        int64_t  mtime[2];
+        int64_t  ctime[2];
+    };
+
+private:
+    static constexpr uint32_t Version   = 2;
+    static constexpr size_t   Alignment = 4096;
+    static constexpr char     Magic[8]  = { 'S', 'B', 'F', 'S', 'I', 'M', 'G', 0 };
+
+private:
+    int                         _fd;
+    size_t                      _len;
+    const char *                _mem;
+    const Header *              _hdr;
+    const Record *              _recs;
+    std::shared_ptr<const void> _map;
+
+public:
+    virtual ~ImageBackend() = default;
+    explicit ImageBackend(const std::string &fname, const Source *src = nullptr);
+
+public:
+    void       foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const override;
+    void       scan(std::function<void(std::string, struct stat, size_t)> &&func) const override;
+    ByteBuffer fetch(size_t index) const override;
+
+private:
+    [[nodiscard]] std::string name(const Record &rec) const;
+    [[nodiscard]] struct stat stat(const Record &rec) const;
+    [[nodiscard]] ByteBuffer  slice(const Record &rec) const;
+
+public:
+    static bool        probe(const std::string &fname);
+    static void        compile(const Backend &be, const std::string &fname, const Source &src, size_t jobs = 1);
+    static Source      source(const std::string &fname);
+    static std::string key(const Source &src);
+};
+
+#endif /* SANDBOX_FS_IMAGE_BACKEND_H */
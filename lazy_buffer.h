@@ -0,0 +1,39 @@
+#ifndef SANDBOX_FS_LAZY_BUFFER_H
+#define SANDBOX_FS_LAZY_BUFFER_H
+
+#include <mutex>
+#include <memory>
+
+#include "backend.h"
+#include "byte_buffer.h"
+
+class LazyBuffer {
+    size_t                         _index;
+    ByteBuffer                     _data;
+    std::once_flag                 _once;
+    std::shared_ptr<const Backend> _backend;
+
+public:
+    LazyBuffer(std::shared_ptr<const Backend> backend, size_t index) : _index(index), _backend(std::move(backend)) {}
+
+public:
+    LazyBuffer(LazyBuffer &&) = delete;
+    LazyBuffer(const LazyBuffer &) = delete;
+
+public:
+    LazyBuffer &operator=(LazyBuffer &&) = delete;
+    LazyBuffer &operator=(const LazyBuffer &) = delete;
+
+public:
+    const ByteBuffer &get() {
+        std::call_once(_once, [this] {
+            _data = _backend->fetch(_index);
+            _backend.reset();
+        });
+
+        /* every caller shares the same decompressed storage */
+        return _data;
+    }
+};
+
+#endif /* SANDBOX_FS_LAZY_BUFFER_H */
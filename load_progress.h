@@ -0,0 +1,30 @@
+#ifndef SANDBOX_FS_LOAD_PROGRESS_H
+#define SANDBOX_FS_LOAD_PROGRESS_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "fuse_error.h"
+
+/* progress of an archive being loaded, updated by the loading thread for every entry and read by
+ * anyone, the load is aborted with `ECANCELED` at the next entry once it has been cancelled, `input`
+ * is the fraction of the archive consumed, as reported by the backend, 0 if it can not tell */
+struct LoadProgress {
+    std::atomic_uint64_t bytes   {0};
+    std::atomic_uint64_t entries {0};
+    std::atomic<double>  input   {0.0};
+    std::atomic_bool     cancel  {false};
+
+public:
+    void update(size_t nb, double in) {
+        if (cancel.load(std::memory_order_relaxed)) {
+            throw FuseError(ECANCELED);
+        } else {
+            input.store(in, std::memory_order_relaxed);
+            bytes.fetch_add(nb, std::memory_order_relaxed);
+            entries.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif /* SANDBOX_FS_LOAD_PROGRESS_H */
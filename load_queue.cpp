@@ -0,0 +1,126 @@
+#include <chrono>
+#include <algorithm>
+#include <folly/logging/xlog.h>
+
+#include "timer.h"
+#include "byte_buffer.h"
+#include "load_queue.h"
+#include "memory_budget.h"
+
+const char *LoadJob::name(State state) {
+    switch (state) {
+        case State::Queued    : return "queued";
+        case State::Loading   : return "loading";
+        case State::Done      : return "done";
+        case State::Failed    : return "failed";
+        case State::Cancelled : return "cancelled";
+    }
+
+    /* should never happen */
+    return "unknown";
+}
+
+LoadQueue::~LoadQueue() {
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        _done = true;
+
+        /* jobs that never started are dropped, the running ones stop at the next entry */
+        for (auto &job : _jobs) job->state = LoadJob::State::Cancelled;
+        for (auto &job : _active) job->progress.cancel = true;
+
+        /* wake up every worker */
+        _jobs.clear();
+        _cond.notify_all();
+    }
+
+    /* wait for the running jobs to unwind */
+    for (auto &thread : _threads) {
+        thread.join();
+    }
+}
+
+LoadQueue::LoadQueue(size_t workers, Runner &&run) : _done(false), _held(0), _run(std::move(run)) {
+    for (size_t i = 0; i < workers; i++) {
+        _threads.emplace_back([this] { worker(); });
+    }
+}
+
+void LoadQueue::submit(Job job) {
+    std::lock_guard<std::mutex> _(_mutex);
+    _jobs.emplace_back(std::move(job));
+    _cond.notify_all();
+}
+
+bool LoadQueue::cancel(const Job &job) {
+    std::lock_guard<std::mutex> _(_mutex);
+    auto iter = std::find(_jobs.begin(), _jobs.end(), job);
+
+    /* running jobs notice the flag at the next entry */
+    job->progress.cancel = true;
+    if (iter == _jobs.end()) {
+        return !job->finished();
+    }
+
+    /* jobs that have not started yet are dropped right away */
+    _jobs.erase(iter);
+    job->finish = T::now();
+    job->state  = LoadJob::State::Cancelled;
+    return true;
+}
+
+void LoadQueue::worker() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (Job job; (job = next(lock)) != nullptr;) {
+        lock.unlock();
+        job->start = T::now();
+        job->state = LoadJob::State::Loading;
+
+        /* load the archive, the runner is expected to clean up after itself on errors */
+        try {
+            _run(*job);
+            job->finish = T::now();
+            job->state  = LoadJob::State::Done;
+        } catch (const FuseError &e) {
+            job->error  = e.message();
+            job->finish = T::now();
+            job->state  = e.code() == ECANCELED ? LoadJob::State::Cancelled : LoadJob::State::Failed;
+        } catch (const std::exception &e) {
+            job->error  = e.what();
+            job->finish = T::now();
+            job->state  = LoadJob::State::Failed;
+        }
+
+        /* the memory held by this job is now accounted by the budget itself */
+        lock.lock();
+        _held -= job->total;
+        _active.erase(std::find(_active.begin(), _active.end(), job));
+        _cond.notify_all();
+    }
+}
+
+LoadQueue::Job LoadQueue::next(std::unique_lock<std::mutex> &lock) {
+    for (;;) {
+        auto &mem  = MemoryBudget::instance();
+        auto  used = static_cast<size_t>(std::max<int64_t>(0, ByteBuffer::allocated()));
+
+        /* shutting down */
+        if (_done) {
+            return nullptr;
+        }
+
+        /* find the first job that fits in the budget */
+        for (auto it = _jobs.begin(); it != _jobs.end(); ++it) {
+            if (_active.empty() || mem.limit() == 0 || used + _held + (*it)->total <= mem.limit()) {
+                auto job = std::move(*it);
+                _held += job->total;
+                _jobs.erase(it);
+                _active.emplace_back(job);
+                return job;
+            }
+        }
+
+        /* memory might also be released by unloading archives, which does not go through the queue */
+        _cond.wait_for(lock, std::chrono::seconds(1));
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef SANDBOX_FS_LOAD_QUEUE_H
+#define SANDBOX_FS_LOAD_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "load_progress.h"
+
+struct LoadJob {
+    enum class State {
+        Queued,
+        Loading,
+        Done,
+        Failed,
+        Cancelled,
+    };
+
+public:
+    std::string          file;
+    std::string          token;
+    bool                 lazy;
+    size_t               total;
+    std::atomic_uint64_t start;
+    std::atomic_uint64_t finish;
+    std::atomic<State>   state;
+    std::string          error;
+    LoadProgress         progress;
+
+public:
+    LoadJob(std::string file, std::string token, bool lazy, size_t total) :
+        file   (std::move(file)),
+        token  (std::move(token)),
+        lazy   (lazy),
+        total  (total),
+        start  (0),
+        finish (0),
+        state  (State::Queued) {}
+
+public:
+    [[nodiscard]] bool finished() const {
+        return state.load(std::memory_order_acquire) > State::Loading;
+    }
+
+public:
+    static const char *name(State state);
+};
+
+/* a fixed number of threads loading archives in the background, archives are estimated to take about as
+ * much memory as their size on disk, and a job only starts when that fits in what is left of the memory
+ * budget after the loads in progress, unless nothing else is loading, so a huge archive is never starved */
+class LoadQueue {
+public:
+    typedef std::shared_ptr<LoadJob>       Job;
+    typedef std::function<void(LoadJob &)> Runner;
+
+private:
+    bool                     _done;
+    size_t                   _held;
+    Runner                   _run;
+    std::mutex               _mutex;
+    std::deque<Job>          _jobs;
+    std::vector<Job>         _active;
+    std::condition_variable  _cond;
+    std::vector<std::thread> _threads;
+
+public:
+   ~LoadQueue();
+    LoadQueue(size_t workers, Runner &&run);
+
+public:
+    void submit(Job job);
+    bool cancel(const Job &job);
+
+private:
+    void worker();
+    Job  next(std::unique_lock<std::mutex> &lock);
+};
+
+#endif /* SANDBOX_FS_LOAD_QUEUE_H */
@@ -1,4 +1,6 @@
+#include <memory>
 #include <csignal>
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <gflags/gflags.h>
@@ -10,9 +12,13 @@
 
 #include "file_node.h"
 #include "fuse_error.h"
+#include "stats_file.h"
+#include "memory_budget.h"
+#include "control_server.h"
 #include "control_interface.h"
 #include "sandbox_controller.h"
 #include "sandbox_file_system.h"
+#include "sandbox_low_level_file_system.h"
 
 FOLLY_INIT_LOGGING_CONFIG(
     ".=INFO;"
@@ -30,6 +36,21 @@ FOLLY_INIT_LOGGING_CONFIG(
 #pragma ide diagnostic ignored "cert-err58-cpp"
 
 DEFINE_string(o, "", "VFS mount options");
+DEFINE_string(ctl_socket, "", "Path of a Unix socket to serve control commands on, empty to disable");
+DEFINE_string(ctl_socket_mode, "0600", "Permissions of the control socket in octal, anyone who can connect can control the sandbox");
+DEFINE_uint32(ctl_workers, 4, "Number of threads to execute control commands from the Unix socket with");
+DEFINE_bool(lowlevel, false, "Use the inode-based FUSE low-level API");
+DEFINE_double(cache_ttl, 0.0, "Kernel cache timeout in seconds for archive-backed nodes, 0 to disable");
+DEFINE_bool(memfd, false, "Keep loaded archive contents in sealed memfds, or unlinked temporary files where memfds are not available");
+DEFINE_bool(dedupe, true, "Share identical file contents across loaded archives");
+DEFINE_bool(node_arenas, true, "Allocate the nodes and names of each loaded archive from an arena released as a whole");
+DEFINE_uint32(load_jobs, 0, "Number of threads to decode archive entries with, 0 for one per core");
+DEFINE_uint32(load_workers, 2, "Number of archives to load in the background at the same time");
+DEFINE_string(image_dir, "", "Directory to keep compiled archive images in, empty to disable");
+DEFINE_uint64(mem_limit, 0, "Memory budget for file data in MiB, 0 for unlimited");
+DEFINE_uint64(token_mem_limit, 0, "Memory budget for the file data of each loaded archive in MiB, 0 for unlimited");
+DEFINE_string(spill_dir, "", "Directory to spill cold file data to when over the memory budget, empty to disable");
+DEFINE_uint64(spill_limit, 0, "Maximum size of the spill file in MiB, 0 for unlimited");
 
 #pragma clang diagnostic pop
 
@@ -37,10 +58,10 @@ int main(int argc, char **argv) {
     google::SetUsageMessage("[OPTIONS] mountpoint");
     google::SetVersionString("v1.0");
 
-    /* initialize folly & control interface */
-    folly::Init        init  (&argc, &argv);
-    FileNode::Node     root  (SandboxController::root());
-    ControlInterface * iface (SandboxController::iface());
+    /* initialize folly & control interfaces */
+    folly::Init    init  (&argc, &argv);
+    FileNode::Node root  (SandboxController::root());
+    ControlFiles   ctrls ({SandboxController::iface(), StatsFile::iface()});
 
     /* mount point cannot be empty */
     if (argc < 2) {
@@ -49,6 +70,16 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* the socket mode is given in octal, like chmod */
+    char *end  = nullptr;
+    auto  mode = static_cast<mode_t>(strtoul(FLAGS_ctl_socket_mode.c_str(), &end, 8));
+
+    /* check for the socket mode */
+    if (FLAGS_ctl_socket_mode.empty() || *end != 0 || mode > 07777) {
+        std::cerr << "* error: invalid control socket mode: " << FLAGS_ctl_socket_mode << std::endl;
+        return 1;
+    }
+
     /* can have at most 1 mount point */
     if (argc > 2) {
         std::cerr << "* error: multiple mountpoints is not supported." << std::endl;
@@ -56,16 +87,43 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* cold file data is spilled to disk when over the memory budget */
+    try {
+        MemoryBudget::instance().configure(
+            FLAGS_mem_limit << 20,
+            FLAGS_token_mem_limit << 20,
+            FLAGS_spill_dir.empty() ? nullptr : std::make_unique<SpillFile>(FLAGS_spill_dir, FLAGS_spill_limit << 20),
+            [](size_t target) { return FileNode::reclaim(SandboxController::roots(), target); },
+            [](size_t limit) { return FileNode::trim(SandboxController::mounted(), limit); }
+        );
+    } catch (const FuseError &e) {
+        std::cerr << "* error: cannot create the spill file: " << e.message() << std::endl;
+        return 1;
+    }
+
     /* reset signal handlers */
     signal(SIGINT, SIG_DFL);
     signal(SIGHUP, SIG_DFL);
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
 
-    /* start the file system */
+    /* start the file system, the control socket and the reclaimer must be gone before the controller */
     try {
-        SandboxController::Guard _;
-        SandboxFileSystem(root, iface).start(argv[1], FLAGS_o);
+        SandboxController::Guard       _;
+        MemoryBudget::Guard            budget;
+        std::unique_ptr<ControlServer> ctl;
+
+        /* control commands can also be sent through a Unix socket */
+        if (!FLAGS_ctl_socket.empty()) {
+            ctl = std::make_unique<ControlServer>(FLAGS_ctl_socket, std::max(1u, FLAGS_ctl_workers), mode);
+        }
+
+        /* mount the sandbox */
+        if (FLAGS_lowlevel) {
+            SandboxLowLevelFileSystem(root, ctrls, FLAGS_cache_ttl).start(argv[1], FLAGS_o);
+        } else {
+            SandboxFileSystem(root, ctrls, FLAGS_cache_ttl).start(argv[1], FLAGS_o);
+        }
     } catch (const FuseError &e) {
         XLOGF(ERR, "* error: FuseError: [{:d}] {:s}.", e.code(), e.message());
         return e.code();
@@ -0,0 +1,359 @@
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <exception>
+#include <string_view>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <archive_entry.h>
+#include <folly/logging/xlog.h>
+
+#include "timer.h"
+#include "fuse_error.h"
+#include "file_backend.h"
+#include "mapped_backend.h"
+
+static constexpr size_t Unmapped = SIZE_MAX;
+
+namespace {
+struct Cursor {
+    size_t                 idx = 0;
+    struct archive *       fp  = nullptr;
+    struct archive_entry * val = nullptr;
+
+public:
+    ~Cursor() {
+        if (fp != nullptr) {
+            archive_read_free(fp);
+        }
+    }
+
+public:
+    struct archive_entry *seek(size_t index) {
+        int ret;
+
+        /* archive handles are forward-only, skip over the headers in between */
+        while (idx <= index) {
+            if ((ret = archive_read_next_header(fp, &val)) == ARCHIVE_OK) {
+                idx++;
+            } else if (ret == ARCHIVE_EOF) {
+                throw FuseError(EIO, "archive entry " + std::to_string(index) + " no longer exists");
+            } else {
+                throw FuseError(archive_errno(fp), archive_error_string(fp));
+            }
+        }
+
+        /* the entry we want */
+        return val;
+    }
+};
+}
+
+MappedBackend::MappedBackend(const std::string &fname) : _fd(-1), _fmt(0), _len(0), _mem(nullptr) {
+    int         ret;
+    void *      mem;
+    Cursor      src;
+    struct stat st = {};
+
+    /* open the archive, the descriptor is kept so that truncation can be detected */
+    if ((_fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        throw FuseError();
+    }
+
+    /* find the archive size */
+    if (fstat(_fd, &st) != 0) {
+        auto err = errno;
+        close(_fd);
+        throw FuseError(err);
+    }
+
+    /* empty files can never be archives */
+    if ((_len = st.st_size) == 0) {
+        close(_fd);
+        throw FuseError(EINVAL, "empty archive");
+    }
+
+    /* map the whole archive */
+    mem = mmap(nullptr, _len, PROT_READ, MAP_PRIVATE, _fd, 0);
+
+    /* check for mapping errors */
+    if (mem == MAP_FAILED) {
+        auto err = errno;
+        close(_fd);
+        throw FuseError(err);
+    }
+
+    /* the mapping lives as long as any buffer that refers to it */
+    _mem = static_cast<const char *>(mem);
+    _map = std::shared_ptr<const void>(mem, [fd = _fd, len = _len](const void *p) {
+        munmap(const_cast<void *>(p), len);
+        close(fd);
+    });
+
+    /* build the entry index, stored data is located but never copied */
+    for (src.fp = open(); (ret = archive_read_next_header(src.fp, &src.val)) == ARCHIVE_OK;) {
+        auto ent = Entry();
+
+        /* get the file name and stat */
+        ent.stat = *archive_entry_stat(src.val);
+        ent.name = std::string(archive_entry_pathname_utf8(src.val));
+
+        /* locate the data */
+        locate(src.fp, &ent);
+        _ents.emplace_back(std::move(ent));
+    }
+
+    /* check for EOF */
+    if (ret != ARCHIVE_EOF) {
+        throw FuseError(archive_errno(src.fp), archive_error_string(src.fp));
+    }
+
+    /* remember the archive format, it decides whether entries can be decoded independently */
+    _fmt  = archive_format(src.fp);
+    _name = archive_format_name(src.fp) == nullptr ? "unknown" : archive_format_name(src.fp);
+}
+
+void MappedBackend::foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const {
+    Cursor src;
+    size_t idx = 0;
+
+    /* stored entries are served from the mapping, others need to be decompressed */
+    for (auto &ent : _ents) {
+        if (ent.off != Unmapped) {
+            done = (double)(ent.off + ent.len) / (double)_len;
+            func(ent.name, ent.stat, slice(ent));
+        } else {
+            if (src.fp == nullptr) src.fp = open();
+            auto data = FileBackend::read(src.fp, src.seek(idx));
+            done = (double)archive_filter_bytes(src.fp, -1) / (double)_len;
+            func(ent.name, ent.stat, std::move(data));
+        }
+
+        /* move to next entry */
+        idx++;
+    }
+}
+
+void MappedBackend::scan(std::function<void(std::string, struct stat, size_t)> &&func) const {
+    for (size_t i = 0; i < _ents.size(); i++) {
+        func(_ents[i].name, _ents[i].stat, i);
+    }
+}
+
+void MappedBackend::parallel(std::function<void(std::string, struct stat, ByteBuffer)> &&func, size_t jobs) const {
+    std::mutex                                   mutex;
+    std::exception_ptr                           error;
+    std::vector<size_t>                          todo;
+    std::vector<std::thread>                     workers;
+    std::atomic_bool                             stop(false);
+    std::atomic_uint64_t                         busy(0);
+    std::atomic_uint64_t                         sent(0);
+    std::unordered_map<std::string_view, size_t> last;
+
+    /* only zip entries are compressed independently, decoding any entry of a solid or
+     * stream-compressed archive means decoding everything before it */
+    if (jobs <= 1 || (_fmt & ARCHIVE_FORMAT_BASE_MASK) != ARCHIVE_FORMAT_ZIP) {
+        foreach(std::move(func));
+        return;
+    }
+
+    /* entries are no longer delivered in order, so only the last one of the same name is delivered */
+    for (size_t i = 0; i < _ents.size(); i++) {
+        last[_ents[i].name] = i;
+    }
+
+    /* entries that need decoding */
+    for (size_t i = 0; i < _ents.size(); i++) {
+        if (_ents[i].off == Unmapped && last[_ents[i].name] == i) {
+            todo.emplace_back(i);
+        }
+    }
+
+    /* each worker takes every `jobs`-th entry with it's own forward-only handle */
+    auto now = T::now();
+    auto num = std::min(jobs, todo.size());
+    auto all = (double)last.size();
+
+    /* entries are delivered out of order, so progress is the share of entries delivered */
+    auto deliver = [&](const Entry &ent, ByteBuffer data) {
+        done = (double)++sent / all;
+        func(ent.name, ent.stat, std::move(data));
+    };
+
+    /* start the workers */
+    for (size_t k = 0; k < num; k++) {
+        workers.emplace_back([&, k] {
+            try {
+                Cursor src;
+                src.fp = open();
+
+                /* decode the entries */
+                for (size_t j = k; j < todo.size() && !stop; j += num) {
+                    auto &ent = _ents[todo[j]];
+                    auto  beg = T::now();
+                    auto  buf = FileBackend::read(src.fp, src.seek(todo[j]));
+
+                    /* deliver the entry */
+                    busy += T::now() - beg;
+                    deliver(ent, std::move(buf));
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> _(mutex);
+                stop  = true;
+                error = error == nullptr ? std::current_exception() : error;
+            }
+        });
+    }
+
+    /* stored entries are served from the mapping while the workers are decoding */
+    try {
+        for (size_t i = 0; i < _ents.size() && !stop; i++) {
+            if (_ents[i].off != Unmapped && last[_ents[i].name] == i) {
+                deliver(_ents[i], slice(_ents[i]));
+            }
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> _(mutex);
+        stop  = true;
+        error = error == nullptr ? std::current_exception() : error;
+    }
+
+    /* wait for the workers */
+    for (auto &th : workers) {
+        th.join();
+    }
+
+    /* check for errors */
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    }
+
+    /* report the effective parallelism */
+    auto wall = static_cast<double>(T::now() - now) * 1e-9;
+    auto cpus = static_cast<double>(busy.load()) * 1e-9;
+    XLOGF(INFO, "Decoded {:d} {:s} entries with {:d} workers in {:.3f}s, {:.2f}x parallelism.", todo.size(), _name, num, wall, wall > 0 ? cpus / wall : 0.0);
+}
+
+ByteBuffer MappedBackend::fetch(size_t index) const {
+    Cursor src;
+    auto & ent = _ents.at(index);
+
+    /* stored entries are served from the mapping */
+    if (ent.off != Unmapped) {
+        return slice(ent);
+    }
+
+    /* others need to be decompressed from a private handle */
+    src.fp = open();
+    return FileBackend::read(src.fp, src.seek(index));
+}
+
+struct archive *MappedBackend::open() const {
+    struct archive *fp;
+
+    /* decoding reads the mapping as well */
+    check();
+    fp = archive_read_new();
+
+    /* the archive is seekable in memory */
+    archive_read_support_filter_all(fp);
+    archive_read_support_format_all(fp);
+
+    /* open the archive from the mapping */
+    if (archive_read_open_memory(fp, _mem, _len) == ARCHIVE_OK) {
+        return fp;
+    }
+
+    /* free the archive before throwing the error */
+    auto err = archive_errno(fp);
+    auto msg = std::string(archive_error_string(fp));
+    archive_read_free(fp);
+    throw FuseError(err, std::move(msg));
+}
+
+ByteBuffer MappedBackend::slice(const Entry &ent) const {
+    if (ent.len == 0) {
+        return ByteBuffer();
+    } else {
+        check();
+        return ByteBuffer::wrap(_mem + ent.off, ent.len, _map);
+    }
+}
+
+void MappedBackend::check() const {
+    struct stat st = {};
+
+    /* check for the archive size */
+    if (fstat(_fd, &st) != 0) {
+        throw FuseError();
+    }
+
+    /* touching the mapping past the end of a truncated file raises SIGBUS, fail the access instead */
+    if (static_cast<size_t>(st.st_size) < _len) {
+        XLOGF(ERR, "Archive shrank from {:d} to {:d} bytes while mapped, it must be replaced instead of rewritten.", _len, st.st_size);
+        throw FuseError(ESTALE, "archive was truncated while mapped");
+    }
+}
+
+void MappedBackend::locate(struct archive *fp, Entry *ent) const {
+    int          ret;
+    size_t       len;
+    la_int64_t   off;
+    const void * rbuf;
+    const char * mbeg = nullptr;
+
+    /* read every block, libarchive hands out pointers into the mapping for stored data */
+    while ((ret = archive_read_data_block(fp, &rbuf, &len, &off)) == ARCHIVE_OK) {
+        auto ptr = static_cast<const char *>(rbuf);
+        auto pos = static_cast<size_t>(off);
+
+        /* remember the first block */
+        if (mbeg == nullptr) {
+            mbeg = ptr;
+        }
+
+        /* every block must continue the previous one within the mapping, otherwise
+         * the entry is compressed or sparse, and must be decompressed on demand */
+        if (pos != ent->len || ptr != mbeg + pos || ptr < _mem || ptr + len > _mem + _len) {
+            ent->off = Unmapped;
+            return;
+        }
+
+        /* extend the range */
+        ent->len += len;
+    }
+
+    /* check for errors */
+    if (ret != ARCHIVE_EOF) {
+        throw FuseError(archive_errno(fp), archive_error_string(fp));
+    } else {
+        ent->off = mbeg == nullptr ? 0 : mbeg - _mem;
+    }
+}
+
+bool MappedBackend::seekable(const std::string &fname) {
+    int                    ret;
+    bool                   res;
+    struct archive_entry * val;
+    struct archive *       fp = archive_read_new();
+
+    /* probe the archive with all filters enabled */
+    archive_read_support_filter_all(fp);
+    archive_read_support_format_all(fp);
+
+    /* open the archive */
+    if (archive_read_open_filename(fp, fname.c_str(), 65536) != ARCHIVE_OK) {
+        archive_read_free(fp);
+        return false;
+    }
+
+    /* only archives without any compression filter can be served from the mapping */
+    ret = archive_read_next_header(fp, &val);
+    res = (ret == ARCHIVE_OK || ret == ARCHIVE_EOF) && archive_filter_count(fp) == 1 && archive_filter_code(fp, 0) == ARCHIVE_FILTER_NONE;
+
+    /* free the probing handle */
+    archive_read_free(fp);
+    return res;
+}
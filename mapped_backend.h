@@ -0,0 +1,58 @@
+#ifndef SANDBOX_FS_MAPPED_BACKEND_H
+#define SANDBOX_FS_MAPPED_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <archive.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+
+/* archives without a compression filter are mapped into memory, and stored entries are served from the
+ * mapping without being copied, the mapping is private but still backed by the file, so truncating the
+ * archive in place while it's loaded makes any access past the new end raise SIGBUS, the size is checked
+ * before every access made while loading or fetching, but buffers handed out earlier keep referring to
+ * the mapping for as long as they live, so archives must be replaced by renaming, never rewritten */
+class MappedBackend : public Backend {
+    struct Entry {
+        std::string name;
+        struct stat stat;
+        size_t      off;
+        size_t      len;
+    };
+
+private:
+    int                         _fd;
+    int                         _fmt;
+    size_t                      _len;
+    const char *                _mem;
+    std::string                 _name;
+    std::vector<Entry>          _ents;
+    std::shared_ptr<const void> _map;
+
+public:
+    virtual ~MappedBackend() = default;
+    explicit MappedBackend(const std::string &fname);
+
+public:
+    void       foreach(std::function<void(std::string, struct stat, ByteBuffer)> &&func) const override;
+    void       scan(std::function<void(std::string, struct stat, size_t)> &&func) const override;
+    ByteBuffer fetch(size_t index) const override;
+
+public:
+    void parallel(std::function<void(std::string, struct stat, ByteBuffer)> &&func, size_t jobs) const override;
+
+private:
+    [[nodiscard]] struct archive * open() const;
+    [[nodiscard]] ByteBuffer       slice(const Entry &ent) const;
+
+private:
+    void check() const;
+    void locate(struct archive *fp, Entry *ent) const;
+
+public:
+    static bool seekable(const std::string &fname);
+};
+
+#endif /* SANDBOX_FS_MAPPED_BACKEND_H */
@@ -0,0 +1,118 @@
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "fuse_error.h"
+#include "memfd_pool.h"
+
+static constexpr size_t Alignment = 4096;
+static constexpr size_t NameLimit = 200;
+
+MemfdPool::~MemfdPool() {
+    if (_map == nullptr && _fd >= 0) {
+        close(_fd);
+    }
+}
+
+MemfdPool::MemfdPool(const std::string &name) : _fd(-1), _len(0), _mem(nullptr), _sealable(false) {
+#ifdef __linux__
+    auto pos = name.rfind('/');
+    auto str = "sandbox_fs:" + name.substr(pos == std::string::npos ? 0 : pos + 1).substr(0, NameLimit);
+
+    /* the pool is sealed after loading, so it must allow sealing */
+    if ((_fd = memfd_create(str.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0) {
+        _sealable = true;
+        return;
+    }
+
+    /* kernels without memfd fall back to a temporary file */
+    if (errno != ENOSYS) {
+        throw FuseError();
+    }
+#endif
+
+    /* elsewhere the pool is an unlinked temporary file, which can be spliced and mapped just the same */
+    auto *dir = getenv("TMPDIR");
+    auto  tmp = std::string(dir == nullptr || *dir == 0 ? "/tmp" : dir) + "/sandbox_fs.XXXXXX";
+
+    /* create the file */
+    if ((_fd = mkstemp(&tmp[0])) < 0) {
+        throw FuseError();
+    }
+
+    /* nothing else can open it once unlinked */
+    unlink(tmp.c_str());
+    fcntl(_fd, F_SETFD, FD_CLOEXEC);
+}
+
+void MemfdPool::seal() {
+    void *mem;
+
+#ifdef __linux__
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+
+    /* archive contents are immutable from now on, writes are copied out of the pool */
+    if (_sealable && fcntl(_fd, F_ADD_SEALS, seals) != 0) {
+        throw FuseError();
+    }
+#endif
+
+    /* nothing to map */
+    if (_len == 0) {
+        return;
+    }
+
+    /* map the whole pool read-only, sealed memfds can not be mapped writable anyway */
+    if ((mem = mmap(nullptr, _len, PROT_READ, MAP_SHARED, _fd, 0)) == MAP_FAILED) {
+        throw FuseError();
+    }
+
+    /* the descriptor is needed for splicing, so it lives as long as the mapping */
+    _mem = static_cast<const char *>(mem);
+    _map = std::shared_ptr<const void>(mem, [fd = _fd, len = _len](const void *p) {
+        munmap(const_cast<void *>(p), len);
+        close(fd);
+    });
+}
+
+size_t MemfdPool::append(const ByteBuffer &data) {
+    auto len = data.len();
+    auto off = (_len + Alignment - 1) & ~(Alignment - 1);
+    auto pos = static_cast<off_t>(off);
+
+    /* empty files take no space */
+    if (len == 0) {
+        return off;
+    }
+
+    /* write the data into the pool, the gap before it is a hole and takes no memory */
+    data.scatter(len, 0, [&](const char *mem, size_t size, int, off_t) {
+        while (size != 0) {
+            auto ret = pwrite(_fd, mem, size, pos);
+
+            /* check for errors */
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                throw FuseError();
+            }
+
+            /* move to next chunk */
+            mem  += ret;
+            pos  += ret;
+            size -= ret;
+        }
+    });
+
+    /* update the pool size */
+    _len = off + len;
+    return off;
+}
+
+ByteBuffer MemfdPool::slice(size_t off, size_t len) const {
+    if (len == 0) {
+        return ByteBuffer();
+    } else {
+        return ByteBuffer::wrap(_mem + off, len, _map, _fd, static_cast<off_t>(off));
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SANDBOX_FS_MEMFD_POOL_H
+#define SANDBOX_FS_MEMFD_POOL_H
+
+#include <string>
+#include <memory>
+
+#include "byte_buffer.h"
+
+/* loaded archive contents are copied into a memfd, which is sealed and mapped once the archive is loaded,
+ * where memfds are not available the pool is an unlinked temporary file instead, which is never sealed,
+ * but nothing else can open it, and the pool is never written once mapped */
+class MemfdPool {
+    int                         _fd;
+    size_t                      _len;
+    const char *                _mem;
+    bool                        _sealable;
+    std::shared_ptr<const void> _map;
+
+public:
+   ~MemfdPool();
+    explicit MemfdPool(const std::string &name);
+
+public:
+    MemfdPool(MemfdPool &&)      = delete;
+    MemfdPool(const MemfdPool &) = delete;
+
+public:
+    MemfdPool &operator=(MemfdPool &&)      = delete;
+    MemfdPool &operator=(const MemfdPool &) = delete;
+
+public:
+    [[nodiscard]] size_t size() const { return _len; }
+
+public:
+    void       seal();
+    size_t     append(const ByteBuffer &data);
+    ByteBuffer slice(size_t off, size_t len) const;
+};
+
+#endif /* SANDBOX_FS_MEMFD_POOL_H */
@@ -0,0 +1,134 @@
+#include <chrono>
+#include <folly/logging/xlog.h>
+
+#include "timer.h"
+#include "fuse_error.h"
+#include "memory_budget.h"
+
+void MemoryBudget::configure(size_t limit, size_t token, std::unique_ptr<SpillFile> spill, Reclaimer &&reclaim, Reclaimer &&trim) {
+    _limit   = limit;
+    _token   = token;
+    _spill   = std::move(spill);
+    _trim    = std::move(trim);
+    _reclaim = std::move(reclaim);
+
+    /* nothing to enforce */
+    if (_limit == 0 && _token == 0) {
+        return;
+    }
+
+    /* the thread runs until stopped */
+    _thread = std::thread([this] { run(); });
+    XLOGF(INFO, "Memory budget is {:d} bytes in total, {:d} bytes per archive, 0 for unlimited.", _limit, _token);
+}
+
+void MemoryBudget::stop() {
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        _stop = true;
+        _cond.notify_one();
+    }
+
+    /* wait for the round in progress if any */
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void MemoryBudget::check() {
+    auto now = T::now();
+    auto old = _last.load(std::memory_order_relaxed);
+
+    /* not too often if the last round did not help */
+    if (!over() || !_reclaim || now - old < Backoff) {
+        return;
+    }
+
+    /* wake up the reclaimer, the writer goes on right away */
+    std::lock_guard<std::mutex> _(_mutex);
+    _pending = true;
+    _cond.notify_one();
+}
+
+void MemoryBudget::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto wake = [this] { return _pending || _stop; };
+
+    /* mounts are only checked from time to time, there is no cheap way to know how much was written into them */
+    while (!_stop) {
+        if (_token == 0) {
+            _cond.wait(lock, wake);
+        } else {
+            _cond.wait_for(lock, std::chrono::nanoseconds(Backoff), wake);
+        }
+
+        /* stopped while waiting */
+        if (_stop) {
+            break;
+        }
+
+        /* reclaim without holding the lock, so that writers never wait for it */
+        _pending = false;
+        lock.unlock();
+        reclaim();
+        lock.lock();
+    }
+}
+
+void MemoryBudget::reclaim() {
+    auto now = T::now();
+
+    /* spill the coldest data until below the low watermark */
+    if (over() && _reclaim) {
+        try {
+            auto ret = _reclaim(_limit - _limit / 8);
+            XLOGF(INFO, "Spilled {:d} bytes of cold file data, {:d} bytes in memory.", ret, ByteBuffer::allocated().load());
+        } catch (const FuseError &e) {
+            XLOGF(WARN, "Cannot spill cold file data: [{:d}] {:s}.", e.code(), e.message());
+        }
+
+        /* files are touched in the new epoch from now on */
+        _epoch++;
+        _last = over() ? now : 0;
+    }
+
+    /* contents written into every mount count against the per-archive budget */
+    if (_token != 0 && _trim) {
+        try {
+            if (auto ret = _trim(_token)) {
+                XLOGF(INFO, "Spilled {:d} bytes of file data written into mounts over the per-archive budget.", ret);
+            }
+        } catch (const FuseError &e) {
+            XLOGF(WARN, "Cannot spill file data written into mounts: [{:d}] {:s}.", e.code(), e.message());
+        }
+    }
+}
+
+bool MemoryBudget::admit(ByteBuffer &data, size_t size, size_t *held) {
+    if (size == 0) {
+        return false;
+    }
+
+    /* keep the contents in memory if they fit */
+    if ((_token == 0 || *held + size <= _token) && !over()) {
+        *held += size;
+        return false;
+    }
+
+    /* otherwise spill them right away, the archive is rejected if even that does not work */
+    spill(data);
+    return true;
+}
+
+size_t MemoryBudget::spill(ByteBuffer &data) {
+    if (_spill == nullptr) {
+        throw FuseError(ENOSPC, "memory budget exceeded");
+    } else {
+        return data.spill([this](const char *mem, size_t len) { return _spill->store(mem, len); });
+    }
+}
+
+MemoryBudget &MemoryBudget::instance() {
+    static auto *v = new MemoryBudget;
+    return *v;
+}
@@ -0,0 +1,72 @@
+#ifndef SANDBOX_FS_MEMORY_BUDGET_H
+#define SANDBOX_FS_MEMORY_BUDGET_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "spill_file.h"
+#include "byte_buffer.h"
+
+/* spilling is done by a background thread, writers crossing the watermark only wake it up, so that no write
+ * ever walks the trees, the per-archive budget is also applied to what was written into every mount, which
+ * is checked every `Backoff` nanoseconds, the thread must be stopped before the trees it walks are gone */
+class MemoryBudget {
+public:
+    typedef std::function<size_t(size_t target)> Reclaimer;
+
+private:
+    static constexpr uint64_t Backoff = 1000000000;
+
+private:
+    size_t                     _limit;
+    size_t                     _token;
+    Reclaimer                  _reclaim;
+    Reclaimer                  _trim;
+    std::mutex                 _mutex;
+    std::condition_variable    _cond;
+    bool                       _stop;
+    bool                       _pending;
+    std::thread                _thread;
+    std::atomic_uint64_t       _last;
+    std::atomic_uint64_t       _epoch;
+    std::unique_ptr<SpillFile> _spill;
+
+public:
+    MemoryBudget() : _limit(0), _token(0), _stop(false), _pending(false), _last(0), _epoch(0) {}
+
+public:
+    struct Guard {
+        ~Guard() { instance().stop(); }
+    };
+
+public:
+    [[nodiscard]] size_t   limit() const { return _limit; }
+    [[nodiscard]] uint64_t epoch() const { return _epoch.load(std::memory_order_relaxed); }
+
+public:
+    [[nodiscard]] bool over() const {
+        return _limit != 0 && ByteBuffer::allocated() > static_cast<int64_t>(_limit);
+    }
+
+public:
+    void configure(size_t limit, size_t token, std::unique_ptr<SpillFile> spill, Reclaimer &&reclaim, Reclaimer &&trim);
+
+public:
+    void   stop();
+    void   check();
+    bool   admit(ByteBuffer &data, size_t size, size_t *held);
+    size_t spill(ByteBuffer &data);
+
+private:
+    void run();
+    void reclaim();
+
+public:
+    static MemoryBudget &instance();
+};
+
+#endif /* SANDBOX_FS_MEMORY_BUDGET_H */
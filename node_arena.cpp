@@ -0,0 +1,117 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "node_arena.h"
+
+NodeArena::~NodeArena() {
+    Chunk *next;
+
+    /* every chunk is released at once, nothing in them has a destructor left to run */
+    for (Chunk *p = _head; p != nullptr; p = next) {
+        next = p->next;
+        free(p);
+    }
+}
+
+void NodeArena::seal() {
+    std::lock_guard<std::mutex> _(_mutex);
+    std::unordered_set<std::string_view>().swap(_names);
+}
+
+void *NodeArena::allocate(size_t size, size_t align) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    void *ret = bump(size, align);
+
+    /* every allocation keeps the arena alive */
+    lock.unlock();
+    _refs++;
+    _objects++;
+    return ret;
+}
+
+void NodeArena::release() noexcept {
+    _objects--;
+    unref();
+}
+
+std::string_view NodeArena::intern(std::string_view name) {
+    std::lock_guard<std::mutex> _(_mutex);
+    auto it = _names.find(name);
+
+    /* names are stored only once per archive */
+    if (it != _names.end()) {
+        return *it;
+    }
+
+    /* copy the name into the arena, names hold no reference, arrays using them keep the arena alive */
+    auto *mem = static_cast<char *>(bump(name.size(), 1));
+    auto  ret = std::string_view(static_cast<char *>(memcpy(mem, name.data(), name.size())), name.size());
+
+    /* add to the interned names */
+    _names.insert(ret);
+    return ret;
+}
+
+void *NodeArena::bump(size_t size, size_t align) {
+    auto pos = (reinterpret_cast<uintptr_t>(_ptr) + align - 1) & ~static_cast<uintptr_t>(align - 1);
+    auto cap = std::min(MaxChunk, std::max(MinChunk, _size.load(std::memory_order_relaxed)));
+    auto len = sizeof(Chunk) + size + align;
+
+    /* fits in the current chunk */
+    if (_ptr != nullptr && pos + size <= reinterpret_cast<uintptr_t>(_end)) {
+        _ptr = reinterpret_cast<char *>(pos + size);
+        _used += size;
+        return reinterpret_cast<void *>(pos);
+    }
+
+    /* large objects get a chunk of their own, so that the current one is not wasted,
+     * others start a new chunk, each one as large as all the previous ones together */
+    auto own = len > cap / 4;
+    auto ptr = static_cast<Chunk *>(malloc(own ? len : (len = cap)));
+
+    /* check for allocation errors */
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    /* link the chunk after the current one, or make it the current one */
+    if (own && _head != nullptr) {
+        ptr->next   = _head->next;
+        _head->next = ptr;
+    } else {
+        ptr->next = _head;
+        _head     = ptr;
+    }
+
+    /* account for the chunk */
+    ptr->size = len;
+    pos       = (reinterpret_cast<uintptr_t>(ptr + 1) + align - 1) & ~static_cast<uintptr_t>(align - 1);
+    _size    += len;
+    _used    += size;
+
+    /* only regular chunks are bumped through */
+    if (!own) {
+        _ptr = reinterpret_cast<char *>(pos + size);
+        _end = reinterpret_cast<char *>(ptr) + len;
+    }
+
+    /* all done */
+    return reinterpret_cast<void *>(pos);
+}
+
+void NodeArena::unref() noexcept {
+    if (--_refs == 0) {
+        delete this;
+    }
+}
+
+NodeArena *&NodeArena::current() {
+    static thread_local NodeArena *v = nullptr;
+    return v;
+}
+
+std::shared_ptr<NodeArena> NodeArena::create() {
+    return std::shared_ptr<NodeArena>(new NodeArena(), [](NodeArena *p) { p->unref(); });
+}
@@ -0,0 +1,120 @@
+#ifndef SANDBOX_FS_NODE_ARENA_H
+#define SANDBOX_FS_NODE_ARENA_H
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <string_view>
+#include <unordered_set>
+
+/* the nodes, directory entries and entry names of one loaded archive, allocated by bumping a pointer
+ * through large chunks, nothing is freed on it's own, every allocation only holds a reference, and the
+ * chunks are released together once the token is closed and the last node allocated from them is gone,
+ * names are interned while loading, so that every distinct name of the archive is stored only once */
+class NodeArena {
+    static constexpr size_t MinChunk = 64ul << 10;
+    static constexpr size_t MaxChunk = 4ul << 20;
+
+private:
+    struct Chunk {
+        Chunk *next;
+        size_t size;
+    };
+
+private:
+    Chunk *                              _head;
+    char *                               _ptr;
+    char *                               _end;
+    std::mutex                           _mutex;
+    std::atomic_int64_t                  _refs;
+    std::atomic_uint64_t                 _size;
+    std::atomic_uint64_t                 _used;
+    std::atomic_uint64_t                 _objects;
+    std::unordered_set<std::string_view> _names;
+
+private:
+   ~NodeArena();
+    NodeArena() : _head(nullptr), _ptr(nullptr), _end(nullptr), _refs(1), _size(0), _used(0), _objects(0) {}
+
+public:
+    class Scope {
+        NodeArena *_prev;
+
+    public:
+       ~Scope() { current() = _prev; }
+        explicit Scope(NodeArena *arena) : _prev(current()) { current() = arena; }
+
+    public:
+        Scope(Scope &&)      = delete;
+        Scope(const Scope &) = delete;
+
+    public:
+        Scope &operator=(Scope &&)      = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+
+public:
+    NodeArena(NodeArena &&)      = delete;
+    NodeArena(const NodeArena &) = delete;
+
+public:
+    NodeArena &operator=(NodeArena &&)      = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+
+public:
+    [[nodiscard]] size_t size()    const { return _size.load(std::memory_order_relaxed); }
+    [[nodiscard]] size_t used()    const { return _used.load(std::memory_order_relaxed); }
+    [[nodiscard]] size_t objects() const { return _objects.load(std::memory_order_relaxed); }
+
+public:
+    void             seal();
+    void *           allocate(size_t size, size_t align);
+    void             release() noexcept;
+    std::string_view intern(std::string_view name);
+
+public:
+    static void *allocate(NodeArena *arena, size_t size, size_t align) {
+        return arena == nullptr ? ::operator new(size) : arena->allocate(size, align);
+    }
+
+public:
+    static void deallocate(NodeArena *arena, void *ptr) noexcept {
+        if (arena == nullptr) {
+            ::operator delete(ptr);
+        } else {
+            arena->release();
+        }
+    }
+
+public:
+    static NodeArena *&               current();
+    static std::shared_ptr<NodeArena> create();
+
+private:
+    void *bump(size_t size, size_t align);
+    void  unref() noexcept;
+};
+
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+public:
+    NodeArena *arena;
+
+public:
+    explicit ArenaAllocator(NodeArena *arena) noexcept : arena(arena) {}
+    template <typename U> ArenaAllocator(const ArenaAllocator<U> &other) noexcept : arena(other.arena) {}
+
+public:
+    T *allocate(size_t n) { return static_cast<T *>(NodeArena::allocate(arena, n * sizeof(T), alignof(T))); }
+    void deallocate(T *p, size_t) noexcept { NodeArena::deallocate(arena, p); }
+
+public:
+    template <typename U> bool operator==(const ArenaAllocator<U> &other) const noexcept { return arena == other.arena; }
+    template <typename U> bool operator!=(const ArenaAllocator<U> &other) const noexcept { return arena != other.arena; }
+};
+
+#endif /* SANDBOX_FS_NODE_ARENA_H */
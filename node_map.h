@@ -0,0 +1,344 @@
+#ifndef SANDBOX_FS_NODE_MAP_H
+#define SANDBOX_FS_NODE_MAP_H
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <string_view>
+#include <folly/MicroSpinLock.h>
+#include <folly/synchronization/Rcu.h>
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+#include "node_arena.h"
+
+/* directory entries, small directories keep a sorted array that is replaced as a whole on every change,
+ * and are promoted to a concurrent hash map once they grow past `Promote` entries, empty ones allocate
+ * nothing at all, readers never lock, and values removed from the map are released after an RCU grace
+ * period, so that pointers returned by `find` stay valid within the caller's read section, `foreach` takes
+ * a snapshot of the entries instead, so that callbacks which recurse or block never hold a read section,
+ * arrays store the names right after the entries, or refer to names interned in the arena they came from */
+template <typename V>
+class NodeMap {
+public:
+    static constexpr size_t Promote = 16;
+
+private:
+    /* promoted maps use folly's default of 8 shard bits, segments are allocated on the first insert
+     * into each shard, and every entry is a separate node with a bucket pointer and reclamation state */
+    static constexpr size_t Shards      = 256;
+    static constexpr size_t SegmentSize = 128;
+    static constexpr size_t EntrySize   = sizeof(void *) * 7;
+
+public:
+    typedef std::pair<std::string, V>                Item;
+    typedef std::pair<std::string_view, V>           Entry;
+    typedef typename V::element_type                 Value;
+    typedef folly::ConcurrentHashMap<std::string, V> Map;
+
+private:
+    struct Array final {
+        NodeArena * arena;
+        size_t      size;
+        size_t      len;
+
+    private:
+        explicit Array(NodeArena *arena, size_t size, size_t len) : arena(arena), size(size), len(len) {}
+
+    public:
+        [[nodiscard]] Entry *begin() const { return reinterpret_cast<Entry *>(const_cast<Array *>(this) + 1); }
+        [[nodiscard]] Entry *end()   const { return begin() + size; }
+        [[nodiscard]] char * names() const { return reinterpret_cast<char *>(end()); }
+
+    public:
+        [[nodiscard]] Entry *find(std::string_view key) const {
+            auto it = std::lower_bound(begin(), end(), key, [](const Entry &v, std::string_view k) { return v.first < k; });
+            return it != end() && it->first == key ? it : nullptr;
+        }
+
+    public:
+        static Array *make(size_t size, size_t names, NodeArena *arena = nullptr) {
+            auto len = sizeof(Array) + sizeof(Entry) * size + names;
+            return new (NodeArena::allocate(arena, len, alignof(Array))) Array(arena, size, len);
+        }
+
+    public:
+        static void release(Array *p) noexcept {
+            if (p != nullptr) {
+                auto *mem = p->arena;
+                for (auto &v : *p) v.~Entry();
+                p->~Array();
+                NodeArena::deallocate(mem, p);
+            }
+        }
+    };
+
+private:
+    std::atomic<Array *> _small;
+    std::atomic<Map *>   _large;
+    folly::MicroSpinLock _lock;
+
+public:
+   ~NodeMap() { clear(); }
+    NodeMap() : _small(nullptr), _large(nullptr) { _lock.init(); }
+
+public:
+    NodeMap(NodeMap &&)      = delete;
+    NodeMap(const NodeMap &) = delete;
+
+public:
+    NodeMap &operator=(NodeMap &&)      = delete;
+    NodeMap &operator=(const NodeMap &) = delete;
+
+public:
+    [[nodiscard]] bool empty() const {
+        return size() == 0;
+    }
+
+public:
+    [[nodiscard]] size_t size() const {
+        folly::rcu_reader _;
+        return load([](const Array *a) { return a == nullptr ? 0 : a->size; }, [](const Map *m) { return m->size(); });
+    }
+
+public:
+    [[nodiscard]] size_t footprint() const {
+        folly::rcu_reader _;
+        return load(
+            [ ](const Array *a) { return a == nullptr ? 0 : a->len; },
+            [ ](const Map   *m) { return sizeof(Map) + SegmentSize * std::min(m->size(), Shards) + (sizeof(Item) + EntrySize) * m->size(); }
+        );
+    }
+
+public:
+    [[nodiscard]] V get(const std::string &key) const {
+        folly::rcu_reader _;
+        return load(
+            [&](const Array *a) { auto *p = a == nullptr ? nullptr : a->find(key); return p == nullptr ? V() : p->second; },
+            [&](const Map   *m) { auto it = m->find(key); return it == m->cend() ? V() : it->second; }
+        );
+    }
+
+public:
+    [[nodiscard]] Value *find(const std::string &key) const {
+        return load(
+            [&](const Array *a) { auto *p = a == nullptr ? nullptr : a->find(key); return p == nullptr ? nullptr : p->second.get(); },
+            [&](const Map   *m) { auto it = m->find(key); return it == m->cend() ? nullptr : it->second.get(); }
+        );
+    }
+
+public:
+    template <typename F>
+    void foreach(F &&fn) const {
+        std::vector<Item> items;
+
+        /* only copy the entries within the read section, references keep the values alive after it */
+        {
+            folly::rcu_reader _;
+            load(
+                [&](const Array *a) { if (a != nullptr) for (auto &v : *a) items.emplace_back(v.first, v.second); return 0; },
+                [&](const Map   *m) { items.reserve(m->size()); for (auto &v : *m) items.emplace_back(v.first, v.second); return 0; }
+            );
+        }
+
+        /* callbacks run outside of it, so they can take as long as they need */
+        for (auto &v : items) {
+            fn(v.first, v.second);
+        }
+    }
+
+public:
+    std::pair<V, bool> try_emplace(const std::string &key, V val) {
+        auto ret = update(key, [&](const V &old) { return old == nullptr ? val : old; });
+        return ret.first == nullptr ? std::make_pair(std::move(val), true) : std::make_pair(std::move(ret.first), false);
+    }
+
+public:
+    size_t erase(const std::string &key) {
+        return update(key, [](const V &) { return V(); }).first == nullptr ? 0 : 1;
+    }
+
+public:
+    size_t erase_if_equal(const std::string &key, const V &val) {
+        return update(key, [&](const V &old) { return old == val ? V() : old; }).second ? 1 : 0;
+    }
+
+public:
+    void insert_or_assign(const std::string &key, V val) {
+        update(key, [&](const V &) { return val; });
+    }
+
+public:
+    bool assign_if_equal(const std::string &key, const V &expected, V desired) {
+        return update(key, [&](const V &old) { return old == expected && old != nullptr ? desired : old; }).second;
+    }
+
+public:
+    void clear() {
+        Array::release(_small.exchange(nullptr));
+        delete _large.exchange(nullptr);
+    }
+
+public:
+    void compact(NodeArena *arena) {
+        std::vector<std::pair<std::string_view, V>> ents;
+        std::lock_guard<folly::MicroSpinLock>       _(_lock);
+
+        /* take every entry, whichever representation they are in */
+        auto *old = _small.load(std::memory_order_relaxed);
+        auto *map = _large.load(std::memory_order_relaxed);
+        if (old != nullptr) for (auto &v : *old) ents.emplace_back(v.first, v.second);
+        if (map != nullptr) for (auto &v : *map) ents.emplace_back(v.first, v.second);
+
+        /* nothing to compact */
+        if (ents.empty()) {
+            return;
+        }
+
+        /* arrays are sorted, maps are not */
+        std::sort(ents.begin(), ents.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+        /* a single array of any size, with the names interned in the arena */
+        auto *arr = Array::make(ents.size(), 0, arena);
+        auto *dst = arr->begin();
+        for (auto &[k, v] : ents) new (dst++) Entry(arena->intern(k), std::move(v));
+
+        /* only trees no reader can see yet are compacted, so the old entries go right away */
+        _small.store(arr, std::memory_order_release);
+        _large.store(nullptr, std::memory_order_release);
+        Array::release(old);
+        delete map;
+    }
+
+private:
+    template <typename A, typename M>
+    auto load(A &&small, M &&large) const {
+        if (auto *a = _small.load(std::memory_order_acquire)) {
+            return small(a);
+        } else if (auto *m = _large.load(std::memory_order_acquire)) {
+            return large(m);
+        } else {
+            return small(nullptr);
+        }
+    }
+
+private:
+    template <typename F>
+    std::pair<V, bool> update(const std::string &key, F &&fn) {
+        std::unique_lock<folly::MicroSpinLock> lock(_lock);
+
+        /* promoted maps stay promoted, and can be modified concurrently */
+        if (auto *m = _large.load(std::memory_order_acquire)) {
+            lock.unlock();
+            return modify(m, key, fn);
+        }
+
+        /* writers to the array are serialized by the lock */
+        auto *old = _small.load(std::memory_order_relaxed);
+        auto *cur = old == nullptr ? nullptr : old->find(key);
+        auto  ret = cur == nullptr ? V() : cur->second;
+        auto  val = fn(ret);
+
+        /* nothing changed */
+        if (val == ret) {
+            return std::make_pair(std::move(ret), false);
+        }
+
+        /* count the new entries */
+        size_t n  = old == nullptr ? 0 : old->size;
+        size_t nn = n + (ret == nullptr) - (val == nullptr);
+
+        /* too many entries, promote to a hash map, readers stop looking at the array once it's gone,
+         * compacted arrays can be larger than that, and are promoted on any change */
+        if (nn > Promote) {
+            auto *map = new Map(nn * 2);
+            for (auto &v : *old) if (v.first != key) map->insert_or_assign(std::string(v.first), v.second);
+            if (val != nullptr) map->insert_or_assign(key, val);
+            _large.store(map, std::memory_order_release);
+            _small.store(nullptr, std::memory_order_release);
+            retire(old);
+            return std::make_pair(std::move(ret), true);
+        }
+
+        /* the names are stored along with the entries */
+        size_t nb = val == nullptr ? 0 : key.size();
+        for (size_t i = 0; i < n; i++) nb += old->begin()[i].first == key ? 0 : old->begin()[i].first.size();
+
+        /* rebuild the array in order, with the entry inserted, replaced or removed */
+        auto *arr = nn == 0 ? nullptr : Array::make(nn, nb);
+        auto *dst = arr == nullptr ? nullptr : arr->begin();
+        auto *str = arr == nullptr ? nullptr : arr->names();
+        auto  add = [&](std::string_view k, V v) {
+            new (dst++) Entry(std::string_view(static_cast<char *>(memcpy(str, k.data(), k.size())), k.size()), std::move(v));
+            str += k.size();
+        };
+
+        /* copy the entries before the key */
+        for (size_t i = 0; i < n; i++) {
+            auto &v = old->begin()[i];
+            if (v.first >= key) break;
+            add(v.first, v.second);
+        }
+
+        /* add the new entry if any */
+        if (val != nullptr) {
+            add(key, val);
+        }
+
+        /* copy the entries after the key */
+        for (size_t i = 0; i < n; i++) {
+            auto &v = old->begin()[i];
+            if (v.first > key) add(v.first, v.second);
+        }
+
+        /* publish the new array */
+        _small.store(arr, std::memory_order_release);
+        retire(old);
+        return std::make_pair(std::move(ret), true);
+    }
+
+private:
+    template <typename F>
+    static std::pair<V, bool> modify(Map *m, const std::string &key, F &&fn) {
+        for (;;) {
+            auto it  = m->find(key);
+            auto ret = it == m->cend() ? V() : it->second;
+            auto val = fn(ret);
+
+            /* nothing changed */
+            if (val == ret) {
+                return std::make_pair(std::move(ret), false);
+            }
+
+            /* some other thread might have modified the entry in the meantime */
+            if (ret == nullptr) {
+                if (!m->try_emplace(key, std::move(val)).second) continue;
+            } else if (val == nullptr) {
+                if (m->erase_if_equal(key, ret) == 0) continue;
+            } else {
+                if (!m->assign_if_equal(key, ret, std::move(val)).has_value()) continue;
+            }
+
+            /* readers might still be looking at the old value */
+            if (ret != nullptr) {
+                folly::rcu_retire(new V(ret), [](V *v) { delete v; });
+            }
+
+            /* all done */
+            return std::make_pair(std::move(ret), true);
+        }
+    }
+
+private:
+    static void retire(Array *p) {
+        if (p != nullptr) {
+            folly::rcu_retire(p, [](Array *v) { Array::release(v); });
+        }
+    }
+};
+
+#endif /* SANDBOX_FS_NODE_MAP_H */
@@ -0,0 +1,161 @@
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+
+#include "op_stats.h"
+
+static inline size_t shard() {
+    static std::atomic_size_t  next(0);
+    static thread_local size_t index = next++ % OpStats::Shards;
+    return index;
+}
+
+static inline size_t bucket(uint64_t nanos) {
+    size_t   ret = 0;
+    uint64_t v   = nanos / 1000;
+
+    /* the first bucket takes everything up to 1us, and every next one doubles */
+    while (v != 0 && ret < OpStats::Buckets - 1) {
+        v >>= 1;
+        ret++;
+    }
+
+    /* the last bucket takes everything else */
+    return ret;
+}
+
+static inline void append(std::string *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static inline void append(std::string *out, const char *fmt, ...) {
+    char    buf[512];
+    va_list va;
+
+    /* format into the buffer */
+    va_start(va, fmt);
+    auto nb = vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+
+    /* names are short, so it always fits */
+    out->append(buf, std::min(static_cast<size_t>(std::max(nb, 0)), sizeof(buf) - 1));
+}
+
+void OpStats::Op::record(uint64_t nanos, bool error, size_t bytes) {
+    auto &sh = _shards[shard()];
+    sh.count.fetch_add(1, std::memory_order_relaxed);
+    sh.nanos.fetch_add(nanos, std::memory_order_relaxed);
+    sh.buckets[bucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+
+    /* rarely happens */
+    if (error) sh.errors.fetch_add(1, std::memory_order_relaxed);
+    if (bytes) sh.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void OpStats::Op::collect(uint64_t *count, uint64_t *errors, uint64_t *nanos, uint64_t *bytes, uint64_t *buckets) const {
+    *count  = 0;
+    *errors = 0;
+    *nanos  = 0;
+    *bytes  = 0;
+    std::fill(buckets, buckets + Buckets, 0);
+
+    /* sum up every shard, the result is not an atomic snapshot, but close enough */
+    for (auto &sh : _shards) {
+        *count  += sh.count.load(std::memory_order_relaxed);
+        *errors += sh.errors.load(std::memory_order_relaxed);
+        *nanos  += sh.nanos.load(std::memory_order_relaxed);
+        *bytes  += sh.bytes.load(std::memory_order_relaxed);
+
+        /* add every bucket */
+        for (size_t i = 0; i < Buckets; i++) {
+            buckets[i] += sh.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+OpStats::Timer *&OpStats::Timer::current() {
+    static thread_local Timer *v = nullptr;
+    return v;
+}
+
+OpStats::Op &OpStats::get(const std::string &name) {
+    std::lock_guard<std::mutex> _(_mutex);
+    auto iter = _names.find(name);
+
+    /* operations are registered on first use */
+    if (iter != _names.end()) {
+        return *iter->second;
+    }
+
+    /* add a new operation */
+    auto *op = _ops.emplace_back(std::make_unique<Op>(name)).get();
+    _names.emplace(name, op);
+    return *op;
+}
+
+void OpStats::dump(std::string *out) {
+    struct Sample {
+        const Op * op;
+        uint64_t   count;
+        uint64_t   errors;
+        uint64_t   nanos;
+        uint64_t   bytes;
+        uint64_t   buckets[Buckets];
+    };
+
+    /* operations are never removed, so they can be used without the lock */
+    std::vector<Sample> ops;
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        for (auto &op : _ops) ops.emplace_back().op = op.get();
+    }
+
+    /* sum up the shards once */
+    for (auto &v : ops) {
+        v.op->collect(&v.count, &v.errors, &v.nanos, &v.bytes, v.buckets);
+    }
+
+    /* in the Prometheus text format */
+    append(out, "# HELP %s_duration_seconds %s\n", _metric, _help);
+    append(out, "# TYPE %s_duration_seconds histogram\n", _metric);
+
+    /* latency histograms, buckets are cumulative */
+    for (auto &v : ops) {
+        uint64_t    sum  = 0;
+        const char *name = v.op->name().c_str();
+
+        /* every bucket but the last one has an upper bound */
+        for (size_t i = 0; i < Buckets - 1; i++) {
+            sum += v.buckets[i];
+            append(out, "%s_duration_seconds_bucket{%s=\"%s\",le=\"%g\"} %llu\n", _metric, _label, name, (double)(1ull << i) * 1e-6, (unsigned long long)sum);
+        }
+
+        /* the last bucket, sum and count */
+        append(out, "%s_duration_seconds_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", _metric, _label, name, (unsigned long long)v.count);
+        append(out, "%s_duration_seconds_sum{%s=\"%s\"} %.9f\n", _metric, _label, name, (double)v.nanos * 1e-9);
+        append(out, "%s_duration_seconds_count{%s=\"%s\"} %llu\n", _metric, _label, name, (unsigned long long)v.count);
+    }
+
+    /* failed calls */
+    append(out, "# HELP %s_errors_total Number of failed calls.\n", _metric);
+    append(out, "# TYPE %s_errors_total counter\n", _metric);
+    for (auto &v : ops) {
+        append(out, "%s_errors_total{%s=\"%s\"} %llu\n", _metric, _label, v.op->name().c_str(), (unsigned long long)v.errors);
+    }
+
+    /* bytes transferred, only reads and writes move any */
+    append(out, "# HELP %s_bytes_total Number of bytes read or written.\n", _metric);
+    append(out, "# TYPE %s_bytes_total counter\n", _metric);
+    for (auto &v : ops) {
+        if (v.bytes != 0) {
+            append(out, "%s_bytes_total{%s=\"%s\"} %llu\n", _metric, _label, v.op->name().c_str(), (unsigned long long)v.bytes);
+        }
+    }
+}
+
+OpStats &OpStats::fuse() {
+    static OpStats v("sandbox_fs_op", "op", "Latency of file system operations.");
+    return v;
+}
+
+OpStats &OpStats::commands() {
+    static OpStats v("sandbox_fs_command", "cmd", "Latency of control commands.");
+    return v;
+}
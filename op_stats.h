@@ -0,0 +1,110 @@
+#ifndef SANDBOX_FS_OP_STATS_H
+#define SANDBOX_FS_OP_STATS_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "timer.h"
+
+/* call counts and latency histograms of a family of operations, every thread updates it's own shard with relaxed
+ * atomics so that recording never contends, and the shards are only summed up when exported, the buckets are powers
+ * of two from 1us up to about 4s, plus one for anything slower */
+class OpStats {
+public:
+    static constexpr size_t Shards  = 16;
+    static constexpr size_t Buckets = 24;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic_uint64_t count            {0};
+        std::atomic_uint64_t errors           {0};
+        std::atomic_uint64_t nanos            {0};
+        std::atomic_uint64_t bytes            {0};
+        std::atomic_uint64_t buckets[Buckets] {};
+    };
+
+public:
+    class Op {
+        std::string _name;
+        Shard       _shards[Shards];
+
+    public:
+        explicit Op(std::string name) : _name(std::move(name)) {}
+
+    public:
+        Op(Op &&)      = delete;
+        Op(const Op &) = delete;
+
+    public:
+        Op &operator=(Op &&)      = delete;
+        Op &operator=(const Op &) = delete;
+
+    public:
+        [[nodiscard]] const std::string &name() const { return _name; }
+
+    public:
+        void record(uint64_t nanos, bool error, size_t bytes);
+        void collect(uint64_t *count, uint64_t *errors, uint64_t *nanos, uint64_t *bytes, uint64_t *buckets) const;
+    };
+
+public:
+    class Timer {
+        Op *     _op;
+        Timer *  _prev;
+        bool     _error;
+        size_t   _bytes;
+        uint64_t _start;
+
+    public:
+       ~Timer() { current() = _prev; _op->record(T::now() - _start, _error, _bytes); }
+        explicit Timer(Op &op) : _op(&op), _prev(current()), _error(false), _bytes(0), _start(T::now()) { current() = this; }
+
+    public:
+        Timer(Timer &&)      = delete;
+        Timer(const Timer &) = delete;
+
+    public:
+        Timer &operator=(Timer &&)      = delete;
+        Timer &operator=(const Timer &) = delete;
+
+    public:
+        void fail()              { _error = true; }
+        void transfer(size_t nb) { _bytes += nb; }
+
+    public:
+        static Timer *& current();
+    };
+
+private:
+    const char *                          _metric;
+    const char *                          _label;
+    const char *                          _help;
+    std::mutex                            _mutex;
+    std::vector<std::unique_ptr<Op>>      _ops;
+    std::unordered_map<std::string, Op *> _names;
+
+public:
+    OpStats(const char *metric, const char *label, const char *help) : _metric(metric), _label(label), _help(help) {}
+
+public:
+    Op & get(const std::string &name);
+    void dump(std::string *out);
+
+public:
+    /* counts the bytes read or written by the operation being timed on this thread, if any */
+    static void transferred(size_t nb) {
+        if (auto *t = Timer::current()) {
+            t->transfer(nb);
+        }
+    }
+
+public:
+    static OpStats &fuse();
+    static OpStats &commands();
+};
+
+#endif /* SANDBOX_FS_OP_STATS_H */
@@ -0,0 +1,58 @@
+#ifndef SANDBOX_FS_OPENED_FILE_H
+#define SANDBOX_FS_OPENED_FILE_H
+
+#include <fcntl.h>
+#include <shared_mutex>
+
+#include "file_node.h"
+#include "sandbox_file.h"
+#include "write_barrier.h"
+
+/* files opened read-only never take the write barrier, and reject anything that would modify them */
+class ReadOnlyFile : public SandboxFile {
+protected:
+    FileNode::Node _node;
+
+public:
+    ReadOnlyFile(int mode, FileNode::Node node) : SandboxFile(mode), _node(std::move(node)) {}
+
+public:
+    void do_resize  (size_t)               override { throw FuseError(EBADF); }
+    void do_getstat (FileNode::Stat *stat) override { *stat = _node->stat(); }
+
+public:
+    ssize_t do_read  (char *buf, size_t len, size_t off) override { return _node->read(buf, len, off); }
+    ssize_t do_write (const char *, size_t, size_t)      override { throw FuseError(EBADF); }
+
+public:
+    bool    do_pin  (size_t len, size_t off, ByteBuffer::Pinned *pins) override { _node->pin(len, off, pins); return true; }
+    ssize_t do_fill (size_t, size_t, const ByteBuffer::Filler &)       override { throw FuseError(EBADF); }
+};
+
+/* files opened for writing hold the write barrier of their mount for every change */
+class OpenedFile : public ReadOnlyFile {
+    typedef std::shared_lock<folly::SharedMutex> Barrier;
+
+private:
+    folly::SharedMutex &_barrier;
+
+public:
+    OpenedFile(int mode, FileNode::Node node, std::string_view path) : ReadOnlyFile(mode, std::move(node)), _barrier(WriteBarrier::of(path)) {}
+
+public:
+    void do_resize (size_t size) override { Barrier _(_barrier); _node->resize(size); }
+
+public:
+    ssize_t do_write (const char *buf, size_t len, size_t off) override { Barrier _(_barrier); return _node->write(buf, len, off); }
+
+public:
+    ssize_t do_fill (size_t len, size_t off, const ByteBuffer::Filler &fn) override { Barrier _(_barrier); return _node->fill(len, off, fn); }
+};
+
+static inline bool isWritable(int flags) {
+    return (flags & O_ACCMODE) != O_RDONLY ||
+           (flags & O_TRUNC) != 0 ||
+           (flags & O_CREAT) != 0;
+}
+
+#endif /* SANDBOX_FS_OPENED_FILE_H */
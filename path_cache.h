@@ -0,0 +1,175 @@
+#ifndef SANDBOX_FS_PATH_CACHE_H
+#define SANDBOX_FS_PATH_CACHE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <string_view>
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+#include "file_node.h"
+
+/* lookups are cached per mount and path, entries only hold weak references, so that unlinked
+ * nodes are released right away, modifications drop the entry of the path and every ancestor, as
+ * those might have been replaced by their private copies, renamed directories drop the whole subtree */
+class PathCache {
+    struct Entry {
+        int                     err;
+        std::weak_ptr<FileNode> node;
+    };
+
+private:
+    struct Mount {
+        std::atomic_uint64_t                         gen;
+        std::weak_ptr<FileNode>                      root;
+        folly::ConcurrentHashMap<std::string, Entry> ents;
+
+    public:
+        explicit Mount(const FileNode::Node &root) : gen(0), root(root) {}
+
+    public:
+        [[nodiscard]] bool owns(const FileNode::Node &node) const {
+            return !root.owner_before(node) && !node.owner_before(root);
+        }
+    };
+
+private:
+    typedef std::shared_ptr<Mount>                          MountRef;
+    typedef folly::ConcurrentHashMap<std::string, MountRef> MountMap;
+
+private:
+    size_t   _size;
+    MountMap _mounts;
+
+public:
+    explicit PathCache(size_t size = 65536) : _size(size) {}
+
+public:
+    /* folly's ConcurrentHashMap has no heterogeneous lookup, so keys are built in a thread-local
+     * scratch string instead, which keeps it's capacity and stops allocating once warmed up */
+    FileNode::Node find(const FileNode::Node &root, std::string_view path, int *err) {
+        static thread_local std::string key;
+        auto name = alias(path);
+        auto rest = path.substr(name.data() - path.data() + name.size());
+
+        /* the root directory and the mount points are one lookup away anyway */
+        if (rest.empty()) {
+            return root->find(path, err);
+        }
+
+        /* find the mount point, this also detects remounts and copied mount roots */
+        auto top = root->find(name, err);
+        auto mnt = top == nullptr ? nullptr : mount(name, top);
+
+        /* the mount point does not exist */
+        if (mnt == nullptr) {
+            _mounts.erase(key.assign(name.data(), name.size()));
+            return nullptr;
+        }
+
+        /* read the generation before resolving, so that modifications in between can be detected */
+        auto gen  = mnt->gen.load();
+        auto end  = mnt->ents.cend();
+        auto iter = mnt->ents.find(key.assign(rest.data(), rest.size()));
+
+        /* check for cached entries, including the negative ones, released nodes are resolved again */
+        if (iter != end) {
+            if (iter->second.err != 0) {
+                *err = iter->second.err;
+                return nullptr;
+            } else if (auto node = iter->second.node.lock()) {
+                return node;
+            }
+        }
+
+        /* the cache is full, start over */
+        if (mnt->ents.size() >= _size) {
+            mnt->ents.clear();
+        }
+
+        /* resolve from the mount point and remember the result */
+        auto node = top->find(rest, err);
+        mnt->ents.insert_or_assign(key, Entry { node == nullptr ? *err : 0, node });
+
+        /* something was modified while resolving, the result might be outdated already */
+        if (mnt->gen.load() != gen) {
+            mnt->ents.erase(key);
+        }
+
+        /* all done */
+        return node;
+    }
+
+public:
+    void invalidate(std::string_view path, bool tree = false) {
+        static thread_local std::string key;
+        auto name = alias(path);
+        auto rest = path.substr(name.data() - path.data() + name.size());
+        auto iter = _mounts.find(key.assign(name.data(), name.size()));
+
+        /* nothing cached for this mount */
+        if (iter == _mounts.cend()) {
+            return;
+        }
+
+        /* lookups in progress must not cache what they found */
+        auto mnt = iter->second;
+        mnt->gen.fetch_add(1);
+
+        /* the subtree of a renamed directory, paths below it might resolve differently now */
+        if (tree) {
+            std::vector<std::string> keys;
+            key.assign(rest.data(), rest.size()).push_back('/');
+
+            /* collect first, then erase */
+            for (auto &v : mnt->ents) {
+                if (v.first.compare(0, key.size(), key) == 0) {
+                    keys.emplace_back(v.first);
+                }
+            }
+
+            /* drop the entries */
+            for (auto &v : keys) {
+                mnt->ents.erase(v);
+            }
+        }
+
+        /* the path itself and every ancestor of it, which might have been copied on the way */
+        for (auto len = rest.size(); len != 0; len = rest.rfind('/', len - 1)) {
+            mnt->ents.erase(key.assign(rest.data(), len));
+        }
+    }
+
+private:
+    MountRef mount(std::string_view name, const FileNode::Node &top) {
+        static thread_local std::string key;
+        auto end  = _mounts.cend();
+        auto iter = _mounts.find(key.assign(name.data(), name.size()));
+
+        /* check if the mount is still the same one */
+        if (iter != end && iter->second->owns(top)) {
+            return iter->second;
+        }
+
+        /* mount point changed, start a new cache */
+        auto ret = std::make_shared<Mount>(top);
+        _mounts.insert_or_assign(key, ret);
+        return ret;
+    }
+
+private:
+    static std::string_view alias(std::string_view path) {
+        auto pos = path.find_first_not_of('/');
+        auto end = path.find('/', pos);
+
+        /* extract the first path component */
+        if (pos == std::string_view::npos) {
+            return std::string_view(path.data() + path.size(), 0);
+        } else {
+            return path.substr(pos, end == std::string_view::npos ? end : end - pos);
+        }
+    }
+};
+
+#endif /* SANDBOX_FS_PATH_CACHE_H */
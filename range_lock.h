@@ -0,0 +1,69 @@
+#ifndef SANDBOX_FS_RANGE_LOCK_H
+#define SANDBOX_FS_RANGE_LOCK_H
+
+#include <tuple>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+/* locks half-open ranges [begin, end) of an object, overlapping ranges of the same object wait
+ * for each other, disjoint ones don't, a single lock can be shared by many objects */
+class RangeLock {
+    typedef std::tuple<const void *, size_t, size_t> Range;
+
+private:
+    std::mutex              _mutex;
+    std::vector<Range>      _ranges;
+    std::condition_variable _cond;
+
+public:
+    class Guard {
+        RangeLock * _lock;
+        Range       _range;
+
+    public:
+       ~Guard() { _lock->unlock(_range); }
+        Guard(RangeLock &lock, const void *key, size_t begin, size_t end) : _lock(&lock), _range(key, begin, end) { _lock->lock(_range); }
+
+    public:
+        Guard(Guard &&)      = delete;
+        Guard(const Guard &) = delete;
+
+    public:
+        Guard &operator=(Guard &&)      = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+public:
+    void lock(const Range &range) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [&] { return !overlaps(range); });
+        _ranges.emplace_back(range);
+    }
+
+public:
+    void unlock(const Range &range) {
+        std::lock_guard<std::mutex> _(_mutex);
+        auto it = std::find(_ranges.begin(), _ranges.end(), range);
+
+        /* order does not matter */
+        *it = _ranges.back();
+        _ranges.pop_back();
+        _cond.notify_all();
+    }
+
+private:
+    [[nodiscard]] bool overlaps(const Range &range) const {
+        for (const auto &[key, begin, end] : _ranges) {
+            if (key == std::get<0>(range) && begin < std::get<2>(range) && std::get<1>(range) < end) {
+                return true;
+            }
+        }
+
+        /* no conflicts */
+        return false;
+    }
+};
+
+#endif /* SANDBOX_FS_RANGE_LOCK_H */
@@ -1,12 +1,36 @@
 #include <string>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <array>
+#include <vector>
+#include <unordered_set>
 #include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include <gflags/gflags.h>
 #include <folly/Random.h>
+#include <folly/SharedMutex.h>
+#include <folly/Synchronized.h>
 #include <folly/logging/xlog.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/concurrency/ConcurrentHashMap.h>
 
+#include "utils.h"
+#include "op_stats.h"
+#include "checkpoint.h"
 #include "fuse_error.h"
 #include "file_backend.h"
+#include "load_queue.h"
+#include "image_backend.h"
+#include "mapped_backend.h"
+#include "write_barrier.h"
 #include "sandbox_controller.h"
 
 ssize_t SandboxController::do_read(char *buf, size_t len, size_t off) {
@@ -20,60 +44,231 @@ ssize_t SandboxController::do_write(const char *buf, size_t len, size_t off) {
 }
 
 void SandboxController::reply(const JSON &v) {
-    auto s = v.dump() + '\n';
-    _rbuf.sputn(s.data(), s.size());
+    if (_sink) {
+        _sink(v);
+    } else {
+        auto s = v.dump() + '\n';
+        _rbuf.sputn(s.data(), s.size());
+    }
+}
+
+std::string SandboxController::nextLine() {
+    int         ch;
+    std::string ret;
+
+    /* read one line */
+    while ((ch = _wbuf.sbumpc()) != '\n') {
+        if (ch == std::char_traits<char>::eof()) {
+            break;
+        } else {
+            ret.push_back(ch);
+        }
+    }
+
+    /* all done */
+    return ret;
+}
+
+static inline void parseCommand(const SandboxController::JSON &req, std::string *cmd, SandboxController::CommandArgs *args) {
+    *cmd  = req.at("cmd").get<std::string>();
+    *args = req.at("args").get<SandboxController::CommandArgs>();
 }
 
 void SandboxController::fireCommand(const char *buf, size_t len) {
-    if (memchr(buf, '\n', len)) {
-        int         ch;
-        JSON        req;
-        std::string str;
-        std::string cmd;
-        CommandArgs args;
-
-        /* read one line */
-        while ((ch = _wbuf.sbumpc()) != '\n') {
-            if (ch == std::char_traits<char>::eof()) {
-                break;
+    auto nl = std::count(buf, buf + len, '\n');
+
+    /* execute every complete line in order, the remaining lines are dropped once any of them fails */
+    for (ssize_t i = 0; i < nl; i++) {
+        try {
+            fireLine(nextLine());
+        } catch (...) {
+            while (++i < nl) nextLine();
+            throw;
+        }
+    }
+}
+
+void SandboxController::fireLine(const std::string &str) {
+    std::string cmd;
+    CommandArgs args;
+
+    /* pipelined requests might be separated by empty lines */
+    if (str.empty()) {
+        return;
+    }
+
+    /* parse the request */
+    try {
+        parseCommand(JSON::parse(str), &cmd, &args);
+    } catch (const JSON::exception &e) {
+        XLOGF(ERR, "Cannot parse request, dropped. JSON Error: [{:d}] {:s}", e.id, e.what());
+        throw FuseError(EINVAL);
+    } catch (const std::exception &e) {
+        XLOGF(ERR, "Cannot parse request, dropped. Error: {:s}", e.what());
+        throw FuseError(EINVAL);
+    }
+
+    /* execute the request */
+    try {
+        dispatch(cmd, args);
+    } catch (const FuseError &) {
+        throw;
+    } catch (const std::exception &e) {
+        XLOGF(ERR, "Cannot handle request. Error: {:s}", e.what());
+        throw FuseError(EINVAL);
+    }
+}
+
+static inline bool barrier(const std::string &cmd) {
+    return cmd == "RESTORE";
+}
+
+static inline std::vector<std::string> resources(const SandboxController::CommandArgs &args) {
+    std::vector<std::string> ret;
+
+    /* archives, tokens and aliases touched by the command, prefixed by the kind of resource */
+    for (auto name : { "file", "token", "alias" }) {
+        if (auto iter = args.find(name); iter != args.end() && iter->second.is_string()) {
+            ret.emplace_back(std::string(name) + ":" + iter->second.get<std::string>());
+        }
+    }
+
+    /* union mounts touch every layer */
+    if (auto iter = args.find("layers"); iter != args.end() && iter->second.is_array()) {
+        for (auto &v : iter->second) {
+            if (v.is_string()) {
+                ret.emplace_back("token:" + v.get<std::string>());
+            }
+        }
+    }
+
+    /* all done */
+    return ret;
+}
+
+/* commands lock the archives, tokens and aliases they touch, striped by name, atomic batches lock everything they
+ * touch exclusively, so that they only hold back commands touching the same things, commands that touch things
+ * which can not be told from their arguments lock every stripe, locks are always taken in stripe order */
+class ResourceLock {
+    static constexpr size_t Stripes = 64;
+
+private:
+    struct alignas(64) Stripe {
+        folly::SharedMutex lock;
+    };
+
+private:
+    bool                _excl;
+    std::vector<size_t> _held;
+
+public:
+   ~ResourceLock() {
+        for (auto it = _held.rbegin(); it != _held.rend(); ++it) {
+            if (_excl) {
+                stripes()[*it].lock.unlock();
             } else {
-                str.push_back(ch);
+                stripes()[*it].lock.unlock_shared();
             }
         }
+    }
 
-        /* parse the request */
-        try {
-            req  = JSON::parse(str);
-            cmd  = req["cmd"].get<std::string>();
-            args = req["args"].get<CommandArgs>();
-        } catch (const JSON::exception &e) {
-            XLOGF(ERR, "Cannot parse request, dropped. JSON Error: [{:d}] {:s}", e.id, e.what());
-            throw FuseError(EINVAL);
-        } catch (const std::exception &e) {
-            XLOGF(ERR, "Cannot parse request, dropped. Error: {:s}", e.what());
-            throw FuseError(EINVAL);
-        }
-
-        /* execute the request */
-        try {
-            executeCommand(cmd, args);
-        } catch (const FuseError &) {
-            throw;
-        } catch (const std::exception &e) {
-            XLOGF(ERR, "Cannot handle request. Error: {:s}", e.what());
-            throw FuseError(EINVAL);
+public:
+    ResourceLock(const std::vector<std::string> &res, bool all, bool exclusive) : _excl(exclusive) {
+        if (all) {
+            for (size_t i = 0; i < Stripes; i++) _held.emplace_back(i);
+        } else {
+            for (auto &v : res) _held.emplace_back(std::hash<std::string>()(v) % Stripes);
+        }
+
+        /* lock in stripe order, and every stripe only once */
+        std::sort(_held.begin(), _held.end());
+        _held.erase(std::unique(_held.begin(), _held.end()), _held.end());
+
+        /* acquire the locks */
+        for (auto i : _held) {
+            if (_excl) {
+                stripes()[i].lock.lock();
+            } else {
+                stripes()[i].lock.lock_shared();
+            }
         }
     }
+
+public:
+    ResourceLock(ResourceLock &&)      = delete;
+    ResourceLock(const ResourceLock &) = delete;
+
+public:
+    ResourceLock &operator=(ResourceLock &&)      = delete;
+    ResourceLock &operator=(const ResourceLock &) = delete;
+
+private:
+    static Stripe *stripes() {
+        static Stripe v[Stripes];
+        return v;
+    }
+};
+
+void SandboxController::dispatch(const std::string &cmd, const CommandArgs &args) {
+    if (cmd == "BATCH") {
+        executeCommand(cmd, args);
+    } else {
+        ResourceLock _(resources(args), barrier(cmd), false);
+        executeCommand(cmd, args);
+    }
+}
+
+SandboxController::JSON SandboxController::run(const std::string &cmd, const CommandArgs &args) {
+    JSON              ret = nullptr;
+    SandboxController ctl(O_WRONLY);
+
+    /* capture the reply of the command, so that commands can run concurrently */
+    try {
+        ctl._sink = [&](const JSON &v) { ret = v; };
+        ctl.executeCommand(cmd, args);
+        return {{"cmd", cmd}, {"error", 0}, {"result", ret}};
+    } catch (const FuseError &e) {
+        return {{"cmd", cmd}, {"error", e.code()}, {"message", e.message()}};
+    } catch (const std::exception &e) {
+        XLOGF(ERR, "Cannot handle request. Error: {:s}", e.what());
+        return {{"cmd", cmd}, {"error", EINVAL}, {"message", e.what()}};
+    }
+}
+
+template <typename F>
+static inline void timed(OpStats::Op &op, F &&fn) {
+    OpStats::Timer t(op);
+
+    /* failed commands are counted, then reported as usual */
+    try {
+        fn();
+    } catch (...) {
+        t.fail();
+        throw;
+    }
 }
 
 #define CALL_END()     throw FuseError(EINVAL)
-#define CALL_CMD(name) do { if (cmd == #name) { execute_ ## name(args); return; } } while (false)
+#define CALL_CMD(name)                                                  \
+    do {                                                                \
+        if (cmd == #name) {                                             \
+            static auto &op = OpStats::commands().get(#name);           \
+            timed(op, [&] { execute_ ## name(args); });                 \
+            return;                                                     \
+        }                                                               \
+    } while (false)
 
 void SandboxController::executeCommand(const std::string &cmd, const CommandArgs &args) {
     CALL_CMD(LOAD);
+    CALL_CMD(STATUS);
+    CALL_CMD(CANCEL);
     CALL_CMD(MOUNT);
+    CALL_CMD(MOUNT_UNION);
     CALL_CMD(UNLOAD);
     CALL_CMD(UNMOUNT);
+    CALL_CMD(CHECKPOINT);
+    CALL_CMD(RESTORE);
+    CALL_CMD(BATCH);
     CALL_END();
 }
 
@@ -84,9 +279,26 @@ void SandboxController::executeCommand(const std::string &cmd, const CommandArgs
 #pragma ide diagnostic ignored "cert-err58-cpp"
 #pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
 
+DECLARE_bool(memfd);
+DECLARE_bool(dedupe);
+DECLARE_bool(node_arenas);
+DECLARE_string(image_dir);
+DECLARE_uint32(load_jobs);
+DECLARE_uint32(load_workers);
+
 struct FileRecord {
-    std::string    name;
-    FileNode::Node node;
+    std::string                name;
+    FileNode::Node             node;
+    FileNode::Node             view;
+    size_t                     nodes;
+    size_t                     meta;
+    ContentStore::Stats        dedupe;
+    std::shared_ptr<NodeArena> arena;
+};
+
+struct MountRecord {
+    std::string    names;
+    FileNode::Node base;
 };
 
 static constexpr int  TokenSize      = 32;
@@ -94,8 +306,16 @@ static constexpr int  TokenCount     = 62;
 static constexpr char TokenCharset[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
 static folly::ThreadLocalPRNG                               prng;
+static constexpr char                                       LayerSep = '\n';
 static folly::ConcurrentHashMap<std::string, FileRecord>  * files  = new folly::ConcurrentHashMap<std::string, FileRecord>;
 static folly::ConcurrentHashMap<std::string, std::string> * tokens = new folly::ConcurrentHashMap<std::string, std::string>;
+static folly::ConcurrentHashMap<std::string, MountRecord> * mounts = new folly::ConcurrentHashMap<std::string, MountRecord>;
+
+static constexpr uint64_t                                                JobRetention = 600ul * 1000000000ul;
+static LoadQueue *                                                       loads        = nullptr;
+static folly::ConcurrentHashMap<std::string, std::shared_ptr<LoadJob>> * jobs  = new folly::ConcurrentHashMap<std::string, std::shared_ptr<LoadJob>>;
+
+static folly::Synchronized<std::vector<std::shared_ptr<ControlInterface::Watcher>>> * watchers = new folly::Synchronized<std::vector<std::shared_ptr<ControlInterface::Watcher>>>;
 
 static inline std::string nextToken() {
     std::string                        ret(TokenSize, 0);
@@ -118,9 +338,228 @@ static inline const std::string &validate(const std::string &s) {
     }
 }
 
-void SandboxController::execute_LOAD(const std::string &file) {
+static inline std::unique_ptr<MemfdPool> openPool(const std::string &file, const Backend *be) {
+    if (!FLAGS_memfd || dynamic_cast<const MappedBackend *>(be) != nullptr || dynamic_cast<const ImageBackend *>(be) != nullptr) {
+        return nullptr;
+    } else {
+        return std::make_unique<MemfdPool>(file);
+    }
+}
+
+static inline size_t loadJobs() {
+    if (FLAGS_load_jobs != 0) {
+        return FLAGS_load_jobs;
+    } else {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+static inline void sweep() {
+    if (auto nb = ContentStore::instance().sweep()) {
+        XLOGF(INFO, "Released {:d} bytes of shared contents.", nb);
+    }
+}
+
+static inline FileNode::Node stackLayers(const std::vector<std::string> &ids, std::string *names) {
+    std::vector<FileNode::Node> nodes;
+
+    /* at least one layer is required */
+    if (ids.empty()) {
+        throw FuseError(EINVAL);
+    }
+
+    /* find every layer, from bottom to top */
+    for (auto &token : ids) {
+        auto end  = files->end();
+        auto iter = files->find(token);
+
+        /* check for loading status, archives still loading in the background are not ready yet */
+        if (iter == end) {
+            auto jend = jobs->end();
+            auto jter = jobs->find(token);
+            throw FuseError(jter != jend && !jter->second->finished() ? EBUSY : ENOENT);
+        }
+
+        /* checkpoints refer to the layers by archive name */
+        names->append(names->empty() ? "" : std::string(1, LayerSep));
+        names->append(iter->second.name);
+        nodes.emplace_back(ids.size() == 1 ? iter->second.view : iter->second.node);
+    }
+
+    /* a single layer was stripped of it's whiteouts when loaded, and is mounted as is */
+    if (nodes.size() == 1) {
+        return nodes.front();
+    } else {
+        return FileNode::merge(nodes);
+    }
+}
+
+static inline std::shared_ptr<Backend> openArchive(const std::string &file) {
+    if (MappedBackend::seekable(file)) {
+        return std::make_shared<MappedBackend>(file);
+    } else {
+        return std::make_shared<FileBackend>(file);
+    }
+}
+
+static inline std::shared_ptr<Backend> openBackend(const std::string &file) {
+    if (ImageBackend::probe(file)) {
+        return std::make_shared<ImageBackend>(file);
+    } else if (FLAGS_image_dir.empty()) {
+        return openArchive(file);
+    }
+
+    /* images are named after the identity of the archive, hashing the contents would cost a full read */
+    auto src = ImageBackend::source(file);
+    auto img = FLAGS_image_dir + "/" + ImageBackend::key(src) + ".img";
+
+    /* reuse the image if it's intact, and still compiled from the same archive */
+    if (access(img.c_str(), R_OK) == 0) {
+        try {
+            return std::make_shared<ImageBackend>(img, &src);
+        } catch (const FuseError &e) {
+            XLOGF(WARN, "Image '{:s}' is unusable, compiling again: [{:d}] {:s}.", img, e.code(), e.message());
+        }
+    }
+
+    /* compile the image on first use */
+    ImageBackend::compile(*openArchive(file), img, src, loadJobs());
+    return std::make_shared<ImageBackend>(img, &src);
+}
+
+static inline FileRecord load(const std::string &file, const std::string &token, bool lazy, LoadProgress *progress) {
+    size_t                   nb = 0;
+    size_t                   sz = 0;
+    ContentStore::Stats      st;
+    FileNode::Node           node;
+    FileNode::Node           view;
+    std::shared_ptr<Backend> ldr;
+    auto                     mem = FLAGS_node_arenas ? NodeArena::create() : nullptr;
+
+    /* archives that do not fit in the memory budget are rejected,
+     * lazy loading fetches contents on demand, so nothing is deduplicated,
+     * the reserved token is released on any error, not just the expected ones,
+     * and the nodes of the token are allocated from it's own arena */
+    try {
+        NodeArena::Scope _(mem.get());
+        ldr  = openBackend(file);
+        node = lazy
+            ? FileNode::index(ldr, progress)
+            : FileNode::build(*ldr, openPool(file, ldr.get()).get(), loadJobs(), FLAGS_dedupe ? &st : nullptr, progress);
+
+        /* the metadata size is taken once, walking the tree for every stats read would be too slow */
+        sz = node->footprint(&nb);
+
+        /* whiteouts are hidden when mounted alone, the tree is shared as is if there are none */
+        view = FileNode::merge({ node });
+
+        /* the interned names are not looked up any more */
+        if (mem != nullptr) {
+            mem->seal();
+        }
+    } catch (const FuseError &e) {
+        tokens->erase(file);
+        sweep();
+        XLOGF(ERR, "Cannot load archive '{:s}': [{:d}] {:s}", file, e.code(), e.message());
+        throw;
+    } catch (const std::exception &e) {
+        tokens->erase(file);
+        sweep();
+        XLOGF(ERR, "Cannot load archive '{:s}': {:s}", file, e.what());
+        throw;
+    } catch (...) {
+        tokens->erase(file);
+        sweep();
+        XLOGF(ERR, "Cannot load archive '{:s}': unknown error", file);
+        throw;
+    }
+
+    /* add to loaded files */
+    FileRecord ret {
+        .name   = file,
+        .node   = std::move(node),
+        .view   = std::move(view),
+        .nodes  = nb,
+        .meta   = sz,
+        .dedupe = st,
+        .arena  = std::move(mem),
+    };
+
+    /* the token becomes usable from now on */
+    files->insert(token, ret);
+    XLOGF(INFO, "Archive '{:s}' loaded as token '{:s}'", file, token);
+    return ret;
+}
+
+static inline SandboxController::JSON result(const std::string &token, const FileRecord &frec) {
+    auto &st  = frec.dedupe;
+    auto *mem = frec.arena.get();
+
+    /* the file token, along with the deduplication results and the memory taken by the nodes */
+    return {
+        {"token", token},
+        {"dedupe", {
+            {"files" , st.files},
+            {"dupes" , st.dupes},
+            {"bytes" , st.bytes},
+            {"saved" , st.saved},
+            {"ratio" , st.ratio()},
+        }},
+        {"arena", {
+            {"bytes"   , mem == nullptr ? 0 : mem->size()},
+            {"used"    , mem == nullptr ? 0 : mem->used()},
+            {"objects" , mem == nullptr ? 0 : mem->objects()},
+        }},
+    };
+}
+
+static inline LoadQueue *loader() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        loads = new LoadQueue(std::max(1u, FLAGS_load_workers), [](LoadJob &job) {
+            load(job.file, job.token, job.lazy, &job.progress);
+        });
+    });
+
+    /* the queue is gone after shutting down */
+    if (loads == nullptr) {
+        throw FuseError(ESHUTDOWN);
+    } else {
+        return loads;
+    }
+}
+
+static inline void prune() {
+    std::vector<std::pair<std::string, std::shared_ptr<LoadJob>>> old;
+
+    /* finished jobs are kept for a while for their status to be read, and forgotten afterwards */
+    for (auto &[token, job] : *jobs) {
+        if (job->finished() && T::now() - job->finish.load() > JobRetention) {
+            old.emplace_back(token, job);
+        }
+    }
+
+    /* erase only the jobs that were found, not anything inserted under the same token since */
+    for (auto &[token, job] : old) {
+        jobs->erase_if_equal(token, job);
+    }
+}
+
+static inline std::shared_ptr<LoadJob> job(const std::string &token) {
+    auto end  = jobs->end();
+    auto iter = jobs->find(token);
+
+    /* check for loading status */
+    if (iter == end) {
+        throw FuseError(ENOENT);
+    } else {
+        return iter->second;
+    }
+}
+
+void SandboxController::execute_LOAD(const std::string &file, bool lazy, bool async) {
+    prune();
     auto ret  = nextToken();
-    auto ldr  = FileBackend(file);
     auto iter = tokens->insert(file, ret);
 
     /* check for insertion */
@@ -128,31 +567,111 @@ void SandboxController::execute_LOAD(const std::string &file) {
         throw FuseError(EEXIST);
     }
 
-    /* load the file */
-    files->insert(ret, FileRecord {
-        .name = file,
-        .node = FileNode::build(ldr),
-    });
+    /* synchronous loads reply the results right away */
+    if (!async) {
+        reply(result(ret, load(file, ret, lazy, nullptr)));
+        return;
+    }
+
+    /* the archive size is used to estimate both the memory it needs and the time it takes */
+    struct stat st = {};
+    ::stat(file.c_str(), &st);
+
+    /* loaded in the background, the token is reserved but can not be mounted until done */
+    auto job = std::make_shared<LoadJob>(file, ret, lazy, st.st_size);
+    jobs->insert(ret, job);
+    loader()->submit(job);
 
-    /* reply the file token */
-    XLOGF(INFO, "Archive '{:s}' loaded as token '{:s}'", file, ret);
-    reply({{"token", ret}});
+    /* reply the token, which is also the job id */
+    XLOGF(INFO, "Archive '{:s}' queued for loading as token '{:s}'", file, ret);
+    reply({{"token", ret}, {"state", LoadJob::name(job->state)}});
 }
 
-void SandboxController::execute_MOUNT(const std::string &token, const std::string &alias) {
-    auto end  = files->end();
-    auto iter = files->find(token);
+void SandboxController::execute_STATUS(const std::string &token) {
+    prune();
+    auto job   = ::job(token);
+    auto state = job->state.load(std::memory_order_acquire);
+    auto start = job->start.load();
+    auto until = job->finished() ? job->finish.load() : T::now();
+    auto bytes = job->progress.bytes.load();
+    auto input = job->progress.input.load();
 
-    /* check for loading status */
-    if (iter == end) {
-        throw FuseError(ENOENT);
+    /* compute throughput and the estimated time left, from the share of the archive consumed if the backend
+     * can tell, compressed archives decode to far more than their size, otherwise assume they are about the same */
+    auto sec  = start == 0 ? 0.0 : (double)(until - start) * 1e-9;
+    auto rate = sec == 0.0 ? 0.0 : (double)bytes / sec;
+    auto done = state == LoadJob::State::Done ? 1.0
+              : input > 0.0 ? std::min(input, 1.0)
+              : job->total == 0 ? 0.0 : std::min((double)bytes / (double)job->total, 1.0);
+    auto ret  = JSON {
+        {"token"   , token},
+        {"file"    , job->file},
+        {"state"   , LoadJob::name(state)},
+        {"bytes"   , bytes},
+        {"entries" , job->progress.entries.load()},
+        {"total"   , job->total},
+        {"elapsed" , sec},
+        {"rate"    , rate},
+        {"progress", done},
+        {"eta"     , state != LoadJob::State::Loading ? 0.0 : done == 0.0 ? -1.0 : sec * (1.0 - done) / done},
+    };
+
+    /* loaded archives also report the loading results */
+    if (state == LoadJob::State::Done) {
+        auto end  = files->end();
+        auto iter = files->find(token);
+        if (iter != end) ret["result"] = result(token, iter->second);
+    }
+
+    /* failed or cancelled jobs are forgotten once reported */
+    if (state == LoadJob::State::Failed || state == LoadJob::State::Cancelled) {
+        ret["error"] = job->error;
+        jobs->erase(token);
     }
 
-    /* mount the virtual directory */
-    root()->add(validate(alias), iter->second.node->clone());
+    /* reply the job status */
+    reply(ret);
+}
+
+void SandboxController::execute_CANCEL(const std::string &token) {
+    auto job = ::job(token);
+
+    /* finished jobs can not be cancelled */
+    if (!loader()->cancel(job)) {
+        throw FuseError(EALREADY);
+    }
+
+    /* jobs that never started must release the reserved token themselves */
+    if (job->state.load(std::memory_order_acquire) == LoadJob::State::Cancelled) {
+        tokens->erase_if_equal(job->file, token);
+    }
+
+    /* loading jobs stop at the next entry */
+    XLOGF(INFO, "Loading of archive '{:s}' as token '{:s}' cancelled.", job->file, token);
+    reply({{"token", token}, {"state", LoadJob::name(job->state)}});
+}
+
+void SandboxController::execute_MOUNT(const std::string &token, const std::string &alias) {
+    std::string names;
+    auto        node = stackLayers({ token }, &names);
+
+    /* mount the virtual directory, the loaded tree is shared and copied on write */
+    root()->add(validate(alias), node);
+    mounts->insert_or_assign(alias, MountRecord { std::move(names), std::move(node) });
     XLOGF(INFO, "Virtual directory '{:s}' mounted from token '{:s}'", alias, token);
 }
 
+void SandboxController::execute_MOUNT_UNION(const std::vector<std::string> &layers, const std::string &alias) {
+    std::string names;
+    auto        now  = T::now();
+    auto        node = stackLayers(layers, &names);
+
+    /* the merged index is frozen just like the loaded trees, so writes go to a private upper layer */
+    root()->add(validate(alias), node);
+    mounts->insert_or_assign(alias, MountRecord { std::move(names), std::move(node) });
+    XLOGF(INFO, "Virtual directory '{:s}' mounted from {:d} layers in {:.3f}ms.", alias, layers.size(), (double)(T::now() - now) * 1e-6);
+}
+
 void SandboxController::execute_UNLOAD(const std::string &token) {
     auto end  = files->end();
     auto iter = files->find(token);
@@ -166,15 +685,225 @@ void SandboxController::execute_UNLOAD(const std::string &token) {
     auto frec = iter->second;
     auto name = std::move(frec.name);
 
-    /* erase from files and tokens */
+    /* erase from files, tokens and background jobs */
     files->erase(iter);
+    jobs->erase(token);
     tokens->erase(name);
+    frec.node.reset();
+    frec.view.reset();
     XLOGF(INFO, "Archive '{:s}' of token '{:s}' has been unloaded.", name, token);
+
+    /* the arena is released as a whole along with the last node, nodes still shared by mounts keep it alive */
+    if (frec.arena != nullptr && frec.arena->objects() != 0) {
+        XLOGF(INFO, "Arena of token '{:s}' is kept alive by {:d} objects still in use.", token, frec.arena->objects());
+    }
+
+    /* release the contents that were only kept by this archive */
+    sweep();
 }
 
 void SandboxController::execute_UNMOUNT(const std::string &alias) {
     root()->del(validate(alias));
+    mounts->erase(alias);
     XLOGF(INFO, "Virtual directory '{:s}' has been unmounted.", alias);
+
+    /* the mount might be the last user of some shared contents */
+    sweep();
+
+    /* the kernel might still have the mount point cached */
+    watchers->withRLock([&](auto &v) {
+        for (auto &fn : v) (*fn)(alias);
+    });
+}
+
+void SandboxController::execute_CHECKPOINT(const std::string &alias, const std::string &file) {
+    auto mend = mounts->end();
+    auto mnt  = mounts->find(validate(alias));
+
+    /* check for mounting status */
+    if (mnt == mend) {
+        throw FuseError(ENOENT);
+    }
+
+    /* only the differences from the archives it was mounted from are written, the mount is looked up under the barrier */
+    auto node = [&] { return root()->get(alias); };
+    auto stat = Checkpoint::save(file, mnt->second.names, mnt->second.base, node, WriteBarrier::of(alias));
+
+    /* reply the statistics */
+    XLOGF(INFO, "Virtual directory '{:s}' checkpointed to '{:s}', {:d} nodes, {:d} removed, {:d} bytes.", alias, file, stat.nodes, stat.removed, stat.bytes);
+    reply({{"nodes", stat.nodes}, {"removed", stat.removed}, {"bytes", stat.bytes}});
+}
+
+void SandboxController::execute_RESTORE(const std::string &file, const std::string &alias) {
+    int               err;
+    std::string       names;
+    FileNode::Node    base;
+    Checkpoint::Stats stat;
+    JSON              ids   = JSON::array();
+
+    /* check the alias before doing any work */
+    if (root()->find(validate(alias), &err) != nullptr) {
+        throw FuseError(EEXIST);
+    }
+
+    /* the checkpoint is applied on top of the archives it was taken from, which must be loaded */
+    auto node = Checkpoint::restore(file, [&](const std::string &archives) {
+        std::vector<std::string> layers;
+
+        /* the layers are listed from bottom to top */
+        for (auto &v : str::split(archives, LayerSep)) {
+            auto end  = tokens->end();
+            auto iter = tokens->find(std::string(v));
+
+            /* check for loading status */
+            if (iter == end) {
+                throw FuseError(ENOENT, "archive '" + std::string(v) + "' is not loaded");
+            }
+
+            /* use the loaded token */
+            ids.emplace_back(iter->second);
+            layers.emplace_back(iter->second);
+        }
+
+        /* rebuild the same layers */
+        base = stackLayers(layers, &names);
+        return base;
+    }, &stat);
+
+    /* mount the restored directory */
+    root()->add(validate(alias), node);
+    mounts->insert_or_assign(alias, MountRecord { std::move(names), std::move(base) });
+
+    /* reply the statistics */
+    XLOGF(INFO, "Virtual directory '{:s}' restored from '{:s}', {:d} nodes, {:d} removed, {:d} bytes.", alias, file, stat.nodes, stat.removed, stat.bytes);
+    reply({{"tokens", ids}, {"nodes", stat.nodes}, {"removed", stat.removed}, {"bytes", stat.bytes}});
+}
+
+static inline folly::Executor *executor() {
+    static auto *v = new folly::CPUThreadPoolExecutor(std::max(1u, std::thread::hardware_concurrency()));
+    return v;
+}
+
+template <typename F>
+static inline void parallel(size_t begin, size_t end, F &&fn) {
+    struct State {
+        size_t                      busy = 0;
+        size_t                      end  = 0;
+        std::mutex                  mutex;
+        std::atomic_size_t          next;
+        std::condition_variable     cond;
+        std::function<void(size_t)> fn;
+    };
+
+    /* helpers that only get to run after everything is done find nothing left, and touch nothing but the state */
+    auto st = std::make_shared<State>();
+    st->end  = end;
+    st->next = begin;
+    st->fn   = std::ref(fn);
+
+    /* every thread picks the next operation until there is none left */
+    auto nt   = std::min<size_t>(end - begin, std::max(1u, std::thread::hardware_concurrency()));
+    auto loop = [](State &s) { for (size_t i; (i = s.next++) < s.end;) s.fn(i); };
+
+    /* helpers come from a shared pool, the calling thread takes part as well */
+    for (size_t i = 1; i < nt; i++) {
+        executor()->add([st, loop] {
+            { std::lock_guard<std::mutex> _(st->mutex); st->busy++; }
+            loop(*st);
+            { std::lock_guard<std::mutex> _(st->mutex); st->busy--; st->cond.notify_all(); }
+        });
+    }
+
+    /* once every operation is taken, wait for the helpers that are still running one */
+    loop(*st);
+    std::unique_lock<std::mutex> lock(st->mutex);
+    st->cond.wait(lock, [&] { return st->busy == 0; });
+}
+
+void SandboxController::execute_BATCH(const JSON &ops, bool atomic) {
+    std::vector<JSON>                                reps;
+    std::vector<std::pair<std::string, CommandArgs>> reqs;
+
+    /* the whole batch is rejected if any of the operations is malformed */
+    try {
+        for (auto &op : ops) {
+            auto &req = reqs.emplace_back();
+            parseCommand(op, &req.first, &req.second);
+
+            /* batches do not nest */
+            if (req.first == "BATCH") {
+                throw FuseError(EINVAL);
+            }
+        }
+    } catch (const JSON::exception &e) {
+        XLOGF(ERR, "Cannot parse batch, dropped. JSON Error: [{:d}] {:s}", e.id, e.what());
+        throw FuseError(EINVAL);
+    }
+
+    /* atomic batches run in order without any other command touching the same things in between,
+     * and stop at the first failure, commands touching anything else go on in the meantime */
+    if (atomic) {
+        auto all = false;
+        auto res = std::vector<std::string>();
+
+        /* collect everything the batch touches */
+        for (auto &[cmd, args] : reqs) {
+            auto v = resources(args);
+            all |= barrier(cmd);
+            res.insert(res.end(), v.begin(), v.end());
+        }
+
+        /* run the operations */
+        ResourceLock _(res, all, true);
+        for (auto &[cmd, args] : reqs) {
+            if (reps.empty() || reps.back()["error"] == 0) {
+                reps.emplace_back(run(cmd, args));
+            } else {
+                reps.push_back({{"cmd", cmd}, {"error", ECANCELED}, {"message", "skipped"}});
+            }
+
+            /* replies are sent as soon as they are ready */
+            reply(reps.back());
+        }
+    } else {
+        reps.resize(reqs.size());
+
+        /* consecutive operations that touch different archives, tokens and aliases run concurrently */
+        for (size_t i = 0, j; i < reqs.size(); i = j) {
+            std::unordered_set<std::string> used;
+
+            /* extend the group until an operation depends on an earlier one in it */
+            for (j = i; j < reqs.size(); j++) {
+                auto res = resources(reqs[j].second);
+                auto dep = std::any_of(res.begin(), res.end(), [&](const std::string &v) { return used.count(v) != 0; });
+
+                /* commands with dependencies that can not be told from the arguments run alone */
+                if (barrier(reqs[j].first)) {
+                    j += j == i;
+                    break;
+                }
+
+                /* depends on an earlier operation */
+                if (dep) {
+                    break;
+                }
+
+                /* add to the group */
+                used.insert(res.begin(), res.end());
+            }
+
+            /* run the group, every operation locks what it touches on it's own */
+            parallel(i, j, [&](size_t k) {
+                ResourceLock _(resources(reqs[k].second), barrier(reqs[k].first), false);
+                reps[k] = run(reqs[k].first, reqs[k].second);
+            });
+
+            /* one reply per operation, in order, as soon as the group is done */
+            for (size_t k = i; k < j; k++) {
+                reply(reps[k]);
+            }
+        }
+    }
 }
 
 #pragma clang diagnostic pop
@@ -186,9 +915,125 @@ static inline void deleteAndNull(T *&p) {
     delete v;
 }
 
+void SandboxController::serve(const std::string &cmd, const CommandArgs &args, Sink &&sink) {
+    SandboxController ctl(O_WRONLY);
+    ctl._sink = std::move(sink);
+    ctl.dispatch(cmd, args);
+}
+
 void SandboxController::end() {
+    deleteAndNull(loads);
+    deleteAndNull(jobs);
     deleteAndNull(files);
     deleteAndNull(tokens);
+    deleteAndNull(mounts);
+    deleteAndNull(watchers);
+}
+
+std::vector<FileNode::Node> SandboxController::roots() {
+    std::vector<FileNode::Node> ret = { root() };
+
+    /* loaded archives are not necessarily mounted */
+    for (auto &v : *files) {
+        ret.emplace_back(v.second.node);
+    }
+
+    /* all done */
+    return ret;
+}
+
+static inline std::string label(const std::string &v) {
+    std::string ret;
+    ret.reserve(v.size());
+
+    /* quotes, backslashes and line feeds must be escaped in label values */
+    for (char ch : v) {
+        switch (ch) {
+            case '"'  : ret += "\\\""; break;
+            case '\\' : ret += "\\\\"; break;
+            case '\n' : ret += "\\n"; break;
+            default   : ret += ch; break;
+        }
+    }
+
+    /* all done */
+    return ret;
+}
+
+static inline void gauge(std::string *out, const char *name, const char *help) {
+    out->append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out->append("# TYPE ").append(name).append(" gauge\n");
+}
+
+static inline void sample(std::string *out, const char *name, const std::string &labels, uint64_t value) {
+    out->append(name);
+    out->append(labels.empty() ? "" : "{" + labels + "}");
+    out->append(" ").append(std::to_string(value)).append("\n");
+}
+
+void SandboxController::metrics(std::string *out) {
+    static constexpr size_t       Count           = 6;
+    static constexpr const char * Names[Count][2] = {
+        { "sandbox_fs_token_nodes"              , "Number of nodes of the loaded archive."               },
+        { "sandbox_fs_token_metadata_bytes"     , "Bytes of node metadata of the loaded archive."        },
+        { "sandbox_fs_token_dedupe_bytes"       , "Bytes of file contents checked for duplicates."       },
+        { "sandbox_fs_token_dedupe_saved_bytes" , "Bytes of file contents shared with other archives."   },
+        { "sandbox_fs_token_arena_bytes"        , "Bytes reserved by the node arena of the archive."     },
+        { "sandbox_fs_token_arena_used_bytes"   , "Bytes of the node arena taken by nodes and names."    },
+    };
+
+    /* take every loaded archive once, tokens are labeled along with the archive name */
+    std::vector<std::pair<std::string, std::array<uint64_t, Count>>> rows;
+    for (auto &v : *files) {
+        auto &dst = rows.emplace_back("token=\"" + label(v.first) + "\",archive=\"" + label(v.second.name) + "\"", std::array<uint64_t, Count>());
+
+        /* node counts, and the memory they take */
+        dst.second[0] = v.second.nodes;
+        dst.second[1] = v.second.meta;
+        dst.second[2] = v.second.dedupe.bytes;
+        dst.second[3] = v.second.dedupe.saved;
+        dst.second[4] = v.second.arena == nullptr ? 0 : v.second.arena->size();
+        dst.second[5] = v.second.arena == nullptr ? 0 : v.second.arena->used();
+    }
+
+    /* per-token metrics */
+    for (size_t i = 0; i < Count; i++) {
+        gauge(out, Names[i][0], Names[i][1]);
+        for (auto &[labels, values] : rows) sample(out, Names[i][0], labels, values[i]);
+    }
+
+    /* global metrics */
+    gauge(out, "sandbox_fs_tokens", "Number of loaded archives.");
+    sample(out, "sandbox_fs_tokens", "", files->size());
+    gauge(out, "sandbox_fs_mounts", "Number of mounted directories.");
+    sample(out, "sandbox_fs_mounts", "", mounts->size());
+    gauge(out, "sandbox_fs_buffer_bytes", "Bytes of file contents held in memory.");
+    sample(out, "sandbox_fs_buffer_bytes", "", std::max<int64_t>(ByteBuffer::allocated(), 0));
+}
+
+std::vector<FileNode::Node> SandboxController::mounted() {
+    std::vector<FileNode::Node> ret;
+
+    /* mounted directories are replaced by private copies on the first write, so take them from the root */
+    root()->nodes().foreach([&](const std::string &, const FileNode::Node &node) {
+        ret.emplace_back(node);
+    });
+
+    /* all done */
+    return ret;
+}
+
+ControlInterface::Watch SandboxController::watch(Watcher &&fn) {
+    auto ref = std::make_shared<Watcher>(std::move(fn));
+    watchers->wlock()->emplace_back(ref);
+
+    /* unregistering waits for the watchers that are running, so the owner can be destroyed right after */
+    return ControlInterface::Watch(ref.get(), [ref](void *) {
+        if (watchers != nullptr) {
+            auto v = watchers->wlock();
+            v->erase(std::remove(v->begin(), v->end(), ref), v->end());
+        }
+    });
 }
 
 FileNode::Node &SandboxController::root()  {
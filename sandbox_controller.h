@@ -1,7 +1,9 @@
 #ifndef SANDBOX_FS_SANDBOX_CONTROLLER_H
 #define SANDBOX_FS_SANDBOX_CONTROLLER_H
 
+#include <vector>
 #include <iostream>
+#include <functional>
 #include <unordered_map>
 #include <nlohmann/json.hpp>
 
@@ -12,22 +14,39 @@ static constexpr mode_t     Mode   = S_IFREG | 0644;
 static constexpr const char Name[] = "_fsctl";
 
 class SandboxController : public ControlInterfaceAdapter<SandboxController, Name, Mode> {
-    std::stringbuf _rbuf;
-    std::stringbuf _wbuf;
-
 public:
     using JSON        = nlohmann::json;
+    using Watcher     = ControlInterface::Watcher;
+    using Sink        = std::function<void(const JSON &)>;
     using CommandArgs = std::unordered_map<std::string, JSON>;
     using ControlInterfaceAdapter::ControlInterfaceAdapter;
 
+private:
+    Sink           _sink;
+    std::stringbuf _rbuf;
+    std::stringbuf _wbuf;
+
 public:
     ssize_t do_read(char *buf, size_t len, size_t off) override;
     ssize_t do_write(const char *buf, size_t len, size_t off) override;
 
 private:
-    void reply(const JSON &v);
-    void fireCommand(const char *buf, size_t len);
-    void executeCommand(const std::string &cmd, const CommandArgs &args);
+    void        reply(const JSON &v);
+    void        fireLine(const std::string &str);
+    void        fireCommand(const char *buf, size_t len);
+    std::string nextLine();
+
+private:
+    void        dispatch(const std::string &cmd, const CommandArgs &args);
+    void        executeCommand(const std::string &cmd, const CommandArgs &args);
+    static JSON run(const std::string &cmd, const CommandArgs &args);
+
+private:
+    template <typename T>
+    static T option(const CommandArgs &args, const char *name, T defv) {
+        auto iter = args.find(name);
+        return iter == args.end() ? std::move(defv) : iter->second.get<T>();
+    }
 
 #define DECLARE_CMD_1(name, type0, arg0)                                \
     void execute_ ## name(type0 arg0);                                  \
@@ -35,6 +54,25 @@ private:
         execute_ ## name(args.at(#arg0).get<std::decay_t<type0>>());    \
     }
 
+#define DECLARE_CMD_1_OPT_1(name, type0, arg0, type1, arg1, def1)       \
+    void execute_ ## name(type0 arg0, type1 arg1);                      \
+    void execute_ ## name(const CommandArgs &args) {                    \
+        execute_ ## name(                                               \
+            args.at(#arg0).get<std::decay_t<type0>>(),                  \
+            option<std::decay_t<type1>>(args, #arg1, def1)              \
+        );                                                              \
+    }
+
+#define DECLARE_CMD_1_OPT_2(name, type0, arg0, type1, arg1, def1, type2, arg2, def2)  \
+    void execute_ ## name(type0 arg0, type1 arg1, type2 arg2);                      \
+    void execute_ ## name(const CommandArgs &args) {                                \
+        execute_ ## name(                                                           \
+            args.at(#arg0).get<std::decay_t<type0>>(),                              \
+            option<std::decay_t<type1>>(args, #arg1, def1),                         \
+            option<std::decay_t<type2>>(args, #arg2, def2)                          \
+        );                                                                          \
+    }
+
 #define DECLARE_CMD_2(name, type0, arg0, type1, arg1)                   \
     void execute_ ## name(type0 arg0, type1 arg1);                      \
     void execute_ ## name(const CommandArgs &args) {                    \
@@ -45,13 +83,21 @@ private:
     }
 
 private:
-    DECLARE_CMD_1(LOAD, const std::string &, file)
+    DECLARE_CMD_1_OPT_2(LOAD, const std::string &, file, bool, lazy, false, bool, async, false)
+    DECLARE_CMD_1(STATUS, const std::string &, token)
+    DECLARE_CMD_1(CANCEL, const std::string &, token)
     DECLARE_CMD_2(MOUNT, const std::string &, token, const std::string &, alias)
+    DECLARE_CMD_2(MOUNT_UNION, const std::vector<std::string> &, layers, const std::string &, alias)
     DECLARE_CMD_1(UNLOAD, const std::string &, token)
     DECLARE_CMD_1(UNMOUNT, const std::string &, alias)
+    DECLARE_CMD_2(CHECKPOINT, const std::string &, alias, const std::string &, file)
+    DECLARE_CMD_2(RESTORE, const std::string &, file, const std::string &, alias)
+    DECLARE_CMD_1_OPT_1(BATCH, const JSON &, ops, bool, atomic, false)
 
 #undef DECLARE_CMD_1
 #undef DECLARE_CMD_2
+#undef DECLARE_CMD_1_OPT_1
+#undef DECLARE_CMD_1_OPT_2
 
 public:
     struct Guard {
@@ -59,8 +105,13 @@ public:
     };
 
 public:
-    static void             end();
-    static FileNode::Node & root();
+    static void                        serve(const std::string &cmd, const CommandArgs &args, Sink &&sink);
+    static void                        end();
+    static ControlInterface::Watch     watch(Watcher &&fn);
+    static void                        metrics(std::string *out);
+    static FileNode::Node &            root();
+    static std::vector<FileNode::Node> roots();
+    static std::vector<FileNode::Node> mounted();
 };
 
 #endif /* SANDBOX_FS_SANDBOX_CONTROLLER_H */
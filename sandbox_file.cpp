@@ -1,3 +1,4 @@
+#include <memory>
 #include "sandbox_file.h"
 
 void SandboxFile::resize(size_t size) {
@@ -27,3 +28,28 @@ ssize_t SandboxFile::write(const char *buf, size_t len, size_t off) {
         return do_write(buf, len, off);
     }
 }
+
+bool SandboxFile::pin(size_t len, size_t off, ByteBuffer::Pinned *pins) {
+    if ((_mode & O_ACCMODE) == O_WRONLY) {
+        throw FuseError(EBADF);
+    } else {
+        return do_pin(len, off, pins);
+    }
+}
+
+ssize_t SandboxFile::fill(size_t len, size_t off, const ByteBuffer::Filler &fn) {
+    if ((_mode & O_ACCMODE) == O_RDONLY) {
+        throw FuseError(EBADF);
+    } else {
+        return do_fill(len, off, fn);
+    }
+}
+
+bool SandboxFile::do_pin(size_t, size_t, ByteBuffer::Pinned *) {
+    return false;
+}
+
+ssize_t SandboxFile::do_fill(size_t len, size_t off, const ByteBuffer::Filler &fn) {
+    std::unique_ptr<char[]> buf(new char[len]);
+    return do_write(buf.get(), fn(buf.get(), len), off);
+}
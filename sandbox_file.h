@@ -6,6 +6,7 @@
 #include <fcntl.h>
 
 #include "fuse_error.h"
+#include "byte_buffer.h"
 
 class SandboxFile {
     int _mode;
@@ -22,6 +23,10 @@ public:
     ssize_t read(char *buf, size_t len, size_t off);
     ssize_t write(const char *buf, size_t len, size_t off);
 
+public:
+    bool    pin(size_t len, size_t off, ByteBuffer::Pinned *pins);
+    ssize_t fill(size_t len, size_t off, const ByteBuffer::Filler &fn);
+
 protected:
     virtual void do_resize(size_t size) = 0;
     virtual void do_getstat(struct stat *stat) = 0;
@@ -29,6 +34,10 @@ protected:
 protected:
     virtual ssize_t do_read(char *buf, size_t len, size_t off) = 0;
     virtual ssize_t do_write(const char *buf, size_t len, size_t off) = 0;
+
+protected:
+    virtual bool    do_pin(size_t len, size_t off, ByteBuffer::Pinned *pins);
+    virtual ssize_t do_fill(size_t len, size_t off, const ByteBuffer::Filler &fn);
 };
 
 #endif /* SANDBOX_FS_SANDBOX_FILE_H */
@@ -1,4 +1,13 @@
+#include <memory>
+#include <vector>
 #include <folly/logging/xlog.h>
+
+#include "op_stats.h"
+#include "dir_listing.h"
+#include "fuse_buffer.h"
+#include "opened_file.h"
+#include "fuse_session.h"
+#include "write_barrier.h"
 #include "sandbox_file_system.h"
 
 namespace {
@@ -23,40 +32,6 @@ public:
         }
     }
 };
-
-struct FuseChannel {
-    const char *       mp;
-    struct fuse_chan * ch;
-
-public:
-    ~FuseChannel() { fuse_unmount(mp, ch); }
-    FuseChannel(const char *mp, struct fuse_args *args) : mp(mp) {
-        if ((ch = fuse_mount(mp, args)) == nullptr) {
-            throw FuseError();
-        }
-    }
-};
-
-struct FuseSignals {
-    struct fuse_session *fs = nullptr;
-
-public:
-    ~FuseSignals() {
-        if (fs != nullptr) {
-            fuse_remove_signal_handlers(fs);
-        }
-    }
-
-public:
-    bool init(struct fuse_session *ss) {
-        if (fuse_set_signal_handlers(ss) != 0) {
-            return false;
-        } else {
-            fs = ss;
-            return true;
-        }
-    }
-};
 }
 
 SandboxFileSystem::~SandboxFileSystem() {
@@ -64,7 +39,7 @@ SandboxFileSystem::~SandboxFileSystem() {
     _root.reset();
 }
 
-SandboxFileSystem::SandboxFileSystem(FileNode::Node root, ControlInterface *iface) : _ctrl(iface) {
+SandboxFileSystem::SandboxFileSystem(FileNode::Node root, ControlFiles ctrls, double ttl) : _ttl(ttl), _ctrls(std::move(ctrls)) {
     _root.swap(root);
     XLOG(INFO, "Sandbox initialized successfully.");
 }
@@ -84,28 +59,42 @@ void SandboxFileSystem::start(const std::string &mount, const std::string &optio
 
     /* fuse operations */
     static struct fuse_operations ops = {
-        .getattr   = fs_getattr,
-        .mkdir     = fs_mkdir,
-        .unlink    = fs_unlink,
-        .rmdir     = fs_rmdir,
-        .rename    = fs_rename,
-        .truncate  = fs_truncate,
-        .open      = fs_open,
-        .read      = fs_read,
-        .write     = fs_write,
-        .release   = fs_release,
-        .readdir   = fs_readdir,
-        .access    = fs_access,
-        .create    = fs_create,
-        .ftruncate = fs_ftruncate,
-        .fgetattr  = fs_fgetattr,
-        .utimens   = fs_utimens,
+        .getattr    = fs_getattr,
+        .mkdir      = fs_mkdir,
+        .unlink     = fs_unlink,
+        .rmdir      = fs_rmdir,
+        .rename     = fs_rename,
+        .truncate   = fs_truncate,
+        .open       = fs_open,
+        .read       = fs_read,
+        .write      = fs_write,
+        .release    = fs_release,
+        .opendir    = fs_opendir,
+        .readdir    = fs_readdir,
+        .releasedir = fs_releasedir,
+        .init       = fs_init,
+        .access     = fs_access,
+        .create     = fs_create,
+        .ftruncate  = fs_ftruncate,
+        .fgetattr   = fs_fgetattr,
+        .utimens    = fs_utimens,
+#if FUSE_VERSION >= 29
+        .write_buf  = fs_write_buf,
+        .read_buf   = fs_read_buf,
+#endif
     };
 
+    /* the path API has no per-node timeouts nor invalidations, let libfuse keep
+     * file pages as long as the mtime and size stays the same instead */
+    std::string mopts = options;
+    if (_ttl > 0.0) {
+        mopts = mopts.empty() ? "auto_cache" : "auto_cache," + mopts;
+    }
+
     /* add mount options if any */
-    if (!options.empty()) {
+    if (!mopts.empty()) {
         opts[1]   = "-o";
-        opts[2]   = options.c_str();
+        opts[2]   = mopts.c_str();
         args.argc = 3;
     }
 
@@ -126,34 +115,55 @@ void SandboxFileSystem::start(const std::string &mount, const std::string &optio
 #pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
 
 namespace {
-class OpenedFile : public SandboxFile {
-    FileNode::Node _node;
+struct Invalidate {
+    PathCache &  cache;
+    const char * path;
+    bool         tree = false;
 
 public:
-    OpenedFile(int mode, FileNode::Node node) : SandboxFile(mode), _node(std::move(node)) {}
-
-public:
-    void do_resize  (size_t size)          override { _node->resize(size); }
-    void do_getstat (FileNode::Stat *stat) override { *stat = _node->stat(); }
-
-public:
-    ssize_t do_read  (char *buf, size_t len, size_t off)       override { return _node->read(buf, len, off); }
-    ssize_t do_write (const char *buf, size_t len, size_t off) override { return _node->write(buf, len, off); }
+    ~Invalidate() { cache.invalidate(path, tree); }
 };
+}
+
+FileNode::Node SandboxFileSystem::lookup(const char *path) {
+    int  err;
+    auto ret = _cache.find(_root, path, &err);
 
-inline bool isControlFile(const char *path, ControlInterface *iface) {
-    return *path == '/' &&
-           iface != nullptr &&
-           strcmp(path + 1, iface->name()) == 0;
+    /* check for lookup errors */
+    if (ret == nullptr) {
+        throw FuseError(err);
+    } else {
+        return ret;
+    }
 }
+
+ControlInterface *SandboxFileSystem::control(const char *path) {
+    if (*path != '/') {
+        return nullptr;
+    }
+
+    /* control files only live in the root directory */
+    for (auto *v : _ctrls) {
+        if (strcmp(path + 1, v->name()) == 0) {
+            return v;
+        }
+    }
+
+    /* not a control file */
+    return nullptr;
 }
 
 void SandboxFileSystem::do_open(const char *path, struct fuse_file_info *fi) {
-    if (isControlFile(path, _ctrl)) {
-        fi->fh        = reinterpret_cast<uint64_t>(_ctrl->open(fi->flags));
+    if (auto *ctl = control(path)) {
+        fi->fh        = reinterpret_cast<uint64_t>(ctl->open(fi->flags));
         fi->direct_io = true;
+    } else if (!isWritable(fi->flags)) {
+        fi->fh        = reinterpret_cast<uint64_t>(new ReadOnlyFile(fi->flags, lookup(path)));
+        fi->direct_io = false;
     } else {
-        fi->fh        = reinterpret_cast<uint64_t>(new OpenedFile(fi->flags, _root->get(path, (fi->flags & O_CREAT) != 0)));
+        Invalidate   _ { _cache, path };
+        WriteBarrier w { path };
+        fi->fh        = reinterpret_cast<uint64_t>(new OpenedFile(fi->flags, _root->get(path, (fi->flags & O_CREAT) != 0, true), path));
         fi->direct_io = false;
     }
 }
@@ -162,12 +172,16 @@ long SandboxFileSystem::do_read(const char *, char *buf, size_t size, off_t off,
     if (fi->fh == 0)  {
         throw FuseError(EINVAL);
     } else {
-        return reinterpret_cast<SandboxFile *>(fi->fh)->read(buf, size, off);
+        auto ret = reinterpret_cast<SandboxFile *>(fi->fh)->read(buf, size, off);
+        OpStats::transferred(ret);
+        return ret;
     }
 }
 
 void SandboxFileSystem::do_rmdir(const char *path) {
-    if (!isControlFile(path, _ctrl)) {
+    if (control(path) == nullptr) {
+        Invalidate   _ { _cache, path };
+        WriteBarrier w { path };
         _root->rmdir(path);
     } else {
         throw FuseError(ENOTDIR);
@@ -177,9 +191,11 @@ void SandboxFileSystem::do_rmdir(const char *path) {
 void SandboxFileSystem::do_mkdir(const char *path, mode_t mode) {
     if (!S_ISDIR(mode)) {
         throw FuseError(EINVAL);
-    } else if (isControlFile(path, _ctrl)) {
+    } else if (control(path) != nullptr) {
         throw FuseError(EEXIST);
     } else {
+        Invalidate   _ { _cache, path };
+        WriteBarrier w { path };
         _root->mkdir(path);
     }
 }
@@ -188,7 +204,9 @@ long SandboxFileSystem::do_write(const char *, const char *buf, size_t size, off
     if (fi->fh == 0)  {
         throw FuseError(EINVAL);
     } else {
-        return reinterpret_cast<SandboxFile *>(fi->fh)->write(buf, size, off);
+        auto ret = reinterpret_cast<SandboxFile *>(fi->fh)->write(buf, size, off);
+        OpStats::transferred(ret);
+        return ret;
     }
 }
 
@@ -197,67 +215,114 @@ void SandboxFileSystem::do_create(const char *path, mode_t, struct fuse_file_inf
 }
 
 void SandboxFileSystem::do_unlink(const char *path) {
-    if (!isControlFile(path, _ctrl)) {
+    if (control(path) == nullptr) {
+        Invalidate   _ { _cache, path };
+        WriteBarrier w { path };
         _root->unlink(path);
     } else {
         throw FuseError(EPERM);
     }
 }
 
-void SandboxFileSystem::do_access(const char *path, int) {
-    if (!isControlFile(path, _ctrl)) {
-        _root->get(path)->access();
+int SandboxFileSystem::do_access(const char *path, int) {
+    int            err;
+    FileNode::Node node;
+
+    /* control files are always accessible */
+    if (control(path) != nullptr) {
+        return 0;
+    }
+
+    /* negative lookups are common, so report them without throwing */
+    if ((node = _cache.find(_root, path, &err)) == nullptr) {
+        return -err;
+    } else {
+        node->access();
+        return 0;
     }
 }
 
 void SandboxFileSystem::do_rename(const char *path, const char *dest) {
-    if (isControlFile(path, _ctrl) || isControlFile(dest, _ctrl)) {
+    if (control(path) != nullptr || control(dest) != nullptr) {
         throw FuseError(EPERM);
     } else {
+        int  err;
+        auto node = _cache.find(_root, path, &err);
+        auto tree = node != nullptr && S_ISDIR(node->stat().st_mode);
+
+        /* lookups below a moved directory change as well */
+        Invalidate   s { _cache, path, tree };
+        Invalidate   d { _cache, dest, tree };
+        WriteBarrier w { path, dest };
         _root->rename(path, dest);
     }
 }
 
-void SandboxFileSystem::do_getattr(const char *path, struct stat *stat) {
-    if (isControlFile(path, _ctrl)) {
-        *stat = _ctrl->stat();
+int SandboxFileSystem::do_getattr(const char *path, struct stat *stat) {
+    int            err;
+    FileNode::Node node;
+
+    /* control files are not part of the tree */
+    if (auto *ctl = control(path)) {
+        *stat = ctl->stat();
+        return 0;
+    }
+
+    /* negative lookups are common, so report them without throwing */
+    if ((node = _cache.find(_root, path, &err)) == nullptr) {
+        return -err;
     } else {
-        *stat = _root->get(path)->stat();
+        *stat = node->stat();
+        return 0;
     }
 }
 
 void SandboxFileSystem::do_utimens(const char *path, const struct timespec *tv) {
     if (tv != nullptr) {
-        if (isControlFile(path, _ctrl)) {
+        if (control(path) != nullptr) {
             throw FuseError(EPERM);
         } else {
-            _root->get(path)->utimens(tv[0], tv[1]);
+            Invalidate   _ { _cache, path };
+            WriteBarrier w { path };
+            _root->get(path, false, true)->utimens(tv[0], tv[1]);
         }
     }
 }
 
-void SandboxFileSystem::do_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, struct fuse_file_info *) {
-    static FileNode::Stat st = {
-        .st_mode      = S_IFDIR | 0755,
-        .st_nlink     = 1,
-        .st_uid       = geteuid(),
-        .st_gid       = getegid(),
-        .st_atimespec = T::nowts(),
-        .st_size      = 0,
-    };
+void SandboxFileSystem::do_opendir(const char *path, struct fuse_file_info *fi) {
+    int  err;
+    auto dir = lookup(path);
+    auto ctl = strcmp(path, "/") == 0 ? _ctrls : ControlFiles();
 
-    /* current & super directory */
-    filler(buf, ".", &st, 0);
-    filler(buf, "..", &st, 0);
+    /* the super directory of the root is the root itself, the listing falls back to it if the parent is gone */
+    auto name = std::string_view(path);
+    auto pos  = name.rfind('/');
+    auto par  = pos == 0 || pos == std::string_view::npos ? _root : _cache.find(_root, name.substr(0, pos), &err);
 
-    /* add the control file if listing the mount root */
-    if (_ctrl != nullptr && strcmp(path, "/") == 0) {
-        filler(buf, _ctrl->name(), &_ctrl->stat(), 0);
+    /* the listing is taken on the first read, and kept until the directory is closed */
+    if (!S_ISDIR(dir->stat().st_mode)) {
+        throw FuseError(ENOTDIR);
+    } else {
+        fi->fh = reinterpret_cast<uint64_t>(new DirListing(dir, par, std::move(ctl)));
     }
+}
 
-    /* add every directory entry */
-    for (auto &v : _root->get(path)->nodes()) {
-        filler(buf, v.first.c_str(), &v.second->stat(), 0);
+void SandboxFileSystem::do_readdir(const char *, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi) {
+    if (fi->fh == 0) {
+        throw FuseError(EINVAL);
+    }
+
+    /* add entries until the buffer is full, the kernel comes back with the offset of the next one */
+    reinterpret_cast<DirListing *>(fi->fh)->list(off, [&](const char *name, const struct stat &st, off_t next) {
+        return filler(buf, name, &st, next) == 0;
+    });
+}
+
+void SandboxFileSystem::do_releasedir(const char *, struct fuse_file_info *fi) {
+    if (fi->fh == 0) {
+        throw FuseError(EINVAL);
+    } else {
+        delete reinterpret_cast<DirListing *>(fi->fh);
     }
 }
 
@@ -270,18 +335,21 @@ void SandboxFileSystem::do_release(const char *, struct fuse_file_info *fi) {
 }
 
 void SandboxFileSystem::do_truncate(const char *path, off_t off) {
-    if (isControlFile(path, _ctrl)) {
+    if (control(path) != nullptr) {
         throw FuseError(EPERM);
     } else {
-        _root->get(path)->resize(off);
+        Invalidate   _ { _cache, path };
+        WriteBarrier w { path };
+        _root->get(path, false, true)->resize(off);
     }
 }
 
-void SandboxFileSystem::do_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *fi) {
+int SandboxFileSystem::do_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *fi) {
     if (fi->fh == 0) {
-        do_getattr(path, stat);
+        return do_getattr(path, stat);
     } else {
         reinterpret_cast<SandboxFile *>(fi->fh)->getstat(stat);
+        return 0;
     }
 }
 
@@ -293,25 +361,134 @@ void SandboxFileSystem::do_ftruncate(const char *path, off_t off, struct fuse_fi
     }
 }
 
+#if FUSE_VERSION >= 29
+
+/* pages of a spliced read, libfuse sends the reply on this thread after `read_buf` returns,
+ * so they stay pinned until the next request handled by this thread, which releases them */
+static thread_local ByteBuffer::Pinned held;
+
+void SandboxFileSystem::do_read_buf(const char *, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *fi) {
+    static thread_local std::vector<FuseBuffer> vec;
+
+    /* the pinned pages keep the descriptors alive until the reply is sent */
+    bool fds  = false;
+    bool snap = false;
+    auto fp   = reinterpret_cast<SandboxFile *>(fi->fh);
+
+    /* check for file handles */
+    if (fp == nullptr) {
+        throw FuseError(EINVAL);
+    }
+
+    /* collect the pages if the file can be pinned */
+    if ((snap = fp->pin(size, off, &held))) {
+        vec.clear();
+        held.scatter([&](const char *mem, size_t len, int fd, off_t pos) {
+            fds |= fd >= 0;
+            vec.emplace_back(mem, len, fd, pos);
+        });
+    }
+
+    /* libfuse frees the memory of every buffer, and copies multiple memory buffers
+     * once more, so a single copied buffer is used unless some parts can be spliced */
+    if (!fds) {
+        std::unique_ptr<char, decltype(&free)> data(static_cast<char *>(malloc(size)), free);
+        auto ret  = snap ? held.len() : fp->read(data.get(), size, off);
+        auto bufv = static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+
+        /* copy out of the pinned pages, which are not needed any more afterwards */
+        if (snap) {
+            auto *ptr = data.get();
+            for (auto &v : vec) ptr = static_cast<char *>(memcpy(ptr, v.mem, v.len)) + v.len;
+            held.release();
+        }
+
+        /* build the buffer vector */
+        *bufv            = FUSE_BUFVEC_INIT(ret);
+        *bufp            = bufv;
+        bufv->buf[0].mem = data.release();
+        OpStats::transferred(ret);
+        return;
+    }
+
+    /* build the buffer vector */
+    auto bufv   = static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec) + vec.size() * sizeof(struct fuse_buf)));
+    bufv->idx   = 0;
+    bufv->off   = 0;
+    bufv->count = vec.size();
+
+    /* spliceable parts point at the descriptor, others are copied */
+    for (size_t i = 0; i < vec.size(); i++) {
+        OpStats::transferred(vec[i].len);
+        if ((bufv->buf[i] = vec[i].buf()).mem != nullptr) {
+            bufv->buf[i].mem = memcpy(malloc(vec[i].len), vec[i].mem, vec[i].len);
+        }
+    }
+
+    /* all done */
+    *bufp = bufv;
+}
+
+long SandboxFileSystem::do_write_buf(const char *, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+    if (fi->fh == 0)  {
+        throw FuseError(EINVAL);
+    } else {
+        auto ret = writeBuffer(reinterpret_cast<SandboxFile *>(fi->fh), buf, off);
+        OpStats::transferred(ret);
+        return ret;
+    }
+}
+
+#endif
+
 /** File-System Proxy Stubs **/
 
+static inline void settle() {
+#if FUSE_VERSION >= 29
+    /* the reply of the previous request on this thread has been sent */
+    held.release();
+#endif
+}
+
+void *SandboxFileSystem::fs_init(struct fuse_conn_info *conn) {
+#if FUSE_VERSION >= 29
+    /* reads can be spliced from the memfd pools */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+#endif
+
+    /* keep the file system instance as private data */
+    return fuse_get_context()->private_data;
+}
+
 #define FS_V(name, formal, actual)                                                          \
     int SandboxFileSystem::fs_ ## name formal {                                             \
+        static auto &op = OpStats::fuse().get(#name);                                       \
+        OpStats::Timer t(op);                                                               \
+        settle();                                                                           \
         try {                                                                               \
             ((SandboxFileSystem *)fuse_get_context()->private_data)->do_ ## name actual;    \
             return 0;                                                                       \
         } catch (const FuseError &e) {                                                      \
+            t.fail();                                                                       \
             return -e.code();                                                               \
         }                                                                                   \
     }
 
-#define FS_R(name, formal, actual)                                                              \
-    int SandboxFileSystem::fs_ ## name formal {                                                 \
-        try {                                                                                   \
-            return ((SandboxFileSystem *)fuse_get_context()->private_data)->do_ ## name actual; \
-        } catch (const FuseError &e) {                                                          \
-            return -e.code();                                                                   \
-        }                                                                                       \
+#define FS_R(name, formal, actual)                                                                 \
+    int SandboxFileSystem::fs_ ## name formal {                                                    \
+        static auto &op = OpStats::fuse().get(#name);                                              \
+        OpStats::Timer t(op);                                                                      \
+        settle();                                                                                  \
+        try {                                                                                      \
+            int ret = ((SandboxFileSystem *)fuse_get_context()->private_data)->do_ ## name actual; \
+            if (ret < 0) t.fail();                                                                 \
+            return ret;                                                                            \
+        } catch (const FuseError &e) {                                                             \
+            t.fail();                                                                              \
+            return -e.code();                                                                      \
+        }                                                                                          \
     }
 
 #define PATH const char *path
@@ -324,15 +501,21 @@ FS_V(mkdir     , (PATH, mode_t mode)
 FS_R(write     , (PATH, const char *buf, size_t size, off_t off, INFO)            , (path, buf, size, off, fi))
 FS_V(create    , (PATH, mode_t mode, INFO)                                        , (path, mode, fi))
 FS_V(unlink    , (PATH)                                                           , (path))
-FS_V(access    , (PATH, int mode)                                                 , (path, mode))
+FS_R(access    , (PATH, int mode)                                                 , (path, mode))
 FS_V(rename    , (PATH, const char *dest)                                         , (path, dest))
-FS_V(getattr   , (PATH, struct stat *stat)                                        , (path, stat))
+FS_R(getattr   , (PATH, struct stat *stat)                                        , (path, stat))
 FS_V(utimens   , (PATH, const struct timespec *tv)                                , (path, tv))
+FS_V(opendir   , (PATH, INFO)                                                     , (path, fi))
 FS_V(readdir   , (PATH, void *buf, fuse_fill_dir_t fn, off_t off, INFO)           , (path, buf, fn, off, fi))
+FS_V(releasedir, (PATH, INFO)                                                     , (path, fi))
 FS_V(release   , (PATH, INFO)                                                     , (path, fi))
 FS_V(truncate  , (PATH, off_t off)                                                , (path, off))
-FS_V(fgetattr  , (PATH, struct stat *stat, INFO)                                  , (path, stat, fi))
+FS_R(fgetattr  , (PATH, struct stat *stat, INFO)                                  , (path, stat, fi))
 FS_V(ftruncate , (PATH, off_t off, INFO)                                          , (path, off, fi))
+#if FUSE_VERSION >= 29
+FS_V(read_buf  , (PATH, struct fuse_bufvec **bufp, size_t size, off_t off, INFO)  , (path, bufp, size, off, fi))
+FS_R(write_buf , (PATH, struct fuse_bufvec *buf, off_t off, INFO)                 , (path, buf, off, fi))
+#endif
 
 #undef FS_V
 #undef FS_R
@@ -9,16 +9,19 @@
 
 #include "file_node.h"
 #include "fuse_error.h"
+#include "path_cache.h"
 #include "sandbox_file.h"
 #include "control_interface.h"
 
 class SandboxFileSystem {
-    FileNode::Node     _root;
-    ControlInterface * _ctrl;
+    double         _ttl;
+    PathCache      _cache;
+    FileNode::Node _root;
+    ControlFiles   _ctrls;
 
 public:
    ~SandboxFileSystem();
-    SandboxFileSystem(FileNode::Node root, ControlInterface *iface);
+    SandboxFileSystem(FileNode::Node root, ControlFiles ctrls, double ttl = 0.0);
 
 public:
     void start(const std::string &mount, const std::string &options = "");
@@ -34,18 +37,28 @@ private:
     long do_write(const char *path, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
     void do_create(const char *path, mode_t mode, struct fuse_file_info *fi);
     void do_unlink(const char *path);
-    void do_access(const char *path, int mode);
+    int  do_access(const char *path, int mode);
     void do_rename(const char *path, const char *dest);
-    void do_getattr(const char *path, struct stat *stat);
+    int  do_getattr(const char *path, struct stat *stat);
     void do_utimens(const char *path, const struct timespec *tv);
+    void do_opendir(const char *path, struct fuse_file_info *fi);
     void do_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi);
+    void do_releasedir(const char *path, struct fuse_file_info *fi);
     void do_release(const char *path, struct fuse_file_info *fi);
     void do_truncate(const char *path, off_t off);
-    void do_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *fi);
+    int  do_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *fi);
     void do_ftruncate(const char *path, off_t off, struct fuse_file_info *fi);
+#if FUSE_VERSION >= 29
+    void do_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *fi);
+    long do_write_buf(const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi);
+#endif
 
 #pragma clang diagnostic pop
 
+private:
+    FileNode::Node     lookup(const char *path);
+    ControlInterface * control(const char *path);
+
 private:
     static int fs_open(const char *path, struct fuse_file_info *fi);
     static int fs_read(const char *path, char *buf, size_t size, off_t off, struct fuse_file_info *fi);
@@ -58,11 +71,20 @@ private:
     static int fs_rename(const char *path, const char *dest);
     static int fs_getattr(const char *path, struct stat *stat);
     static int fs_utimens(const char *path, const struct timespec *tv);
+    static int fs_opendir(const char *path, struct fuse_file_info *fi);
     static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t fn, off_t off, struct fuse_file_info *fi);
+    static int fs_releasedir(const char *path, struct fuse_file_info *fi);
     static int fs_release(const char *path, struct fuse_file_info *fi);
     static int fs_truncate(const char *path, off_t off);
     static int fs_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *fi);
     static int fs_ftruncate(const char *path, off_t off, struct fuse_file_info *fi);
+#if FUSE_VERSION >= 29
+    static int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *fi);
+    static int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi);
+#endif
+
+private:
+    static void *fs_init(struct fuse_conn_info *conn);
 };
 
 #endif /* SANDBOX_FS_SANDBOX_FILE_SYSTEM_H */
@@ -0,0 +1,837 @@
+#include <vector>
+#include <sys/uio.h>
+#include <folly/logging/xlog.h>
+
+#include "op_stats.h"
+#include "dir_listing.h"
+#include "fuse_buffer.h"
+#include "opened_file.h"
+#include "fuse_session.h"
+#include "write_barrier.h"
+#include "sandbox_low_level_file_system.h"
+
+namespace {
+struct FuseLowLevelSession {
+    struct fuse_session * ss = nullptr;
+
+public:
+    ~FuseLowLevelSession() {
+        if (ss != nullptr) {
+            fuse_session_destroy(ss);
+        }
+    }
+
+public:
+    bool init(struct fuse_chan *ch, struct fuse_args *args, struct fuse_lowlevel_ops *ops, void *data) {
+        if ((ss = fuse_lowlevel_new(args, ops, sizeof(struct fuse_lowlevel_ops), data)) == nullptr) {
+            return false;
+        } else {
+            fuse_session_add_chan(ss, ch);
+            return true;
+        }
+    }
+};
+}
+
+SandboxLowLevelFileSystem::~SandboxLowLevelFileSystem() {
+    XLOG(INFO, "Shutting down ...");
+    _watches.clear();
+    _names.clear();
+    _inodes.clear();
+    _root.reset();
+}
+
+SandboxLowLevelFileSystem::SandboxLowLevelFileSystem(FileNode::Node root, ControlFiles ctrls, double ttl) :
+    _ttl    (ttl),
+    _ctrls  (std::move(ctrls)),
+    _chan   (nullptr),
+    _next   (FirstIno),
+    _splice (false)
+{
+    _root.swap(root);
+    _inodes.insert(FUSE_ROOT_ID, std::make_shared<Inode>(FUSE_ROOT_ID, Link { 0, &FileNode::epoch("/"), 0, "", _root }));
+
+    /* every control file gets a fixed inode, and there are only so many of them */
+    if (_ctrls.size() > CtrlMax) {
+        throw FuseError(E2BIG);
+    }
+
+    /* unmounted directories must be dropped from the kernel caches */
+    for (auto *v : _ctrls) {
+        _watches.emplace_back(v->watch([this](const std::string &alias) { unmount(alias); }));
+    }
+
+    /* caching policy */
+    if (_ttl <= 0.0) {
+        XLOG(INFO, "Sandbox initialized successfully (low-level API).");
+    } else {
+        XLOGF(INFO, "Sandbox initialized successfully (low-level API, cache timeout {:.1f}s).", _ttl);
+    }
+}
+
+void SandboxLowLevelFileSystem::start(const std::string &mount, const std::string &options) {
+    const char *opts[] = {
+        "sandbox_fs",
+        nullptr,
+        nullptr,
+    };
+
+    /* fuse arguments */
+    struct fuse_args args = {
+        .argc = 1,
+        .argv = const_cast<char **>(opts),
+    };
+
+    /* fuse low-level operations */
+    static struct fuse_lowlevel_ops ops = {
+        .init       = ll_init,
+        .lookup     = ll_lookup,
+        .forget     = ll_forget,
+        .getattr    = ll_getattr,
+        .setattr    = ll_setattr,
+        .mkdir      = ll_mkdir,
+        .unlink     = ll_unlink,
+        .rmdir      = ll_rmdir,
+        .rename     = ll_rename,
+        .open       = ll_open,
+        .read       = ll_read,
+        .write      = ll_write,
+        .release    = ll_release,
+        .opendir    = ll_opendir,
+        .readdir    = ll_readdir,
+        .releasedir = ll_releasedir,
+        .access     = ll_access,
+        .create     = ll_create,
+#if FUSE_VERSION >= 29
+        .write_buf  = ll_write_buf,
+#endif
+    };
+
+    /* add mount options if any */
+    if (!options.empty()) {
+        opts[1]   = "-o";
+        opts[2]   = options.c_str();
+        args.argc = 3;
+    }
+
+    /* initialise the VFS, the channel must be unmounted before the session is destroyed */
+    FuseLowLevelSession fs;
+    FuseSignals         ss;
+    FuseChannel         ch(mount.c_str(), &args);
+
+    /* start the FUSE file system */
+    if (!fs.init(ch.ch, &args, &ops, this) || !ss.init(fs.ss)) {
+        throw FuseError();
+    }
+
+    /* notifications are sent through the channel */
+    _chan = ch.ch;
+    auto ret = fuse_session_loop_mt(fs.ss);
+
+    /* the channel is about to be unmounted */
+    _chan = nullptr;
+    if (ret != 0) throw FuseError();
+}
+
+/** Inode Management **/
+
+SandboxLowLevelFileSystem::InodeRef SandboxLowLevelFileSystem::inode(fuse_ino_t ino) {
+    auto end  = _inodes.cend();
+    auto iter = _inodes.find(ino);
+
+    /* the kernel should never refer to inodes that were forgotten */
+    if (iter == end) {
+        throw FuseError(ESTALE);
+    } else {
+        return iter->second;
+    }
+}
+
+FileNode::Node SandboxLowLevelFileSystem::node(fuse_ino_t ino) {
+    int  err;
+    auto ref = inode(ino);
+
+    /* fast path, no frozen node was copied within the mount since the last time */
+    {
+        auto link = ref->link.rlock();
+        if (link->epoch == link->clock->load(std::memory_order_acquire)) return link->node;
+    }
+
+    /* nodes that were unlinked in the meantime keep referring to the old node */
+    std::string file;
+    try {
+        file = path(ino);
+    } catch (const FuseError &) {
+        auto link = ref->link.wlock();
+        link->epoch = link->clock->load(std::memory_order_acquire);
+        return link->node;
+    }
+
+    /* some ancestor may have been replaced by it's private copy, or the inode was moved to
+     * another mount, resolve again by path, after reading the epoch of the mount it's in now */
+    auto *clock = &FileNode::epoch(file);
+    auto  epoch = clock->load(std::memory_order_acquire);
+    auto  node  = FileNode::Node();
+    try { node = _root->find(file, &err); } catch (const FuseError &) {}
+
+    /* update the link */
+    auto link = ref->link.wlock();
+    if (node != nullptr) link->node = node;
+    link->clock = clock;
+    link->epoch = epoch;
+    return link->node;
+}
+
+std::string SandboxLowLevelFileSystem::path(fuse_ino_t ino) {
+    fuse_ino_t  parent;
+    std::string ret;
+
+    /* walk up the parent chain */
+    while (ino != FUSE_ROOT_ID) {
+        inode(ino)->link.withRLock([&](const Link &link) {
+            parent = link.parent;
+            ret.insert(0, link.name).insert(0, 1, '/');
+        });
+
+        /* the inode was unlinked */
+        if (parent == 0) {
+            throw FuseError(ENOENT);
+        } else {
+            ino = parent;
+        }
+    }
+
+    /* the root directory */
+    if (ret.empty()) {
+        return "/";
+    } else {
+        return ret;
+    }
+}
+
+std::string SandboxLowLevelFileSystem::path(fuse_ino_t parent, const char *name) {
+    if (parent == FUSE_ROOT_ID) {
+        return std::string("/") + name;
+    } else {
+        return path(parent) + "/" + name;
+    }
+}
+
+double SandboxLowLevelFileSystem::timeout(const FileNode::Node &node) {
+    if (node->frozen()) {
+        return _ttl;
+    } else {
+        return 0.0;
+    }
+}
+
+fuse_ino_t SandboxLowLevelFileSystem::control(fuse_ino_t parent, const char *name) {
+    if (parent != FUSE_ROOT_ID) {
+        return 0;
+    }
+
+    /* control files only live in the root directory */
+    for (size_t i = 0; i < _ctrls.size(); i++) {
+        if (strcmp(name, _ctrls[i]->name()) == 0) {
+            return CtrlIno + i;
+        }
+    }
+
+    /* not a control file */
+    return 0;
+}
+
+ControlInterface *SandboxLowLevelFileSystem::control(fuse_ino_t ino) {
+    if (ino < CtrlIno || ino >= CtrlIno + _ctrls.size()) {
+        return nullptr;
+    } else {
+        return _ctrls[ino - CtrlIno];
+    }
+}
+
+FileNode::Node SandboxLowLevelFileSystem::entry(fuse_ino_t parent, const char *name, struct fuse_entry_param *ep) {
+    int            err;
+    InodeRef       ref;
+    FileNode::Node node;
+
+    /* names live in the same mount as their parent, except for the mount points themselves */
+    auto inval = FileNode::Node();
+    auto clock = parent == FUSE_ROOT_ID ? &FileNode::epoch(name) : inode(parent)->link.rlock()->clock;
+
+    /* read the epoch before resolving, so that copies made in between are picked up later */
+    auto epoch = clock->load(std::memory_order_acquire);
+    auto dir   = this->node(parent);
+
+    /* the parent was just moved to another mount, make the next access resolve again */
+    if (parent != FUSE_ROOT_ID) {
+        if (auto next = inode(parent)->link.rlock()->clock; next != clock) {
+            clock = next;
+            epoch = clock->load(std::memory_order_acquire) - 1;
+        }
+    }
+
+    /* resolve the name within the parent directory */
+    if ((node = dir->find(name, &err)) == nullptr) {
+        throw FuseError(err);
+    }
+
+    /* find or allocate the inode, guarded against concurrent renames and forgets */
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        auto end  = _names.cend();
+        auto iter = _names.find(key(parent, name));
+
+        /* create a new inode if the name is not known yet */
+        if (iter == end) {
+            ref = std::make_shared<Inode>(_next++, Link { parent, clock, epoch, name, node });
+            _inodes.insert(ref->ino, ref);
+            _names.insert(key(parent, name), ref->ino);
+        } else {
+            ref = inode(iter->second);
+
+            /* the replaced node is released after the lock is dropped */
+            ref->link.withWLock([&](Link &link) { inval.swap(link.node); link.node = node; link.clock = clock; link.epoch = epoch; });
+        }
+
+        /* every successful lookup must be balanced by a forget */
+        ref->refs++;
+    }
+
+    /* fill the entry, only frozen nodes can be cached by the kernel */
+    ep->ino           = ref->ino;
+    ep->attr          = node->stat();
+    ep->attr.st_ino   = ref->ino;
+    ep->generation    = 0;
+    ep->attr_timeout  = timeout(node);
+    ep->entry_timeout = timeout(node);
+    return node;
+}
+
+void SandboxLowLevelFileSystem::move(fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    std::lock_guard<std::mutex> _(_mutex);
+    auto src  = key(parent, name);
+    auto dst  = key(newparent, newname);
+    auto end  = _names.cend();
+    auto iter = _names.find(src);
+    auto prev = _names.find(dst);
+
+    /* the destination, if any, was replaced */
+    if (prev != end) {
+        inode(prev->second)->link.wlock()->parent = 0;
+        _names.erase(dst);
+    }
+
+    /* re-key the source inode */
+    if (iter != end) {
+        auto ino = iter->second;
+        auto ref = inode(ino);
+
+        /* move the name mapping */
+        _names.erase(src);
+        _names.insert(dst, ino);
+
+        /* update the link as well */
+        ref->link.withWLock([&](Link &link) {
+            link.name   = newname;
+            link.parent = newparent;
+        });
+    }
+}
+
+void SandboxLowLevelFileSystem::detach(fuse_ino_t parent, const char *name) {
+    std::lock_guard<std::mutex> _(_mutex);
+    auto src  = key(parent, name);
+    auto end  = _names.cend();
+    auto iter = _names.find(src);
+
+    /* the inode stays alive until the kernel forgets it, but can no longer be found by name */
+    if (iter != end) {
+        inode(iter->second)->link.wlock()->parent = 0;
+        _names.erase(src);
+    }
+}
+
+void SandboxLowLevelFileSystem::expire(fuse_ino_t ino) {
+    if (_ttl > 0.0 && _chan != nullptr) {
+        fuse_lowlevel_notify_inval_inode(_chan, ino, -1, 0);
+    }
+}
+
+void SandboxLowLevelFileSystem::unmount(const std::string &alias) {
+    detach(FUSE_ROOT_ID, alias.c_str());
+
+    /* the mount point could have been cached for a long time */
+    if (_ttl > 0.0 && _chan != nullptr) {
+        fuse_lowlevel_notify_inval_entry(_chan, FUSE_ROOT_ID, alias.c_str(), alias.size());
+    }
+}
+
+std::string SandboxLowLevelFileSystem::key(fuse_ino_t parent, const char *name) {
+    return std::to_string(parent) + "/" + name;
+}
+
+/** File-System Event Handlers **/
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+
+namespace {
+inline SandboxFile *file(struct fuse_file_info *fi) {
+    if (fi->fh == 0) {
+        throw FuseError(EINVAL);
+    } else {
+        return reinterpret_cast<SandboxFile *>(fi->fh);
+    }
+}
+
+inline DirListing *listing(struct fuse_file_info *fi) {
+    if (fi->fh == 0) {
+        throw FuseError(EINVAL);
+    } else {
+        return reinterpret_cast<DirListing *>(fi->fh);
+    }
+}
+
+#if FUSE_VERSION >= 29
+inline void replyBuffer(fuse_req_t req, const std::vector<FuseBuffer> &vec) {
+    static thread_local std::vector<char> mem;
+    mem.resize(sizeof(struct fuse_bufvec) + vec.size() * sizeof(struct fuse_buf));
+
+    /* the buffer vector is variable sized */
+    auto bufv   = reinterpret_cast<struct fuse_bufvec *>(mem.data());
+    bufv->idx   = 0;
+    bufv->off   = 0;
+    bufv->count = vec.size();
+
+    /* fill every buffer */
+    for (size_t i = 0; i < vec.size(); i++) {
+        bufv->buf[i] = vec[i].buf();
+    }
+
+    /* pages in the page cache are shared, so they are spliced without moving */
+    fuse_reply_data(req, bufv, static_cast<enum fuse_buf_copy_flags>(0));
+}
+#endif
+}
+
+void SandboxLowLevelFileSystem::do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param ep = {};
+
+    /* control files are not part of the tree, and never forgotten */
+    if (auto ino = control(parent, name)) {
+        ep.ino         = ino;
+        ep.attr        = control(ino)->stat();
+        ep.attr.st_ino = ino;
+    } else {
+        entry(parent, name, &ep);
+    }
+
+    /* reply the entry */
+    fuse_reply_entry(req, &ep);
+}
+
+void SandboxLowLevelFileSystem::do_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    if (ino != FUSE_ROOT_ID && control(ino) == nullptr) {
+        std::lock_guard<std::mutex> _(_mutex);
+        auto end  = _inodes.cend();
+        auto iter = _inodes.find(ino);
+
+        /* drop the inode when the last reference goes away */
+        if (iter != end && iter->second->refs.fetch_sub(nlookup) == nlookup) {
+            auto ref  = iter->second;
+            auto link = ref->link.rlock();
+
+            /* the name mapping only exists if the inode is still linked */
+            if (link->parent != 0) {
+                _names.erase(key(link->parent, link->name.c_str()));
+            }
+
+            /* remove the inode */
+            _inodes.erase(ino);
+        }
+    }
+
+    /* forget never fails */
+    fuse_reply_none(req);
+}
+
+void SandboxLowLevelFileSystem::do_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    double      ttl = 0.0;
+    struct stat st;
+
+    /* opened files have their own view */
+    if (auto *ctl = control(ino)) {
+        st = ctl->stat();
+    } else if (fi != nullptr && fi->fh != 0) {
+        file(fi)->getstat(&st);
+    } else {
+        auto node = this->node(ino);
+        st  = node->stat();
+        ttl = timeout(node);
+    }
+
+    /* reply the attributes */
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, ttl);
+}
+
+void SandboxLowLevelFileSystem::do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct stat st;
+
+    /* control files can not be modified */
+    if (control(ino) != nullptr) {
+        throw FuseError(EPERM);
+    }
+
+    /* ownership and permissions are not supported */
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        throw FuseError(ENOSYS);
+    }
+
+    /* truncate through the file handle if possible */
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (fi != nullptr && fi->fh != 0) {
+            file(fi)->resize(attr->st_size);
+        } else {
+            auto         file = path(ino);
+            WriteBarrier _(file);
+            _root->get(file, false, true)->resize(attr->st_size);
+        }
+    }
+
+    /* update timestamps */
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        FileNode::Time tv[2] = {
+            { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+            { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+        };
+
+        /* select the timestamps to set */
+        if (to_set & FUSE_SET_ATTR_ATIME) tv[0] = attr->st_atimespec;
+        if (to_set & FUSE_SET_ATTR_MTIME) tv[1] = attr->st_mtimespec;
+
+        /* update the node */
+        auto         file = path(ino);
+        WriteBarrier _(file);
+        _root->get(file, false, true)->utimens(tv[0], tv[1]);
+    }
+
+    /* reply the new attributes, the node is a private copy by now and is never cached */
+    st        = node(ino)->stat();
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, 0.0);
+}
+
+void SandboxLowLevelFileSystem::do_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse_entry_param ep = {};
+
+    /* cannot shadow the control file */
+    if (control(parent, name)) {
+        throw FuseError(EEXIST);
+    }
+
+    /* create the directory */
+    {
+        auto         file = path(parent, name);
+        WriteBarrier _(file);
+        _root->mkdir(file);
+    }
+
+    /* reply the new entry */
+    entry(parent, name, &ep);
+    fuse_reply_entry(req, &ep);
+}
+
+void SandboxLowLevelFileSystem::do_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (control(parent, name)) {
+        throw FuseError(EPERM);
+    }
+
+    /* remove the file */
+    {
+        auto         file = path(parent, name);
+        WriteBarrier _(file);
+        _root->unlink(file);
+    }
+
+    /* the inode can no longer be found by name */
+    detach(parent, name);
+    fuse_reply_err(req, 0);
+}
+
+void SandboxLowLevelFileSystem::do_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (control(parent, name)) {
+        throw FuseError(ENOTDIR);
+    }
+
+    /* remove the directory */
+    {
+        auto         file = path(parent, name);
+        WriteBarrier _(file);
+        _root->rmdir(file);
+    }
+
+    /* the inode can no longer be found by name */
+    detach(parent, name);
+    fuse_reply_err(req, 0);
+}
+
+void SandboxLowLevelFileSystem::do_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    if (control(parent, name) || control(newparent, newname)) {
+        throw FuseError(EPERM);
+    }
+
+    /* move the node, then the inode */
+    {
+        auto         src = path(parent, name);
+        auto         dst = path(newparent, newname);
+        WriteBarrier _(src, dst);
+        _root->rename(src, dst);
+    }
+
+    /* re-key the inode */
+    move(parent, name, newparent, newname);
+    fuse_reply_err(req, 0);
+}
+
+void SandboxLowLevelFileSystem::do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    SandboxFile *  fp;
+    FileNode::Node node;
+    bool           copied = false;
+
+    /* read-only opens are a direct node dereference, frozen contents never change,
+     * so their pages can be kept across opens */
+    if (auto *ctl = control(ino)) {
+        fp             = ctl->open(fi->flags);
+        fi->direct_io  = true;
+        fi->keep_cache = false;
+    } else if (!isWritable(fi->flags)) {
+        fp             = new ReadOnlyFile(fi->flags, node = this->node(ino));
+        fi->direct_io  = false;
+        fi->keep_cache = _ttl > 0.0 && node->frozen();
+    } else {
+        auto         file = path(ino);
+        WriteBarrier _(file);
+        copied         = this->node(ino)->frozen();
+        fp             = new OpenedFile(fi->flags, _root->get(file, false, true), file);
+        fi->direct_io  = false;
+        fi->keep_cache = false;
+    }
+
+    /* the request might have been interrupted */
+    fi->fh = reinterpret_cast<uint64_t>(fp);
+    if (fuse_reply_open(req, fi) != 0) {
+        delete fp;
+        return;
+    }
+
+    /* the node was replaced by a private copy, which must not be served from cached attributes */
+    if (copied) {
+        expire(ino);
+    }
+}
+
+void SandboxLowLevelFileSystem::do_read(fuse_req_t req, fuse_ino_t, size_t size, off_t off, struct fuse_file_info *fi) {
+    static thread_local std::vector<struct iovec> iov;
+    static thread_local std::vector<FuseBuffer>   vec;
+    ByteBuffer::Pinned pins;
+    bool               fds = false;
+    auto               fp  = file(fi);
+
+    /* files that can not be pinned are copied */
+    if (!fp->pin(size, off, &pins)) {
+        auto buf = std::unique_ptr<char[]>(new char[size]);
+        auto ret = fp->read(buf.get(), size, off);
+        OpStats::transferred(ret);
+        fuse_reply_buf(req, buf.get(), ret);
+        return;
+    }
+
+    /* point at the pages in place, the pins keep them alive and unmodified until replied */
+    iov.clear();
+    vec.clear();
+    pins.scatter([&](const char *mem, size_t len, int fd, off_t pos) {
+        fds |= fd >= 0;
+        OpStats::transferred(len);
+        vec.emplace_back(mem, len, fd, pos);
+        iov.push_back(iovec { .iov_base = const_cast<char *>(mem), .iov_len = len });
+    });
+
+    /* pages backed by a memfd are spliced from the descriptor, the kernel copies directly from the others */
+#if FUSE_VERSION >= 29
+    if (fds && _splice) {
+        replyBuffer(req, vec);
+    } else {
+        fuse_reply_iov(req, iov.data(), static_cast<int>(iov.size()));
+    }
+#else
+    fuse_reply_iov(req, iov.data(), static_cast<int>(iov.size()));
+#endif
+
+    /* the reply has been sent, nothing may point at the pages any more once they are released */
+    iov.clear();
+    vec.clear();
+    pins.release();
+}
+
+void SandboxLowLevelFileSystem::do_write(fuse_req_t req, fuse_ino_t, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    auto ret = file(fi)->write(buf, size, off);
+    OpStats::transferred(ret);
+    fuse_reply_write(req, ret);
+}
+
+#if FUSE_VERSION >= 29
+
+void SandboxLowLevelFileSystem::do_write_buf(fuse_req_t req, fuse_ino_t, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    auto ret = writeBuffer(file(fi), bufv, off);
+    OpStats::transferred(ret);
+    fuse_reply_write(req, ret);
+}
+
+#endif
+
+void SandboxLowLevelFileSystem::do_release(fuse_req_t req, fuse_ino_t, struct fuse_file_info *fi) {
+    delete file(fi);
+    fuse_reply_err(req, 0);
+}
+
+void SandboxLowLevelFileSystem::do_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (control(ino) != nullptr) {
+        throw FuseError(ENOTDIR);
+    }
+
+    /* the listing is taken on the first read, and kept until the directory is closed */
+    auto dir = node(ino);
+    auto ctl = ino == FUSE_ROOT_ID ? _ctrls : ControlFiles();
+    auto up  = ino == FUSE_ROOT_ID ? 0 : inode(ino)->link.rlock()->parent;
+
+    /* check for directory */
+    if (!S_ISDIR(dir->stat().st_mode)) {
+        throw FuseError(ENOTDIR);
+    }
+
+    /* the super directory of the root is the root itself, the listing falls back to it if the parent is gone */
+    FileNode::Node par;
+    try { par = ino == FUSE_ROOT_ID ? _root : up == 0 ? nullptr : node(up); } catch (const FuseError &) {}
+
+    /* the request might have been interrupted */
+    fi->fh = reinterpret_cast<uint64_t>(new DirListing(dir, par, std::move(ctl)));
+    if (fuse_reply_open(req, fi) != 0) delete listing(fi);
+}
+
+void SandboxLowLevelFileSystem::do_readdir(fuse_req_t req, fuse_ino_t, size_t size, off_t off, struct fuse_file_info *fi) {
+    size_t            pos = 0;
+    std::vector<char> buf(size);
+
+    /* add entries until the buffer is full, the kernel comes back with the offset of the next one */
+    listing(fi)->list(off, [&](const char *name, const struct stat &st, off_t next) {
+        auto len = fuse_add_direntry(req, buf.data() + pos, size - pos, name, &st, next);
+
+        /* check for buffer space */
+        if (len > size - pos) {
+            return false;
+        } else {
+            pos += len;
+            return true;
+        }
+    });
+
+    /* reply the entries */
+    fuse_reply_buf(req, buf.data(), pos);
+}
+
+void SandboxLowLevelFileSystem::do_releasedir(fuse_req_t req, fuse_ino_t, struct fuse_file_info *fi) {
+    delete listing(fi);
+    fuse_reply_err(req, 0);
+}
+
+void SandboxLowLevelFileSystem::do_access(fuse_req_t req, fuse_ino_t ino, int) {
+    if (control(ino) == nullptr) {
+        node(ino)->access();
+    }
+
+    /* the node is accessible */
+    fuse_reply_err(req, 0);
+}
+
+void SandboxLowLevelFileSystem::do_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t, struct fuse_file_info *fi) {
+    struct fuse_entry_param ep = {};
+
+    /* control files always exist */
+    if (control(parent, name)) {
+        throw FuseError(EEXIST);
+    }
+
+    /* create the node and the inode */
+    auto file = path(parent, name);
+    {
+        WriteBarrier _(file);
+        _root->get(file, true, true);
+    }
+
+    /* the handle holds the barrier of the mount it was created in */
+    auto fp = new OpenedFile(fi->flags, entry(parent, name, &ep), file);
+
+    /* the request might have been interrupted */
+    fi->fh        = reinterpret_cast<uint64_t>(fp);
+    fi->direct_io = false;
+    if (fuse_reply_create(req, &ep, fi) != 0) delete fp;
+}
+
+/** File-System Proxy Stubs **/
+
+void SandboxLowLevelFileSystem::ll_init(void *data, struct fuse_conn_info *conn) {
+    auto self = static_cast<SandboxLowLevelFileSystem *>(data);
+
+#if FUSE_VERSION >= 29
+    /* replies can be spliced from the memfd pools, this does not affect other replies */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want   |= FUSE_CAP_SPLICE_WRITE;
+        self->_splice = true;
+    }
+#endif
+}
+
+#define LL_V(name, formal, actual)                                                      \
+    void SandboxLowLevelFileSystem::ll_ ## name formal {                                \
+        static auto &op = OpStats::fuse().get(#name);                                   \
+        OpStats::Timer t(op);                                                           \
+        try {                                                                           \
+            ((SandboxLowLevelFileSystem *)fuse_req_userdata(req))->do_ ## name actual;  \
+        } catch (const FuseError &e) {                                                  \
+            t.fail();                                                                   \
+            fuse_reply_err(req, e.code());                                              \
+        }                                                                               \
+    }
+
+#define REQ  fuse_req_t req
+#define INO  fuse_ino_t ino
+#define INFO struct fuse_file_info *fi
+
+LL_V(lookup     , (REQ, fuse_ino_t parent, const char *name)                                       , (req, parent, name))
+LL_V(forget     , (REQ, INO, unsigned long nlookup)                                                , (req, ino, nlookup))
+LL_V(getattr    , (REQ, INO, INFO)                                                                 , (req, ino, fi))
+LL_V(setattr    , (REQ, INO, struct stat *attr, int to_set, INFO)                                  , (req, ino, attr, to_set, fi))
+LL_V(mkdir      , (REQ, fuse_ino_t parent, const char *name, mode_t mode)                          , (req, parent, name, mode))
+LL_V(unlink     , (REQ, fuse_ino_t parent, const char *name)                                       , (req, parent, name))
+LL_V(rmdir      , (REQ, fuse_ino_t parent, const char *name)                                       , (req, parent, name))
+LL_V(rename     , (REQ, fuse_ino_t parent, const char *name, fuse_ino_t dir, const char *dest)     , (req, parent, name, dir, dest))
+LL_V(open       , (REQ, INO, INFO)                                                                 , (req, ino, fi))
+LL_V(read       , (REQ, INO, size_t size, off_t off, INFO)                                         , (req, ino, size, off, fi))
+LL_V(write      , (REQ, INO, const char *buf, size_t size, off_t off, INFO)                        , (req, ino, buf, size, off, fi))
+#if FUSE_VERSION >= 29
+LL_V(write_buf  , (REQ, INO, struct fuse_bufvec *bufv, off_t off, INFO)                            , (req, ino, bufv, off, fi))
+#endif
+LL_V(release    , (REQ, INO, INFO)                                                                 , (req, ino, fi))
+LL_V(opendir    , (REQ, INO, INFO)                                                                 , (req, ino, fi))
+LL_V(readdir    , (REQ, INO, size_t size, off_t off, INFO)                                         , (req, ino, size, off, fi))
+LL_V(releasedir , (REQ, INO, INFO)                                                                 , (req, ino, fi))
+LL_V(access     , (REQ, INO, int mask)                                                             , (req, ino, mask))
+LL_V(create     , (REQ, fuse_ino_t parent, const char *name, mode_t mode, INFO)                    , (req, parent, name, mode, fi))
+
+#undef LL_V
+#undef REQ
+#undef INO
+#undef INFO
+
+#pragma clang diagnostic pop
@@ -0,0 +1,146 @@
+#ifndef SANDBOX_FS_SANDBOX_LOW_LEVEL_FILE_SYSTEM_H
+#define SANDBOX_FS_SANDBOX_LOW_LEVEL_FILE_SYSTEM_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <fuse_lowlevel.h>
+#include <folly/Synchronized.h>
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+#include "file_node.h"
+#include "fuse_error.h"
+#include "sandbox_file.h"
+#include "control_interface.h"
+
+class SandboxLowLevelFileSystem {
+    struct Link {
+        fuse_ino_t                   parent;
+        const std::atomic_uint64_t * clock;
+        uint64_t                     epoch;
+        std::string                  name;
+        FileNode::Node               node;
+    };
+
+private:
+    struct Inode {
+        fuse_ino_t                ino;
+        std::atomic_uint64_t      refs;
+        folly::Synchronized<Link> link;
+
+    public:
+        Inode(fuse_ino_t ino, Link &&link) : ino(ino), refs(0), link(std::move(link)) {}
+    };
+
+private:
+    typedef std::shared_ptr<Inode>                            InodeRef;
+    typedef folly::ConcurrentHashMap<fuse_ino_t, InodeRef>    InodeMap;
+    typedef folly::ConcurrentHashMap<std::string, fuse_ino_t> NameMap;
+
+private:
+    static constexpr fuse_ino_t CtrlIno  = FUSE_ROOT_ID + 1;
+    static constexpr fuse_ino_t CtrlMax  = 16;
+    static constexpr fuse_ino_t FirstIno = CtrlIno + CtrlMax;
+
+private:
+    double                  _ttl;
+    FileNode::Node          _root;
+    ControlFiles            _ctrls;
+    struct fuse_chan *      _chan;
+
+private:
+    std::vector<ControlInterface::Watch> _watches;
+
+private:
+    NameMap                 _names;
+    InodeMap                _inodes;
+    std::mutex              _mutex;
+    std::atomic<fuse_ino_t> _next;
+    std::atomic_bool        _splice;
+
+public:
+   ~SandboxLowLevelFileSystem();
+    SandboxLowLevelFileSystem(FileNode::Node root, ControlFiles ctrls, double ttl = 0.0);
+
+public:
+    void start(const std::string &mount, const std::string &options = "");
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+
+private:
+    void do_lookup     (fuse_req_t req, fuse_ino_t parent, const char *name);
+    void do_forget     (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+    void do_getattr    (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void do_setattr    (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+    void do_mkdir      (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+    void do_unlink     (fuse_req_t req, fuse_ino_t parent, const char *name);
+    void do_rmdir      (fuse_req_t req, fuse_ino_t parent, const char *name);
+    void do_rename     (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+    void do_open       (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void do_read       (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    void do_write      (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+    void do_release    (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+#if FUSE_VERSION >= 29
+    void do_write_buf  (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
+#endif
+    void do_opendir    (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void do_readdir    (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    void do_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void do_access     (fuse_req_t req, fuse_ino_t ino, int mask);
+    void do_create     (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+
+#pragma clang diagnostic pop
+
+private:
+    InodeRef       inode(fuse_ino_t ino);
+    FileNode::Node node(fuse_ino_t ino);
+    std::string    path(fuse_ino_t ino);
+    std::string    path(fuse_ino_t parent, const char *name);
+
+private:
+    double             timeout(const FileNode::Node &node);
+    fuse_ino_t         control(fuse_ino_t parent, const char *name);
+    ControlInterface * control(fuse_ino_t ino);
+    FileNode::Node     entry(fuse_ino_t parent, const char *name, struct fuse_entry_param *ep);
+
+private:
+    void move(fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+    void detach(fuse_ino_t parent, const char *name);
+
+private:
+    void expire(fuse_ino_t ino);
+    void unmount(const std::string &alias);
+
+private:
+    static std::string key(fuse_ino_t parent, const char *name);
+
+private:
+    static void ll_init       (void *data, struct fuse_conn_info *conn);
+
+private:
+    static void ll_lookup     (fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void ll_forget     (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+    static void ll_getattr    (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    static void ll_setattr    (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+    static void ll_mkdir      (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+    static void ll_unlink     (fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void ll_rmdir      (fuse_req_t req, fuse_ino_t parent, const char *name);
+    static void ll_rename     (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+    static void ll_open       (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    static void ll_read       (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    static void ll_write      (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+    static void ll_release    (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+#if FUSE_VERSION >= 29
+    static void ll_write_buf  (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
+#endif
+    static void ll_opendir    (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    static void ll_readdir    (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    static void ll_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    static void ll_access     (fuse_req_t req, fuse_ino_t ino, int mask);
+    static void ll_create     (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+};
+
+#endif /* SANDBOX_FS_SANDBOX_LOW_LEVEL_FILE_SYSTEM_H */
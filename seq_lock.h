@@ -0,0 +1,104 @@
+#ifndef SANDBOX_FS_SEQ_LOCK_H
+#define SANDBOX_FS_SEQ_LOCK_H
+
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/* a value published through a sequence counter, readers never lock and retry if a writer
+ * got in the way, the value is kept in atomic words, so a torn copy is never undefined */
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock values must be trivially copyable");
+
+private:
+    static constexpr size_t Words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+private:
+    std::mutex           _mutex;
+    std::atomic_uint64_t _seq;
+    std::atomic_uint64_t _data[Words];
+
+public:
+    explicit SeqLock(const T &val = T()) : _seq(0) { write(val); }
+
+public:
+    SeqLock(SeqLock &&)      = delete;
+    SeqLock(const SeqLock &) = delete;
+
+public:
+    SeqLock &operator=(SeqLock &&)      = delete;
+    SeqLock &operator=(const SeqLock &) = delete;
+
+public:
+    [[nodiscard]] T load() const noexcept {
+        T        ret;
+        uint64_t seq;
+
+        /* copy the value, and retry if a writer was in progress (odd sequence
+         * numbers), or touched it in the meantime */
+        do {
+            seq = _seq.load(std::memory_order_acquire);
+            ret = read();
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((seq & 1) != 0 || _seq.load(std::memory_order_relaxed) != seq);
+
+        /* all done */
+        return ret;
+    }
+
+public:
+    void store(const T &val) noexcept {
+        std::lock_guard<std::mutex> _(_mutex);
+        publish(val);
+    }
+
+public:
+    template <typename F>
+    void update(F &&fn) {
+        std::lock_guard<std::mutex> _(_mutex);
+        T val = read();
+
+        /* writers are serialized, the value is stable while the lock is held */
+        fn(val);
+        publish(val);
+    }
+
+private:
+    [[nodiscard]] T read() const noexcept {
+        T        ret;
+        uint64_t buf[Words];
+
+        /* load word by word */
+        for (size_t i = 0; i < Words; i++) {
+            buf[i] = _data[i].load(std::memory_order_relaxed);
+        }
+
+        /* convert back to the value */
+        memcpy(&ret, buf, sizeof(T));
+        return ret;
+    }
+
+private:
+    void write(const T &val) noexcept {
+        uint64_t buf[Words] = {};
+        memcpy(buf, &val, sizeof(T));
+
+        /* store word by word */
+        for (size_t i = 0; i < Words; i++) {
+            _data[i].store(buf[i], std::memory_order_relaxed);
+        }
+    }
+
+private:
+    void publish(const T &val) noexcept {
+        _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        write(val);
+        _seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+#endif /* SANDBOX_FS_SEQ_LOCK_H */
@@ -0,0 +1,111 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <folly/logging/xlog.h>
+
+#include "fuse_error.h"
+#include "spill_file.h"
+
+static constexpr size_t Alignment = 4096;
+
+SpillFile::~SpillFile() {
+    _chunk.reset();
+    close(_fd);
+}
+
+SpillFile::SpillFile(const std::string &dir, size_t limit) : _fd(-1), _end(0), _limit(limit), _size(0) {
+    std::string name = dir + "/sandbox_fs.spill.XXXXXX";
+
+    /* the file is only reachable through the descriptor */
+    if ((_fd = mkstemp(name.data())) < 0) {
+        throw FuseError();
+    } else {
+        unlink(name.c_str());
+        fcntl(_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    /* all done */
+    XLOGF(INFO, "Spilling cold file data to '{:s}'.", dir);
+}
+
+ByteBuffer::Extent SpillFile::store(const char *mem, size_t len) {
+    std::shared_ptr<Chunk>      old;
+    std::lock_guard<std::mutex> _(_mutex);
+    size_t                      pos = _chunk == nullptr ? ChunkSize : (_chunk->used + Alignment - 1) & ~(Alignment - 1);
+
+    /* start a new chunk if this one is full, the old one might be released
+     * right away, which must happen after unlocking */
+    if (pos + len > ChunkSize) {
+        pos = 0;
+        old.swap(_chunk);
+        _chunk = allocate();
+    }
+
+    /* write the data, and read it back through the mapping on demand */
+    for (size_t off = 0; off < len;) {
+        auto ret = pwrite(_fd, mem + off, len - off, _chunk->off + pos + off);
+
+        /* check for errors */
+        if (ret < 0) {
+            throw FuseError();
+        } else {
+            off += ret;
+        }
+    }
+
+    /* every page keeps the chunk mapped */
+    _chunk->used = pos + len;
+    return ByteBuffer::Extent { _chunk->mem + pos, _fd, static_cast<off_t>(_chunk->off + pos), _chunk };
+}
+
+std::shared_ptr<SpillFile::Chunk> SpillFile::allocate() {
+    void *mem;
+    off_t off;
+
+    /* check for the size limit */
+    if (_limit != 0 && _size + ChunkSize > _limit) {
+        throw FuseError(ENOSPC, "spill file is full");
+    }
+
+    /* reuse released chunks first */
+    if (!_free.empty()) {
+        off = _free.back();
+        _free.pop_back();
+    } else if (ftruncate(_fd, _end + ChunkSize) == 0) {
+        off   = _end;
+        _end += ChunkSize;
+    } else {
+        throw FuseError();
+    }
+
+    /* map the whole chunk, pages are written with pwrite() only */
+    if ((mem = mmap(nullptr, ChunkSize, PROT_READ, MAP_SHARED, _fd, off)) == MAP_FAILED) {
+        _free.push_back(off);
+        throw FuseError();
+    }
+
+    /* the chunk is released when the last page referring to it is gone */
+    _size += ChunkSize;
+    return std::shared_ptr<Chunk>(new Chunk { off, 0, static_cast<const char *>(mem) }, [this](Chunk *p) { release(p); });
+}
+
+void SpillFile::release(Chunk *chunk) {
+    munmap(const_cast<char *>(chunk->mem), ChunkSize);
+
+#if defined(__linux__)
+    /* give the disk space back */
+    fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, chunk->off, ChunkSize);
+#elif defined(F_PUNCHHOLE)
+    /* same on APFS, the offset and length are multiples of the block size */
+    struct fpunchhole ph = {};
+    ph.fp_offset = chunk->off;
+    ph.fp_length = ChunkSize;
+    fcntl(_fd, F_PUNCHHOLE, &ph);
+#endif
+
+    /* the chunk can be reused */
+    std::lock_guard<std::mutex> _(_mutex);
+    _size -= ChunkSize;
+    _free.push_back(chunk->off);
+    delete chunk;
+}
@@ -0,0 +1,54 @@
+#ifndef SANDBOX_FS_SPILL_FILE_H
+#define SANDBOX_FS_SPILL_FILE_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "byte_buffer.h"
+
+class SpillFile {
+    struct Chunk {
+        off_t        off;
+        size_t       used;
+        const char * mem;
+    };
+
+private:
+    static constexpr size_t ChunkSize = 64ul << 20;
+
+private:
+    int                    _fd;
+    off_t                  _end;
+    size_t                 _limit;
+    std::mutex             _mutex;
+    std::atomic_size_t     _size;
+    std::vector<off_t>     _free;
+    std::shared_ptr<Chunk> _chunk;
+
+public:
+   ~SpillFile();
+    SpillFile(const std::string &dir, size_t limit);
+
+public:
+    SpillFile(SpillFile &&)      = delete;
+    SpillFile(const SpillFile &) = delete;
+
+public:
+    SpillFile &operator=(SpillFile &&)      = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+public:
+    [[nodiscard]] size_t size() const { return _size; }
+
+public:
+    ByteBuffer::Extent store(const char *mem, size_t len);
+
+private:
+    std::shared_ptr<Chunk> allocate();
+    void                   release(Chunk *chunk);
+};
+
+#endif /* SANDBOX_FS_SPILL_FILE_H */
@@ -0,0 +1,27 @@
+#include <cstring>
+#include <algorithm>
+
+#include "op_stats.h"
+#include "stats_file.h"
+#include "sandbox_controller.h"
+
+StatsFile::StatsFile(int flags) : ControlInterfaceAdapter(flags) {
+    OpStats::fuse().dump(&_text);
+    OpStats::commands().dump(&_text);
+    SandboxController::metrics(&_text);
+}
+
+ssize_t StatsFile::do_read(char *buf, size_t len, size_t off) {
+    if (off >= _text.size()) {
+        return 0;
+    }
+
+    /* copy from the snapshot */
+    len = std::min(len, _text.size() - off);
+    memcpy(buf, _text.data() + off, len);
+    return static_cast<ssize_t>(len);
+}
+
+ssize_t StatsFile::do_write(const char *, size_t, size_t) {
+    throw FuseError(EPERM);
+}
@@ -0,0 +1,28 @@
+#ifndef SANDBOX_FS_STATS_FILE_H
+#define SANDBOX_FS_STATS_FILE_H
+
+#include <string>
+
+#include "file_node.h"
+#include "control_interface.h"
+
+static constexpr mode_t     StatsMode   = S_IFREG | 0444;
+static constexpr const char StatsName[] = "_fsstat";
+
+/* a read-only view of the operation counters and the per-token statistics in the Prometheus text format, the
+ * text is taken once when opened, so that a scraper reading it in pieces always gets a consistent copy */
+class StatsFile : public ControlInterfaceAdapter<StatsFile, StatsName, StatsMode> {
+    std::string _text;
+
+public:
+    explicit StatsFile(int flags);
+
+public:
+    ssize_t do_read(char *buf, size_t len, size_t off) override;
+    ssize_t do_write(const char *buf, size_t len, size_t off) override;
+
+public:
+    static ControlInterface::Watch watch(ControlInterface::Watcher &&) { return nullptr; }
+};
+
+#endif /* SANDBOX_FS_STATS_FILE_H */
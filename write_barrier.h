@@ -0,0 +1,71 @@
+#ifndef SANDBOX_FS_WRITE_BARRIER_H
+#define SANDBOX_FS_WRITE_BARRIER_H
+
+#include <utility>
+#include <functional>
+#include <string_view>
+#include <folly/SharedMutex.h>
+
+/* checkpoints need a consistency point, so every change to a mount holds the barrier of that mount
+ * shared, while checkpoints hold it exclusively for as long as it takes to collect the changes,
+ * barriers are striped by the mount name, so mounts never need to register or unregister them */
+class WriteBarrier {
+    static constexpr size_t Stripes = 64;
+
+private:
+    struct alignas(64) Stripe {
+        folly::SharedMutex lock;
+    };
+
+private:
+    size_t               _n;
+    folly::SharedMutex * _locks[2];
+
+public:
+   ~WriteBarrier() {
+        for (size_t i = 0; i < _n; i++) {
+            _locks[i]->unlock_shared();
+        }
+    }
+
+public:
+    explicit WriteBarrier(std::string_view path) : WriteBarrier(path, path) {}
+    explicit WriteBarrier(std::string_view path, std::string_view dest) : _n(0), _locks() {
+        auto *p = &of(path);
+        auto *q = &of(dest);
+
+        /* lock in address order, paths within the same stripe only lock it once,
+         * so that a checkpoint waiting on one of them never causes a deadlock */
+        if (p > q) std::swap(p, q);
+        _locks[_n++] = p;
+        if (p != q) _locks[_n++] = q;
+
+        /* acquire the locks */
+        for (size_t i = 0; i < _n; i++) {
+            _locks[i]->lock_shared();
+        }
+    }
+
+public:
+    WriteBarrier(WriteBarrier &&)      = delete;
+    WriteBarrier(const WriteBarrier &) = delete;
+
+public:
+    WriteBarrier &operator=(WriteBarrier &&)      = delete;
+    WriteBarrier &operator=(const WriteBarrier &) = delete;
+
+public:
+    static folly::SharedMutex &of(std::string_view path) {
+        static Stripe stripes[Stripes];
+
+        /* the mount name is the first component of the path */
+        auto beg = path.find_first_not_of('/');
+        auto end = beg == std::string_view::npos ? beg : path.find('/', beg);
+        auto key = beg == std::string_view::npos ? std::string_view() : path.substr(beg, end - beg);
+
+        /* find the stripe */
+        return stripes[std::hash<std::string_view>()(key) % Stripes].lock;
+    }
+};
+
+#endif /* SANDBOX_FS_WRITE_BARRIER_H */